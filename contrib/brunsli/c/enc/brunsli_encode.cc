@@ -64,8 +64,8 @@ size_t EstimateAuxDataSize(const JPEGData& jpg) {
   return size;
 }
 
-size_t GetMaximumBrunsliEncodedSize(const JPEGData& jpg) {
-  // Rough estimate is 1.2 * uncompressed size plus some more for the header.
+// Returns an upper bound on the size of all sections but the DC and AC data.
+size_t GetMaximumBrunsliHeaderSize(const JPEGData& jpg) {
   size_t hdr_size = 1 << 20;
   hdr_size += EstimateAuxDataSize(jpg);
   for (const std::string& data : jpg.app_data) {
@@ -75,7 +75,13 @@ size_t GetMaximumBrunsliEncodedSize(const JPEGData& jpg) {
     hdr_size += data.size();
   }
   hdr_size += jpg.tail_data.size();
-  return 1.2 * jpg.width * jpg.height * jpg.components.size() + hdr_size;
+  return hdr_size;
+}
+
+size_t GetMaximumBrunsliEncodedSize(const JPEGData& jpg) {
+  // Rough estimate is 1.2 * uncompressed size plus some more for the header.
+  return 1.2 * jpg.width * jpg.height * jpg.components.size() +
+         GetMaximumBrunsliHeaderSize(jpg);
 }
 
 size_t Base128Size(size_t val) {
@@ -591,7 +597,8 @@ DataStream::DataStream()
       low_(0),
       high_(~0),
       bw_val_(0),
-      bw_bitpos_(0) {}
+      bw_bitpos_(0),
+      ans_state_(0) {}
 
 void DataStream::Resize(int max_num_code_words) {
   code_words_.resize(max_num_code_words);
@@ -674,9 +681,26 @@ void DataStream::AddBit(Prob* const p, int bit) {
 }
 
 void DataStream::EncodeCodeWords(EntropyCodes* s, Storage* storage) {
+  FinishCodeWords(s);
+  // TODO: what about alignment and endianness?
+  uint16_t* out = reinterpret_cast<uint16_t*>(storage->data);
+  const uint16_t* out_start = out;
+  *(out++) = (ans_state_ >> 16) & 0xffff;
+  *(out++) = (ans_state_ >> 0) & 0xffff;
+  for (int i = 0; i < pos_; ++i) {
+    const CodeWord& word = code_words_[i];
+    if (word.nbits) {
+      *(out++) = word.value;
+    }
+  }
+  storage->pos += (out - out_start) * 16;
+}
+
+size_t DataStream::FinishCodeWords(EntropyCodes* s) {
   FlushBitWriter();
   FlushArithmeticCoder();
   ANSCoder ans;
+  size_t num_words = 2;
   for (int i = pos_ - 1; i >= 0; --i) {
     CodeWord* const word = &code_words_[i];
     if (word->nbits == 0) {
@@ -684,20 +708,34 @@ void DataStream::EncodeCodeWords(EntropyCodes* s, Storage* storage) {
           s->GetANSTable(word->context)->info_[word->code];
       word->value = ans.PutSymbol(info, &word->nbits);
     }
+    if (word->nbits) ++num_words;
   }
-  const uint32_t state = ans.GetState();
-  // TODO: what about alignment and endianness?
-  uint16_t* out = reinterpret_cast<uint16_t*>(storage->data);
-  const uint16_t* out_start = out;
-  *(out++) = (state >> 16) & 0xffff;
-  *(out++) = (state >> 0) & 0xffff;
+  ans_state_ = ans.GetState();
+  return num_words * sizeof(uint16_t);
+}
+
+bool DataStream::WriteCodeWords(JPEGOutput out) const {
+  // Same layout as EncodeCodeWords, written in chunks of kChunkWords.
+  static const size_t kChunkWords = 1 << 15;
+  std::vector<uint16_t> chunk(kChunkWords);
+  size_t n = 0;
+  chunk[n++] = (ans_state_ >> 16) & 0xffff;
+  chunk[n++] = (ans_state_ >> 0) & 0xffff;
   for (int i = 0; i < pos_; ++i) {
     const CodeWord& word = code_words_[i];
     if (word.nbits) {
-      *(out++) = word.value;
+      if (n == kChunkWords) {
+        if (!out.Write(reinterpret_cast<const uint8_t*>(chunk.data()),
+                       n * sizeof(uint16_t))) {
+          return false;
+        }
+        n = 0;
+      }
+      chunk[n++] = word.value;
     }
   }
-  storage->pos += (out - out_start) * 16;
+  return out.Write(reinterpret_cast<const uint8_t*>(chunk.data()),
+                   n * sizeof(uint16_t));
 }
 
 void EncodeNumNonzeros(int val, Prob* p, DataStream* data_stream) {
@@ -1311,8 +1349,11 @@ EntropyCodes PrepareEntropyCodes(State* state) {
   return state->entropy_source.Finish(group_context_offsets);
 }
 
-bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
-                      uint8_t* data, size_t* len) {
+// Writes the sections not in skip_sections to data[0 ... *len). The sizes of
+// the section size fields are chosen as if data had size_bound bytes.
+static bool BrunsliSerializeSections(State* state, const JPEGData& jpg,
+                                     uint32_t skip_sections, size_t size_bound,
+                                     uint8_t* data, size_t* len) {
   size_t pos = 0;
 
   // TODO: refactor to remove repetitive params.
@@ -1337,7 +1378,7 @@ bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
 
   if (!(skip_sections & (1u << kBrunsliMetaDataTag))) {
     ok = EncodeSection(jpg, state, kBrunsliMetaDataTag, EncodeMetaData,
-                       Base128Size(*len - pos), *len, data, &pos);
+                       Base128Size(size_bound - pos), *len, data, &pos);
     if (!ok) return false;
   }
 
@@ -1350,19 +1391,19 @@ bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
   if (!(skip_sections & (1u << kBrunsliHistogramDataTag))) {
     ok =
         EncodeSection(jpg, state, kBrunsliHistogramDataTag, EncodeHistogramData,
-                      Base128Size(*len - pos), *len, data, &pos);
+                      Base128Size(size_bound - pos), *len, data, &pos);
     if (!ok) return false;
   }
 
   if (!(skip_sections & (1u << kBrunsliDCDataTag))) {
     ok = EncodeSection(jpg, state, kBrunsliDCDataTag, EncodeDCData,
-                       Base128Size(*len - pos), *len, data, &pos);
+                       Base128Size(size_bound - pos), *len, data, &pos);
     if (!ok) return false;
   }
 
   if (!(skip_sections & (1u << kBrunsliACDataTag))) {
     ok = EncodeSection(jpg, state, kBrunsliACDataTag, EncodeACData,
-                       Base128Size(*len - pos), *len, data, &pos);
+                       Base128Size(size_bound - pos), *len, data, &pos);
     if (!ok) return false;
   }
 
@@ -1370,6 +1411,64 @@ bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
   return true;
 }
 
+bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
+                      uint8_t* data, size_t* len) {
+  return BrunsliSerializeSections(state, jpg, skip_sections, *len, data, len);
+}
+
+// Writes one of the DC and AC data sections to out. pos is the number of
+// bytes written so far and is updated.
+static bool WriteDataStreamSection(State* state, uint8_t tag,
+                                   DataStream* data_stream, size_t size_bound,
+                                   JPEGOutput out, size_t* pos) {
+  const size_t section_size_bytes = Base128Size(size_bound - *pos);
+  const size_t section_size = data_stream->FinishCodeWords(state->entropy_codes);
+  if (*pos + 1 + section_size_bytes + section_size > size_bound) {
+    return false;
+  }
+  if ((section_size >> (7 * section_size_bytes)) > 0) {
+    BRUNSLI_LOG_ERROR() << "Section 0x" << std::hex << SectionMarker(tag)
+                        << " size " << std::dec << section_size
+                        << " too large for " << section_size_bytes
+                        << " bytes base128 number." << BRUNSLI_ENDL();
+    return false;
+  }
+  uint8_t header[16];
+  header[0] = SectionMarker(tag);
+  EncodeBase128Fix(section_size, section_size_bytes, &header[1]);
+  if (!out.Write(header, 1 + section_size_bytes)) return false;
+  if (!data_stream->WriteCodeWords(out)) return false;
+  *pos += 1 + section_size_bytes + section_size;
+  return true;
+}
+
+bool BrunsliSerialize(State* state, const JPEGData& jpg, JPEGOutput out) {
+  // The section size fields are sized as if the output went to a buffer of
+  // GetMaximumBrunsliEncodedSize() bytes, so the output is the same as the
+  // one of BrunsliSerialize() above.
+  const size_t size_bound = GetMaximumBrunsliEncodedSize(jpg);
+  const uint32_t data_sections =
+      (1u << kBrunsliDCDataTag) | (1u << kBrunsliACDataTag);
+
+  // Everything but the DC and AC data goes through a buffer.
+  std::vector<uint8_t> head(
+      std::min(size_bound, GetMaximumBrunsliHeaderSize(jpg)));
+  size_t pos = head.size();
+  if (!BrunsliSerializeSections(state, jpg, data_sections, size_bound,
+                                head.data(), &pos)) {
+    return false;
+  }
+  if (!out.Write(head.data(), pos)) return false;
+
+  // The DC and AC data is written directly from the code words.
+  if (!WriteDataStreamSection(state, kBrunsliDCDataTag, &state->data_stream_dc,
+                              size_bound, out, &pos)) {
+    return false;
+  }
+  return WriteDataStreamSection(state, kBrunsliACDataTag,
+                                &state->data_stream_ac, size_bound, out, &pos);
+}
+
 }  // namespace enc
 }  // namespace internal
 
@@ -1377,7 +1476,9 @@ bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
  *
  * For "groups" workflow, few more stages are required, see comments.
  */
-bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len, bool use_brotli) {
+template <typename Serialize>
+static bool EncodeJpeg(const JPEGData& jpg, bool use_brotli,
+                       Serialize serialize) {
   State state;
   state.use_brotli = use_brotli;
 
@@ -1429,7 +1530,19 @@ bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len, bool use
   // Groups workflow: distribute codes.
 
   // Groups workflow: apply corresponding skip masks.
-  return BrunsliSerialize(&state, jpg, 0, data, len);
+  return serialize(&state);
+}
+
+bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len, bool use_brotli) {
+  return EncodeJpeg(jpg, use_brotli, [&](State* state) {
+    return BrunsliSerialize(state, jpg, 0, data, len);
+  });
+}
+
+bool BrunsliEncodeJpeg(const JPEGData& jpg, JPEGOutput out, bool use_brotli) {
+  return EncodeJpeg(jpg, use_brotli, [&](State* state) {
+    return BrunsliSerialize(state, jpg, out);
+  });
 }
 
 
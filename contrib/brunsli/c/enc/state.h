@@ -15,6 +15,7 @@
 
 #include "../common/distributions.h"
 #include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_writer.h>
 #include "../common/platform.h"
 #include <brunsli/types.h>
 #include "./ans_encode.h"
@@ -103,6 +104,10 @@ class DataStream {
   // probability, i.e. P(bit = 0) = prob / 256. Statistics are updated in 'p'.
   void AddBit(Prob* const p, int bit);
   void EncodeCodeWords(EntropyCodes* s, Storage* storage);
+  // EncodeCodeWords in two steps: the first one computes the ANS codes and
+  // returns the encoded size in bytes, the second one writes the data.
+  size_t FinishCodeWords(EntropyCodes* s);
+  bool WriteCodeWords(JPEGOutput out) const;
 
  private:
   struct CodeWord {
@@ -125,6 +130,7 @@ class DataStream {
   uint32_t high_;
   uint32_t bw_val_;
   int bw_bitpos_;
+  uint32_t ans_state_;
   std::vector<CodeWord> code_words_;
 };
 
@@ -150,6 +156,7 @@ void EncodeAC(State* state);
 EntropyCodes PrepareEntropyCodes(State* state);
 bool BrunsliSerialize(State* state, const JPEGData& jpg, uint32_t skip_sections,
                       uint8_t* data, size_t* len);
+bool BrunsliSerialize(State* state, const JPEGData& jpg, JPEGOutput out);
 
 }  // namespace enc
 }  // namespace internal
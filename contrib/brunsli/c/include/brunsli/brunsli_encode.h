@@ -11,6 +11,7 @@
 #define BRUNSLI_ENC_BRUNSLI_ENCODE_H_
 
 #include <brunsli/jpeg_data.h>
+#include <brunsli/jpeg_data_writer.h>
 #include <brunsli/types.h>
 
 namespace brunsli {
@@ -25,6 +26,12 @@ size_t GetMaximumBrunsliEncodedSize(const JPEGData& jpg);
 // jpg data.
 bool BrunsliEncodeJpeg(const JPEGData& jpg, uint8_t* data, size_t* len, bool use_brotli);
 
+// Encodes the given jpg in brunsli format and passes the encoded bytes to out
+// as they are produced, so no buffer of GetMaximumBrunsliEncodedSize() bytes
+// is needed. The output is identical to the one of the function above.
+// Returns false on output error or invalid jpg data.
+bool BrunsliEncodeJpeg(const JPEGData& jpg, JPEGOutput out, bool use_brotli);
+
 // Return the storage size needed to store raw jpg data in bypass mode.
 size_t GetBrunsliBypassSize(size_t jpg_size);
 
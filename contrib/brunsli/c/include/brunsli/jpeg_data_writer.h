@@ -22,7 +22,9 @@ typedef int (*JPEGOutputHook)(void* data, const uint8_t* buf, size_t len);
 struct JPEGOutput {
   JPEGOutput(JPEGOutputHook cb, void* data) : cb(cb), data(data) {}
   bool Write(const uint8_t* buf, size_t len) const {
-    return (len == 0) || (cb(data, buf, len) == len);
+    if (len == 0) return true;
+    const int written = cb(data, buf, len);
+    return (written >= 0) && (static_cast<size_t>(written) == len);
   }
 
  private:
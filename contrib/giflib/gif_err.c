@@ -15,8 +15,9 @@
 
 #include <stdio.h>
 #include "gif_lib.h"
+#include "gif_lib_private.h"
 
-int _GifError = 0;
+GIF_THREAD_LOCAL int _GifError = 0;
 
 /*****************************************************************************
  * Return the last GIF error (0 if none) and reset the error.             
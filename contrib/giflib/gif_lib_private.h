@@ -56,6 +56,13 @@ typedef struct GifFilePrivateType {
     int* CodeTable;
 } GifFilePrivateType;
 
-extern int _GifError;
+/* precomp recompresses GIF frames on several threads, so the error code is per thread */
+#if defined(_MSC_VER)
+#define GIF_THREAD_LOCAL __declspec(thread)
+#else
+#define GIF_THREAD_LOCAL __thread
+#endif
+
+extern GIF_THREAD_LOCAL int _GifError;
 
 #endif /* _GIF_LIB_PRIVATE_H */
@@ -1,3 +1,5 @@
+#define GIF_MAX_MEMORY_SIZE (512 * 1024 * 1024)
+
 const short InterlacedOffset[] = { 0, 4, 2, 1 }; /* The way Interlaced image should. */
 const short InterlacedJumps[] = { 8, 8, 4, 2 };    /* be read - offsets and jumps... */
 
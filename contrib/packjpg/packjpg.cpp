@@ -288,6 +288,9 @@ packJPG by Matthias Stirner, 01/2016
 #endif
 
 #define INTERN static
+// conversion state is kept per thread, so separate threads
+// can each convert a file at the same time
+#define INTERN_TLS static thread_local
 
 #define INIT_MODEL_S(a,b,c) new model_s( a, b, c, 255 )
 #define INIT_MODEL_B(a,b)   new model_b( a, b, 255 )
@@ -513,7 +516,7 @@ INTERN inline bool file_exists( const char* filename );
 // these are developers functions, they are not needed
 // in any way to compress jpg or decompress pjg
 #if !defined(BUILD_LIB) && defined(DEV_BUILD)
-INTERN int collmode = 0; // write mode for collections: 0 -> std, 1 -> dhf, 2 -> squ, 3 -> unc
+INTERN_TLS int collmode = 0; // write mode for collections: 0 -> std, 1 -> dhf, 2 -> squ, 3 -> unc
 INTERN bool dump_hdr( void );
 INTERN bool dump_huf( void );
 INTERN bool dump_coll( void );
@@ -530,8 +533,9 @@ INTERN bool dump_pgm( void );
 	global variables: library only variables
 	----------------------------------------------- */
 #if defined(BUILD_LIB)
-INTERN int lib_in_type  = -1;
-INTERN int lib_out_type = -1;
+INTERN_TLS int lib_in_type  = -1;
+INTERN_TLS int lib_out_type = -1;
+bool (*pjglib_abort_check)( void ) = NULL; // conversion is cancelled if this returns true
 #endif
 
 
@@ -539,39 +543,39 @@ INTERN int lib_out_type = -1;
 	global variables: data storage
 	----------------------------------------------- */
 
-INTERN unsigned short qtables[4][64];				// quantization tables
-INTERN huffCodes      hcodes[2][4];				// huffman codes
-INTERN huffTree       htrees[2][4];				// huffman decoding trees
-INTERN unsigned char  htset[2][4];					// 1 if huffman table is set
-
-INTERN unsigned char* grbgdata		   =   NULL;	// garbage data
-INTERN unsigned char* hdrdata          =   NULL;   // header data
-INTERN unsigned char* huffdata         =   NULL;   // huffman coded data
-INTERN int            hufs             =    0  ;   // size of huffman data
-INTERN int            hdrs             =    0  ;   // size of header
-INTERN int            grbs             =    0  ;   // size of garbage
-
-INTERN unsigned int*  rstp             =   NULL;   // restart markers positions in huffdata
-INTERN unsigned int*  scnp             =   NULL;   // scan start positions in huffdata
-INTERN int            rstc             =    0  ;   // count of restart markers
-INTERN int            scnc             =    0  ;   // count of scans
-INTERN int            rsti             =    0  ;   // restart interval
-INTERN char           padbit           =    -1 ;   // padbit (for huffman coding)
-INTERN unsigned char* rst_err          =   NULL;   // number of wrong-set RST markers per scan
-
-INTERN unsigned char* zdstdata[4]      = { NULL }; // zero distribution (# of non-zeroes) lists (for higher 7x7 block)
-INTERN unsigned char* eobxhigh[4]      = { NULL }; // eob in x direction (for higher 7x7 block)
-INTERN unsigned char* eobyhigh[4]      = { NULL }; // eob in y direction (for higher 7x7 block)
-INTERN unsigned char* zdstxlow[4]		= { NULL }; // # of non zeroes for first row
-INTERN unsigned char* zdstylow[4]		= { NULL }; // # of non zeroes for first collumn
-INTERN signed short*  colldata[4][64]  = {{NULL}}; // collection sorted DCT coefficients
-
-INTERN unsigned char* freqscan[4]      = { NULL }; // optimized order for frequency scans (only pointers to scans)
-INTERN unsigned char  zsrtscan[4][64];				// zero optimized frequency scan
-
-INTERN int adpt_idct_8x8[ 4 ][ 8 * 8 * 8 * 8 ];	// precalculated/adapted values for idct (8x8)
-INTERN int adpt_idct_1x8[ 4 ][ 1 * 1 * 8 * 8 ];	// precalculated/adapted values for idct (1x8)
-INTERN int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values for idct (8x1)
+INTERN_TLS unsigned short qtables[4][64];				// quantization tables
+INTERN_TLS huffCodes      hcodes[2][4];				// huffman codes
+INTERN_TLS huffTree       htrees[2][4];				// huffman decoding trees
+INTERN_TLS unsigned char  htset[2][4];					// 1 if huffman table is set
+
+INTERN_TLS unsigned char* grbgdata		   =   NULL;	// garbage data
+INTERN_TLS unsigned char* hdrdata          =   NULL;   // header data
+INTERN_TLS unsigned char* huffdata         =   NULL;   // huffman coded data
+INTERN_TLS int            hufs             =    0  ;   // size of huffman data
+INTERN_TLS int            hdrs             =    0  ;   // size of header
+INTERN_TLS int            grbs             =    0  ;   // size of garbage
+
+INTERN_TLS unsigned int*  rstp             =   NULL;   // restart markers positions in huffdata
+INTERN_TLS unsigned int*  scnp             =   NULL;   // scan start positions in huffdata
+INTERN_TLS int            rstc             =    0  ;   // count of restart markers
+INTERN_TLS int            scnc             =    0  ;   // count of scans
+INTERN_TLS int            rsti             =    0  ;   // restart interval
+INTERN_TLS char           padbit           =    -1 ;   // padbit (for huffman coding)
+INTERN_TLS unsigned char* rst_err          =   NULL;   // number of wrong-set RST markers per scan
+
+INTERN_TLS unsigned char* zdstdata[4]      = { NULL }; // zero distribution (# of non-zeroes) lists (for higher 7x7 block)
+INTERN_TLS unsigned char* eobxhigh[4]      = { NULL }; // eob in x direction (for higher 7x7 block)
+INTERN_TLS unsigned char* eobyhigh[4]      = { NULL }; // eob in y direction (for higher 7x7 block)
+INTERN_TLS unsigned char* zdstxlow[4]		= { NULL }; // # of non zeroes for first row
+INTERN_TLS unsigned char* zdstylow[4]		= { NULL }; // # of non zeroes for first collumn
+INTERN_TLS signed short*  colldata[4][64]  = {{NULL}}; // collection sorted DCT coefficients
+
+INTERN_TLS unsigned char* freqscan[4]      = { NULL }; // optimized order for frequency scans (only pointers to scans)
+INTERN_TLS unsigned char  zsrtscan[4][64];				// zero optimized frequency scan
+
+INTERN_TLS int adpt_idct_8x8[ 4 ][ 8 * 8 * 8 * 8 ];	// precalculated/adapted values for idct (8x8)
+INTERN_TLS int adpt_idct_1x8[ 4 ][ 1 * 1 * 8 * 8 ];	// precalculated/adapted values for idct (1x8)
+INTERN_TLS int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values for idct (8x1)
 
 
 /* -----------------------------------------------
@@ -579,64 +583,64 @@ INTERN int adpt_idct_8x1[ 4 ][ 8 * 8 * 1 * 1 ];	// precalculated/adapted values
 	----------------------------------------------- */
 
 // seperate info for each color component
-INTERN componentInfo cmpnfo[ 4 ];
+INTERN_TLS componentInfo cmpnfo[ 4 ];
 
-INTERN int cmpc        = 0; // component count
-INTERN int imgwidth    = 0; // width of image
-INTERN int imgheight   = 0; // height of image
+INTERN_TLS int cmpc        = 0; // component count
+INTERN_TLS int imgwidth    = 0; // width of image
+INTERN_TLS int imgheight   = 0; // height of image
 
-INTERN int sfhm        = 0; // max horizontal sample factor
-INTERN int sfvm        = 0; // max verical sample factor
-INTERN int mcuv        = 0; // mcus per line
-INTERN int mcuh        = 0; // mcus per collumn
-INTERN int mcuc        = 0; // count of mcus
+INTERN_TLS int sfhm        = 0; // max horizontal sample factor
+INTERN_TLS int sfvm        = 0; // max verical sample factor
+INTERN_TLS int mcuv        = 0; // mcus per line
+INTERN_TLS int mcuh        = 0; // mcus per collumn
+INTERN_TLS int mcuc        = 0; // count of mcus
 
 
 /* -----------------------------------------------
 	global variables: info about current scan
 	----------------------------------------------- */
 
-INTERN int cs_cmpc      =   0  ; // component count in current scan
-INTERN int cs_cmp[ 4 ]  = { 0 }; // component numbers  in current scan
-INTERN int cs_from      =   0  ; // begin - band of current scan ( inclusive )
-INTERN int cs_to        =   0  ; // end - band of current scan ( inclusive )
-INTERN int cs_sah       =   0  ; // successive approximation bit pos high
-INTERN int cs_sal       =   0  ; // successive approximation bit pos low
+INTERN_TLS int cs_cmpc      =   0  ; // component count in current scan
+INTERN_TLS int cs_cmp[ 4 ]  = { 0 }; // component numbers  in current scan
+INTERN_TLS int cs_from      =   0  ; // begin - band of current scan ( inclusive )
+INTERN_TLS int cs_to        =   0  ; // end - band of current scan ( inclusive )
+INTERN_TLS int cs_sah       =   0  ; // successive approximation bit pos high
+INTERN_TLS int cs_sal       =   0  ; // successive approximation bit pos low
 	
 
 /* -----------------------------------------------
 	global variables: info about files
 	----------------------------------------------- */
 	
-INTERN char*  jpgfilename = NULL;	// name of JPEG file
-INTERN char*  pjgfilename = NULL;	// name of PJG file
-INTERN int    jpgfilesize;			// size of JPEG file
-INTERN int    pjgfilesize;			// size of PJG file
-INTERN int    jpegtype = 0;			// type of JPEG coding: 0->unknown, 1->sequential, 2->progressive
-INTERN int    filetype;				// type of current file
-INTERN iostream* str_in  = NULL;	// input stream
-INTERN iostream* str_out = NULL;	// output stream
+INTERN_TLS char*  jpgfilename = NULL;	// name of JPEG file
+INTERN_TLS char*  pjgfilename = NULL;	// name of PJG file
+INTERN_TLS int    jpgfilesize;			// size of JPEG file
+INTERN_TLS int    pjgfilesize;			// size of PJG file
+INTERN_TLS int    jpegtype = 0;			// type of JPEG coding: 0->unknown, 1->sequential, 2->progressive
+INTERN_TLS int    filetype;				// type of current file
+INTERN_TLS iostream* str_in  = NULL;	// input stream
+INTERN_TLS iostream* str_out = NULL;	// output stream
 
 #if !defined(BUILD_LIB)
-INTERN iostream* str_str = NULL;	// storage stream
+INTERN_TLS iostream* str_str = NULL;	// storage stream
 
-INTERN char** filelist = NULL;		// list of files to process 
-INTERN int    file_cnt = 0;			// count of files in list
-INTERN int    file_no  = 0;			// number of current file
+INTERN_TLS char** filelist = NULL;		// list of files to process 
+INTERN_TLS int    file_cnt = 0;			// count of files in list
+INTERN_TLS int    file_no  = 0;			// number of current file
 
-INTERN char** err_list = NULL;		// list of error messages 
-INTERN int*   err_tp   = NULL;		// list of error types
+INTERN_TLS char** err_list = NULL;		// list of error messages 
+INTERN_TLS int*   err_tp   = NULL;		// list of error types
 #endif
 
 #if defined(DEV_INFOS)
-INTERN int    dev_size_hdr      = 0;
-INTERN int    dev_size_cmp[ 4 ] = { 0 };
-INTERN int    dev_size_zsr[ 4 ] = { 0 };
-INTERN int    dev_size_dc[ 4 ]  = { 0 };
-INTERN int    dev_size_ach[ 4 ] = { 0 };
-INTERN int    dev_size_acl[ 4 ] = { 0 };
-INTERN int    dev_size_zdh[ 4 ] = { 0 };
-INTERN int    dev_size_zdl[ 4 ] = { 0 };
+INTERN_TLS int    dev_size_hdr      = 0;
+INTERN_TLS int    dev_size_cmp[ 4 ] = { 0 };
+INTERN_TLS int    dev_size_zsr[ 4 ] = { 0 };
+INTERN_TLS int    dev_size_dc[ 4 ]  = { 0 };
+INTERN_TLS int    dev_size_ach[ 4 ] = { 0 };
+INTERN_TLS int    dev_size_acl[ 4 ] = { 0 };
+INTERN_TLS int    dev_size_zdh[ 4 ] = { 0 };
+INTERN_TLS int    dev_size_zdl[ 4 ] = { 0 };
 #endif
 
 
@@ -644,9 +648,9 @@ INTERN int    dev_size_zdl[ 4 ] = { 0 };
 	global variables: messages
 	----------------------------------------------- */
 
-INTERN char errormessage [ MSG_SIZE ];
-INTERN bool (*errorfunction)();
-INTERN int  errorlevel;
+INTERN_TLS char errormessage [ MSG_SIZE ];
+INTERN_TLS bool (*errorfunction)();
+INTERN_TLS int  errorlevel;
 // meaning of errorlevel:
 // -1 -> wrong input
 // 0 -> no error
@@ -659,30 +663,30 @@ INTERN int  errorlevel;
 	----------------------------------------------- */
 
 #if !defined( BUILD_LIB )
-INTERN int  verbosity  = -1;	// level of verbosity
-INTERN bool overwrite  = false;	// overwrite files yes / no
-INTERN bool wait_exit  = true;	// pause after finished yes / no
-INTERN int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN bool disc_meta  = false;	// discard meta-info yes / no
-
-INTERN bool developer  = false;	// allow developers functions yes/no
-INTERN bool auto_set   = true;	// automatic find best settings yes/no
-INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
-
-INTERN FILE*  msgout   = stdout;// stream for output of messages
-INTERN bool   pipe_on  = false;	// use stdin/stdout instead of filelist
+INTERN_TLS int  verbosity  = -1;	// level of verbosity
+INTERN_TLS bool overwrite  = false;	// overwrite files yes / no
+INTERN_TLS bool wait_exit  = true;	// pause after finished yes / no
+INTERN_TLS int  verify_lv  = 0;		// verification level ( none (0), simple (1), detailed output (2) )
+INTERN_TLS int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+INTERN_TLS bool disc_meta  = false;	// discard meta-info yes / no
+
+INTERN_TLS bool developer  = false;	// allow developers functions yes/no
+INTERN_TLS bool auto_set   = true;	// automatic find best settings yes/no
+INTERN_TLS int  action = A_COMPRESS;// what to do with JPEG/PJG files
+
+INTERN_TLS FILE*  msgout   = stdout;// stream for output of messages
+INTERN_TLS bool   pipe_on  = false;	// use stdin/stdout instead of filelist
 #else
-INTERN int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN bool disc_meta  = false;	// discard meta-info yes / no
-INTERN bool auto_set   = true;	// automatic find best settings yes/no
-INTERN int  action = A_COMPRESS;// what to do with JPEG/PJG files
+INTERN_TLS int  err_tol    = 1;		// error threshold ( proceed on warnings yes (2) / no (1) )
+INTERN_TLS bool disc_meta  = false;	// discard meta-info yes / no
+INTERN_TLS bool auto_set   = true;	// automatic find best settings yes/no
+INTERN_TLS int  action = A_COMPRESS;// what to do with JPEG/PJG files
 #endif
 
-INTERN unsigned char nois_trs[ 4 ] = {6,6,6,6}; // bit pattern noise threshold
-INTERN unsigned char segm_cnt[ 4 ] = {10,10,10,10}; // number of segments
+INTERN_TLS unsigned char nois_trs[ 4 ] = {6,6,6,6}; // bit pattern noise threshold
+INTERN_TLS unsigned char segm_cnt[ 4 ] = {10,10,10,10}; // number of segments
 #if !defined( BUILD_LIB )
-INTERN unsigned char orig_set[ 8 ] = { 0 }; // store array for settings
+INTERN_TLS unsigned char orig_set[ 8 ] = { 0 }; // store array for settings
 #endif
 
 
@@ -938,6 +942,10 @@ EXPORT bool pjglib_convert_stream2mem( unsigned char** out_file, unsigned int* o
 			}
 		}
 		if ( msg != NULL ) strcpy( msg, errormessage );
+		free( jpgfilename );
+		jpgfilename = NULL;
+		free( pjgfilename );
+		pjgfilename = NULL;
 		return false;
 	}
 	
@@ -963,6 +971,12 @@ EXPORT bool pjglib_convert_stream2mem( unsigned char** out_file, unsigned int* o
 		}
 	}
 	
+	// free memory from filenames, the state is per thread and
+	// would otherwise be left behind when a worker thread exits
+	free( jpgfilename );
+	jpgfilename = NULL;
+	free( pjgfilename );
+	pjgfilename = NULL;
 	
 	return true;
 }
@@ -1069,7 +1083,7 @@ EXPORT void pjglib_init_streams( void* in_src, int in_type, int in_size, void* o
 #if defined(BUILD_LIB)
 EXPORT const char* pjglib_version_info( void )
 {
-	static char v_info[ 256 ];
+	static thread_local char v_info[ 256 ];
 	
 	// copy version info to string
 	sprintf( v_info, "--> %s library v%i.%i%s (%s) by %s <--",
@@ -1087,7 +1101,7 @@ EXPORT const char* pjglib_version_info( void )
 #if defined(BUILD_LIB)
 EXPORT const char* pjglib_short_name( void )
 {
-	static char v_name[ 256 ];
+	static thread_local char v_name[ 256 ];
 	
 	// copy version info to string
 	sprintf( v_name, "%s v%i.%i%s",
@@ -1740,6 +1754,14 @@ INTERN void execute( bool (*function)() )
 			if ( verbosity == 2 ) fprintf( msgout,  "%8s", "ERROR" );
 		}
 		#else
+		// check if the caller wants to cancel the conversion
+		if ( ( pjglib_abort_check != NULL ) && ( *pjglib_abort_check )() ) {
+			sprintf( errormessage, "conversion aborted" );
+			errorlevel = 2;
+			errorfunction = function;
+			return;
+		}
+		
 		// call function
 		( *function )();
 		
@@ -2415,6 +2437,16 @@ INTERN bool decode_jpeg( void )
 	// JPEG decompression loop
 	while ( true )
 	{
+		#if defined(BUILD_LIB)
+		// progressive JPEGs can have lots of scans, check for cancellation
+		if ( ( pjglib_abort_check != NULL ) && ( *pjglib_abort_check )() ) {
+			sprintf( errormessage, "conversion aborted" );
+			errorlevel = 2;
+			delete huffr;
+			return false;
+		}
+		#endif
+		
 		// seek till start-of-scan, parse only DHT, DRI and SOS
 		for ( type = 0x00; type != 0xDA; ) {
 			if ( ( int ) hpos >= hdrs ) break;
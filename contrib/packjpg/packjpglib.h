@@ -16,6 +16,10 @@ EXPORT void pjglib_init_streams( void* in_src, int in_type, int in_size, void* o
 EXPORT const char* pjglib_version_info( void );
 EXPORT const char* pjglib_short_name( void );
 
+/* optional callback, checked between conversion steps: if it returns
+   true, the conversion is aborted with an error */
+extern bool (*pjglib_abort_check)( void );
+
 /* a short reminder about input/output stream types
    for the pjglib_init_streams() function
 	
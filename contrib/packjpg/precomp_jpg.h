@@ -41,6 +41,9 @@ bool pjglib_convert_file2file( char* in, char* out, char* msg );
 void pjglib_init_streams( void* in_src, int in_type, int in_size, void* out_dest, int out_type );
 bool pjglib_convert_stream2mem( unsigned char** out_file, unsigned int* out_size, char* msg );
 
+// if set, this is checked during conversion, returning true aborts it
+extern bool (*pjglib_abort_check)( void );
+
 // this function writes versioninfo for the packJPG
 // DLL to a string
 const char* pjglib_version_info( void );
\ No newline at end of file
@@ -18,6 +18,9 @@
 #endif
 
 #define INTERN static
+// conversion state is kept per thread, so separate threads
+// can each convert a file at the same time
+#define INTERN_TLS static thread_local
 
 #define INIT_MODEL_S(a,b,c) new model_s( a, b, c, 511 )
 #define INIT_MODEL_B(a,b)   new model_b( a, b, 511 )
@@ -183,8 +186,9 @@ INTERN bool dump_decoded_data( void );
 	global variables: library only variables
 	----------------------------------------------- */
 #if defined(BUILD_LIB)
-INTERN int lib_in_type  = -1;
-INTERN int lib_out_type = -1;
+INTERN_TLS int lib_in_type  = -1;
+INTERN_TLS int lib_out_type = -1;
+bool (*pmplib_abort_check)( void ) = NULL; // conversion is cancelled if this returns true
 #endif
 
 
@@ -192,79 +196,79 @@ INTERN int lib_out_type = -1;
 	global variables: data storage
 	----------------------------------------------- */
 
-INTERN mp3Frame*      firstframe		=	NULL;	// first physical frame
-INTERN mp3Frame*      lastframe		=	NULL;	// last physical frame
-INTERN unsigned char* main_data		=	NULL;	// (mainly) huffman coded data
-INTERN unsigned char* data_before		=	NULL;	// data before (should be ID3v2 tag)
-INTERN unsigned char* data_after		=	NULL;	// data after (should be ID3v1 or ID3v2 tag)
-INTERN unsigned char* unmute_data		=	NULL;	// fix data (to reverse muted frames)
-INTERN int            main_data_size	=     0 ;	// size of main data
-INTERN int            data_before_size =     0 ;	// size of data before
-INTERN int            data_after_size  =     0 ;   // size of data after
-INTERN int            unmute_data_size =     0 ;   // size of fix data
-INTERN int            n_bad_first      =     0 ;   // # of bad first frames (should be zero!)
-INTERN unsigned char* gg_context[2]	= {NULL};	// universal context based on global gain
+INTERN_TLS mp3Frame*      firstframe		=	NULL;	// first physical frame
+INTERN_TLS mp3Frame*      lastframe		=	NULL;	// last physical frame
+INTERN_TLS unsigned char* main_data		=	NULL;	// (mainly) huffman coded data
+INTERN_TLS unsigned char* data_before		=	NULL;	// data before (should be ID3v2 tag)
+INTERN_TLS unsigned char* data_after		=	NULL;	// data after (should be ID3v1 or ID3v2 tag)
+INTERN_TLS unsigned char* unmute_data		=	NULL;	// fix data (to reverse muted frames)
+INTERN_TLS int            main_data_size	=     0 ;	// size of main data
+INTERN_TLS int            data_before_size =     0 ;	// size of data before
+INTERN_TLS int            data_after_size  =     0 ;   // size of data after
+INTERN_TLS int            unmute_data_size =     0 ;   // size of fix data
+INTERN_TLS int            n_bad_first      =     0 ;   // # of bad first frames (should be zero!)
+INTERN_TLS unsigned char* gg_context[2]	= {NULL};	// universal context based on global gain
 
 /* -----------------------------------------------
 	global variables: info about audio file
 	----------------------------------------------- */
 
-INTERN int  g_nframes     =   0;  // number of frames
-INTERN int  g_nchannels   =   0;  // number of channels
-INTERN int  g_samplerate  =   0;  // sample rate
-INTERN int  g_bitrate     =   0;  // bit rate - global or zero for vbr
+INTERN_TLS int  g_nframes     =   0;  // number of frames
+INTERN_TLS int  g_nchannels   =   0;  // number of channels
+INTERN_TLS int  g_samplerate  =   0;  // sample rate
+INTERN_TLS int  g_bitrate     =   0;  // bit rate - global or zero for vbr
 
 
 /* -----------------------------------------------
 	global variables: frame analysis info
 	----------------------------------------------- */
 
-INTERN char i_mpeg			= -1; // mpeg - non changing
-INTERN char i_layer			= -1; // layer - non changing
-INTERN char i_samplerate	= -1; // sample rate - non changing
-INTERN char i_bitrate		= -1; // bit rate - value or -1 (variable)
-INTERN char i_protection	= -1; // checksum - for all (1), none (0) or some (-1) frames
-INTERN char i_padding		= -1; // padding - for all (1), none (0) or some (-1) frames
-INTERN char i_privbit		= -1; // private bit - value or -1 (variable)
-INTERN char i_channels		= -1; // channel mode - non changing
-INTERN char i_stereo_ms		= -1; // ms stereo - for all (1), none (0) or some (-1) frames
-INTERN char i_stereo_int	= -1; // int stereo - for all (1), none (0) or some (-1) frames
-INTERN char i_copyright		= -1; // copyright bit - value or -1 (variable)
-INTERN char i_original		= -1; // original bit - value or -1 (variable)
-INTERN char i_emphasis		= -1; // emphasis - value or -1 (variable)
-INTERN char i_padbits		= -1; // side info padding bits - value or -1 (variable)
-INTERN char i_bit_res		= -1; // bit reservoir - is used (1) or not used (0)
-INTERN char i_share			= -1; // scalefactor sharing - is used (1) or not used (0)
-INTERN char i_sblocks		= -1; // special blocks - are used (1) or not used (0)
-INTERN char i_mixed			= -1; // mixed blocks - are used (1) or not used (0)
-INTERN char i_preemphasis	= -1; // preemphasis - value or -1 (variable)
-INTERN char i_coarse		= -1; // coarse scalefactors - value or -1 (variable)
-INTERN char i_sbgain		= -1; // subblock gain - used properly (1), not used (0) or used for non-short (-1)
-INTERN char i_aux_h			= -1; // auxiliary data handling - none (0), at begin and end (1), between frames (-1)
-INTERN char i_sb_diff		= -1; // special blocks diffs between ch0 and ch1 - none (0) or some (-1)
+INTERN_TLS char i_mpeg			= -1; // mpeg - non changing
+INTERN_TLS char i_layer			= -1; // layer - non changing
+INTERN_TLS char i_samplerate	= -1; // sample rate - non changing
+INTERN_TLS char i_bitrate		= -1; // bit rate - value or -1 (variable)
+INTERN_TLS char i_protection	= -1; // checksum - for all (1), none (0) or some (-1) frames
+INTERN_TLS char i_padding		= -1; // padding - for all (1), none (0) or some (-1) frames
+INTERN_TLS char i_privbit		= -1; // private bit - value or -1 (variable)
+INTERN_TLS char i_channels		= -1; // channel mode - non changing
+INTERN_TLS char i_stereo_ms		= -1; // ms stereo - for all (1), none (0) or some (-1) frames
+INTERN_TLS char i_stereo_int	= -1; // int stereo - for all (1), none (0) or some (-1) frames
+INTERN_TLS char i_copyright		= -1; // copyright bit - value or -1 (variable)
+INTERN_TLS char i_original		= -1; // original bit - value or -1 (variable)
+INTERN_TLS char i_emphasis		= -1; // emphasis - value or -1 (variable)
+INTERN_TLS char i_padbits		= -1; // side info padding bits - value or -1 (variable)
+INTERN_TLS char i_bit_res		= -1; // bit reservoir - is used (1) or not used (0)
+INTERN_TLS char i_share			= -1; // scalefactor sharing - is used (1) or not used (0)
+INTERN_TLS char i_sblocks		= -1; // special blocks - are used (1) or not used (0)
+INTERN_TLS char i_mixed			= -1; // mixed blocks - are used (1) or not used (0)
+INTERN_TLS char i_preemphasis	= -1; // preemphasis - value or -1 (variable)
+INTERN_TLS char i_coarse		= -1; // coarse scalefactors - value or -1 (variable)
+INTERN_TLS char i_sbgain		= -1; // subblock gain - used properly (1), not used (0) or used for non-short (-1)
+INTERN_TLS char i_aux_h			= -1; // auxiliary data handling - none (0), at begin and end (1), between frames (-1)
+INTERN_TLS char i_sb_diff		= -1; // special blocks diffs between ch0 and ch1 - none (0) or some (-1)
 	
 
 /* -----------------------------------------------
 	global variables: info about files
 	----------------------------------------------- */
 	
-INTERN char*  mp3filename = NULL;	// name of MP3 file
-INTERN char*  pmpfilename = NULL;	// name of PMP file
-INTERN int    mp3filesize;			// size of MP3 file
-INTERN int    pmpfilesize;			// size of PMP file
-INTERN int    filetype;				// type of current file
-INTERN iostream* str_in  = NULL;	// input stream
-INTERN iostream* str_out = NULL;	// output stream
+INTERN_TLS char*  mp3filename = NULL;	// name of MP3 file
+INTERN_TLS char*  pmpfilename = NULL;	// name of PMP file
+INTERN_TLS int    mp3filesize;			// size of MP3 file
+INTERN_TLS int    pmpfilesize;			// size of PMP file
+INTERN_TLS int    filetype;				// type of current file
+INTERN_TLS iostream* str_in  = NULL;	// input stream
+INTERN_TLS iostream* str_out = NULL;	// output stream
 
 #if !defined(BUILD_LIB)
-INTERN iostream* str_str = NULL;	// storage stream
+INTERN_TLS iostream* str_str = NULL;	// storage stream
 
-INTERN char** filelist = NULL;		// list of files to process 
-INTERN int    file_cnt = 0;			// count of files in list
-INTERN int    file_no  = 0;			// number of current file
+INTERN_TLS char** filelist = NULL;		// list of files to process 
+INTERN_TLS int    file_cnt = 0;			// count of files in list
+INTERN_TLS int    file_no  = 0;			// number of current file
 
-INTERN char** err_list = NULL;		// list of error messages 
-INTERN int*   err_tp   = NULL;		// list of error types
+INTERN_TLS char** err_list = NULL;		// list of error messages 
+INTERN_TLS int*   err_tp   = NULL;		// list of error types
 #endif
 
 
@@ -272,9 +276,9 @@ INTERN int*   err_tp   = NULL;		// list of error types
 	global variables: messages
 	----------------------------------------------- */
 
-INTERN char errormessage [ 128 ];
-INTERN bool (*errorfunction)();
-INTERN int  errorlevel;
+INTERN_TLS char errormessage [ 128 ];
+INTERN_TLS bool (*errorfunction)();
+INTERN_TLS int  errorlevel;
 // meaning of errorlevel:
 // -1 -> wrong input
 // 0 -> no error
@@ -287,20 +291,20 @@ INTERN int  errorlevel;
 	----------------------------------------------- */
 
 #if !defined( BUILD_LIB )
-INTERN int  verbosity  = -1;		// level of verbosity
-INTERN bool overwrite  = false;		// overwrite files yes / no
-INTERN bool wait_exit  = true;		// pause after finished yes / no
-INTERN int  verify_lv  = 0;			// verification level ( none (0), simple (1), detailed output (2) )
-INTERN int  err_tol    = 1;			// error threshold ( proceed on warnings yes (2) / no (1) )
+INTERN_TLS int  verbosity  = -1;		// level of verbosity
+INTERN_TLS bool overwrite  = false;		// overwrite files yes / no
+INTERN_TLS bool wait_exit  = true;		// pause after finished yes / no
+INTERN_TLS int  verify_lv  = 0;			// verification level ( none (0), simple (1), detailed output (2) )
+INTERN_TLS int  err_tol    = 1;			// error threshold ( proceed on warnings yes (2) / no (1) )
 
-INTERN bool developer  = false;		// allow developers functions yes/no
-INTERN int  action     = A_COMPRESS;// what to do with MP3/PMP files
+INTERN_TLS bool developer  = false;		// allow developers functions yes/no
+INTERN_TLS int  action     = A_COMPRESS;// what to do with MP3/PMP files
 
-INTERN FILE*  msgout   = stdout;	// stream for output of messages
-INTERN bool   pipe_on  = false;		// use stdin/stdout instead of filelist
+INTERN_TLS FILE*  msgout   = stdout;	// stream for output of messages
+INTERN_TLS bool   pipe_on  = false;		// use stdin/stdout instead of filelist
 #else
-INTERN int  err_tol    = 1;			// error threshold ( proceed on warnings yes (2) / no (1) )
-INTERN int  action     = A_COMPRESS;// what to do with MP3/PMP files
+INTERN_TLS int  err_tol    = 1;			// error threshold ( proceed on warnings yes (2) / no (1) )
+INTERN_TLS int  action     = A_COMPRESS;// what to do with MP3/PMP files
 #endif
 
 
@@ -522,6 +526,10 @@ EXPORT bool pmplib_convert_stream2mem( unsigned char** out_file, unsigned int* o
 			}
 		}
 		if ( msg != NULL ) strcpy( msg, errormessage );
+		free( mp3filename );
+		mp3filename = NULL;
+		free( pmpfilename );
+		pmpfilename = NULL;
 		return false;
 	}
 	
@@ -547,6 +555,12 @@ EXPORT bool pmplib_convert_stream2mem( unsigned char** out_file, unsigned int* o
 		}
 	}
 	
+	// free memory from filenames, the state is per thread and
+	// would otherwise be left behind when a worker thread exits
+	free( mp3filename );
+	mp3filename = NULL;
+	free( pmpfilename );
+	pmpfilename = NULL;
 	
 	return true;
 }
@@ -608,8 +622,10 @@ EXPORT void pmplib_init_streams( void* in_src, int in_type, int in_size, void* o
 	}
 	
 	// free memory from filenames if needed
-	if ( mp3filename != NULL ) free( mp3filename ); mp3filename = NULL;
-	if ( pmpfilename != NULL ) free( pmpfilename ); pmpfilename = NULL;
+	free( mp3filename );
+	mp3filename = NULL;
+	free( pmpfilename );
+	pmpfilename = NULL;
 	
 	// check input stream
 	str_in->read( buffer, 1, 2 );
@@ -646,7 +662,7 @@ EXPORT void pmplib_init_streams( void* in_src, int in_type, int in_size, void* o
 #if defined(BUILD_LIB)
 EXPORT const char* pmplib_version_info( void )
 {
-	static char v_info[ 256 ];
+	static thread_local char v_info[ 256 ];
 	
 	// copy version info to string
 	sprintf( v_info, "--> %s library v%i.%i%s (%s) by %s <--",
@@ -664,7 +680,7 @@ EXPORT const char* pmplib_version_info( void )
 #if defined(BUILD_LIB)
 EXPORT const char* pmplib_short_name( void )
 {
-	static char v_name[ 256 ];
+	static thread_local char v_name[ 256 ];
 	
 	// copy version info to string
 	sprintf( v_name, "%s v%i.%i%s",
@@ -1249,6 +1265,14 @@ INTERN void execute( bool (*function)() )
 			if ( verbosity == 2 ) fprintf( msgout,  "%8s", "ERROR" );
 		}
 		#else
+		// check if the caller wants to cancel the conversion
+		if ( ( pmplib_abort_check != NULL ) && ( *pmplib_abort_check )() ) {
+			sprintf( errormessage, "conversion aborted" );
+			errorlevel = 2;
+			errorfunction = function;
+			return;
+		}
+		
 		// call function
 		( *function )();
 		
@@ -1284,8 +1308,10 @@ INTERN bool check_file( void )
 	}
 	
 	// free memory from filenames if needed
-	if ( mp3filename != NULL ) free( mp3filename ); mp3filename = NULL;
-	if ( pmpfilename != NULL ) free( pmpfilename ); pmpfilename = NULL;
+	free( mp3filename );
+	mp3filename = NULL;
+	free( pmpfilename );
+	pmpfilename = NULL;
 	
 	// immediately return error if 2 bytes can't be read
 	if ( str_in->read( fileid, 1, 2 ) != 2 ) { 
@@ -2441,8 +2467,8 @@ INTERN inline mp3Frame* mp3_build_frame( void )
 	----------------------------------------------- */
 INTERN inline bool mp3_append_frame( mp3Frame* frame )
 {
-	static granuleInfo* lastgranule[2] = { NULL, NULL };
-	static int n = 0;
+	static thread_local granuleInfo* lastgranule[2] = { NULL, NULL };
+	static thread_local int n = 0;
 	int ch;
 	
 	
@@ -2637,7 +2663,7 @@ INTERN inline bool mp3_unmute_frame( mp3Frame* frame )
 	----------------------------------------------- */
 INTERN inline unsigned char* mp3_build_fixed( mp3Frame* frame )
 {
-	static unsigned char* fixed = ( unsigned char* ) calloc( 64, 1 );
+	static thread_local unsigned char fixed[ 64 ];
 	unsigned char* tmp_ptr;
 	
 	granuleInfo* granule;
@@ -2902,7 +2928,11 @@ INTERN inline unsigned short mp3_calc_layer3_crc( unsigned char* header, unsigne
 INTERN inline granuleData*** mp3_decode_frame( huffman_reader* dec, mp3Frame* frame )
 {
 	// storage
-	static granuleData*** frame_data = NULL;
+	static thread_local unsigned char frame_scalefactors[ 2 ][ 2 ][ 36 ];
+	static thread_local signed short frame_coefficients[ 2 ][ 2 ][ 578 ];
+	static thread_local granuleData frame_granules[ 2 ][ 2 ];
+	static thread_local granuleData* frame_granule_ptrs[ 2 ][ 2 ];
+	static thread_local granuleData** frame_data[ 2 ] = { NULL, NULL };
 	granuleInfo* granule;
 	signed short* coefs;
 	unsigned char* scfs;
@@ -2928,16 +2958,15 @@ INTERN inline granuleData*** mp3_decode_frame( huffman_reader* dec, mp3Frame* fr
 	
 	
 	
-	// alloc mem for frame data if not done before
-	// no need to free this memory again!
-	if ( frame_data == NULL ) {
-		frame_data = ( granuleData*** ) calloc( 2, sizeof( granuleData** ) );
+	// link the fixed size frame data storage if not done before,
+	// it is thread local and goes away with its thread, no free needed
+	if ( frame_data[ 0 ] == NULL ) {
 		for ( ch = 0; ch < 2; ch++ ) {
-			frame_data[ ch ] = ( granuleData** ) calloc( 2, sizeof( granuleData* ) );
+			frame_data[ ch ] = frame_granule_ptrs[ ch ];
 			for ( gr = 0; gr < 2; gr++ ) {
-				frame_data[ ch ][ gr ] = ( granuleData* ) calloc( 1, sizeof( granuleData ) );
-				frame_data[ ch ][ gr ]->scalefactors = ( unsigned char* ) calloc( 36, sizeof( char ) );
-				frame_data[ ch ][ gr ]->coefficients = ( signed short* ) calloc( 578, sizeof( short ) );
+				frame_granules[ ch ][ gr ].scalefactors = frame_scalefactors[ ch ][ gr ];
+				frame_granules[ ch ][ gr ].coefficients = frame_coefficients[ ch ][ gr ];
+				frame_data[ ch ][ gr ] = &frame_granules[ ch ][ gr ];
 			}
 		}
 	}
@@ -4457,7 +4486,7 @@ INTERN inline bool pmp_encode_main_data( aricoder* enc )
 	// -> encode using main size prediction as context
 	
 	// context / storage
-	static unsigned char* pad_and_aux= ( unsigned char* ) calloc( 2048, 1 ); // !!! (length)
+	static thread_local unsigned char pad_and_aux[ 2048 ]; // !!! (length)
 	mp3Frame* frame;
 	granuleInfo* granule;
 	unsigned char* scf_c[2];
@@ -5109,7 +5138,7 @@ INTERN inline bool pmp_encode_main_data( aricoder* enc )
 INTERN inline bool pmp_decode_main_data( aricoder* dec )
 {
 	// context / storage
-	static unsigned char* pad_and_aux= ( unsigned char* ) calloc( 2048, 1 );
+	static thread_local unsigned char pad_and_aux[ 2048 ];
 	mp3Frame* frame;
 	granuleInfo* granule;
 	unsigned char* scf_c[2];
@@ -5891,15 +5920,15 @@ INTERN inline bool pmp_build_context( void )
 	----------------------------------------------- */
 INTERN inline unsigned char* pmp_predict_lame_anc( int nbits, unsigned char* ref )
 {
-	static unsigned char* pred = (unsigned char*) calloc( 2048, sizeof( char ) );
-	static unsigned char* lame_str = (unsigned char*) calloc( 4 + 16, sizeof( char ) ); // !!!
+	static thread_local unsigned char pred[ 2048 ];
+	static thread_local unsigned char lame_str[ 4 + 16 ]; // !!!
 	const unsigned char b01 = 0x55;
 	const unsigned char b10 = 0xAA;
 	const unsigned char b00 = 0x00;
 	const unsigned char b11 = 0xFF;
-	static int lame_str_len = 4;
-	static int lame_bit = 0;
-	static bool alt_pred = 0;
+	static thread_local int lame_str_len = 4;
+	static thread_local int lame_bit = 0;
+	static thread_local bool alt_pred = 0;
 	int offset;
 	int nbytes;
 	int i;
@@ -6680,7 +6709,7 @@ INTERN bool visualize_headers( void )
 {
 	static const int img_width = 1280; // must be divisible by 2
 	static const bool inc_all = false;
-	static unsigned char* line = (unsigned char*) calloc ( img_width, sizeof( char ) );
+	static thread_local unsigned char* line = (unsigned char*) calloc ( img_width, sizeof( char ) );
 	mp3Frame* frame;
 	mp3Frame* frame0 = firstframe;
 	mp3Frame* frame1 = firstframe;
@@ -16,6 +16,10 @@ EXPORT void pmplib_init_streams( void* in_src, int in_type, int in_size, void* o
 EXPORT const char* pmplib_version_info( void );
 EXPORT const char* pmplib_short_name( void );
 
+/* optional callback, checked between conversion steps: if it returns
+   true, the conversion is aborted with an error */
+extern bool (*pmplib_abort_check)( void );
+
 /* a short reminder about input/output stream types
    for the pmplib_init_streams() function
 	
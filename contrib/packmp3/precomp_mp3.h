@@ -12,5 +12,8 @@ bool pmplib_convert_file2file( char* in, char* out, char* msg );
 void pmplib_init_streams( void* in_src, int in_type, int in_size, void* out_dest, int out_type );
 bool pmplib_convert_stream2mem( unsigned char** out_file, unsigned int* out_size, char* msg );
 
+// if set, this is checked during conversion, returning true aborts it
+extern bool (*pmplib_abort_check)( void );
+
 // this function writes versioninfo for the packMP3 DLL to a string
 const char* pmplib_version_info( void );
@@ -13,6 +13,7 @@
    limitations under the License. */
 
 #include <algorithm>
+#include <chrono>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
@@ -23,6 +24,7 @@
 #include "preflate_decoder.h"
 #include "preflate_info.h"
 #include "preflate_reencoder.h"
+#include "support/byte_compare.h"
 #include "support/support_tests.h"
 
 bool loadfile(
@@ -125,6 +127,48 @@ int combine(const char* const * const fns, const unsigned fncnt, const std::stri
   return ok ? 0 : -1;
 }
 
+// times the match length kernels on all positions of the file against a
+// few typical match distances, limited to the deflate maximum match length
+int benchmark(const char* const * const fns, const unsigned fncnt) {
+  static const unsigned dists[] = {1, 2, 4, 8, 64, 1024, 32768};
+  bool ok = true;
+  for (unsigned i = 0; i < fncnt; ++i) {
+    std::vector<unsigned char> content;
+    if (!loadfile(content, fns[i])) {
+      printf("loading of %s failed\n", fns[i]);
+      ok = false;
+      continue;
+    }
+    printf("benchmarking %s (%d bytes, active kernel: %s)\n", fns[i], (int)content.size(),
+           byteCompareKernelName(byteCompareActiveKernel()));
+    uint64_t reference = 0;
+    for (int k = 0; k < BYTE_COMPARE_KERNEL_COUNT; ++k) {
+      ByteCompareFunc cmp = byteCompareKernelFunc((ByteCompareKernel)k);
+      if (!cmp) {
+        continue;
+      }
+      const unsigned char* data = content.data();
+      unsigned size = content.size();
+      uint64_t total = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (unsigned d = 0; d < sizeof(dists) / sizeof(dists[0]); ++d) {
+        for (unsigned pos = dists[d]; pos < size; ++pos) {
+          total += cmp(data + pos - dists[d], data + pos, std::min(size - pos, 258u));
+        }
+      }
+      auto end = std::chrono::steady_clock::now();
+      if (k == BYTE_COMPARE_BYTEWISE) {
+        reference = total;
+      } else if (total != reference) {
+        printf("  %-8s mismatch\n", byteCompareKernelName((ByteCompareKernel)k));
+        ok = false;
+      }
+      printf("  %-8s %8.2f ms (%llu matched bytes)\n", byteCompareKernelName((ByteCompareKernel)k),
+             std::chrono::duration<double, std::milli>(end - start).count(), (unsigned long long)total);
+    }
+  }
+  return ok ? 0 : -1;
+}
 
 #include "preflate_seq_chain.h"
 int main(int argc, const char * const * const argv) {
@@ -166,6 +210,9 @@ static const char* const def_fns[] = {
     if (argc >= 3 && !strcmp(argv[1], "-x")) {
       return combine(argv + 2, argc - 2, ".x");
     }
+    if (argc >= 3 && !strcmp(argv[1], "-b")) {
+      return benchmark(argv + 2, argc - 2);
+    }
   }
   printf("usage: %s -t FILE [FILE ... FILE]\n", argv[0]);
   printf("       test uncompression and recompression\n");
@@ -177,5 +224,7 @@ static const char* const def_fns[] = {
   printf("       info (FILE.r) into deflate stream (FILE)\n");
   printf("       %s -x FILE [FILE ... FILE]\n", argv[0]);
   printf("       recombines into FILE.x instead of FILE\n");
+  printf("       %s -b FILE [FILE ... FILE]\n", argv[0]);
+  printf("       benchmark match length kernels on FILE\n");
   return -1;
 }
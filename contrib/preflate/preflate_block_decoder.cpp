@@ -25,7 +25,8 @@ PreflateBlockDecoder::PreflateBlockDecoder(
   , _output(output)
   , _errorCode(OK)
   , _dynamicLitLenDecoder(nullptr, 0, false, 0)
-  , _dynamicDistDecoder(nullptr, 0, false, 0) {
+  , _dynamicDistDecoder(nullptr, 0, false, 0)
+  , _literalPairsDecoder(nullptr) {
 }
 
 bool PreflateBlockDecoder::_error(const ErrorCode code) {
@@ -70,11 +71,27 @@ bool PreflateBlockDecoder::readBlock(PreflateTokenBlock &block, bool &last) {
         return false;
       }
     }
+    _setupLiteralPairs();
     while (true) {
       if (_input.eof()) {
         return false;
       }
-      unsigned litLen = _litLenDecoder->decode(_input);
+      const LiteralPair& pair = _literalPairs[_input.peek(LITERAL_PAIR_BITS)];
+      unsigned litLen;
+      if (pair.count == 2) {
+        _input.skip(pair.bits);
+        _writeLiterals(pair.symbol, pair.literal2);
+        block.tokens.push_back(PreflateToken(PreflateToken::LITERAL));
+        block.tokens.push_back(PreflateToken(PreflateToken::LITERAL));
+        curPos += 2;
+        continue;
+      }
+      if (pair.count == 1) {
+        _input.skip(pair.bits);
+        litLen = pair.symbol;
+      } else {
+        litLen = _litLenDecoder->decode(_input);
+      }
       if (litLen < 256) {
         _writeLiteral(litLen);
         block.tokens.push_back(PreflateToken(PreflateToken::LITERAL));
@@ -116,6 +133,30 @@ void PreflateBlockDecoder::_setupStaticTables() {
   _distDecoder = PreflateBlockTrees::staticDistTreeDecoder();
 }
 
+void PreflateBlockDecoder::_setupLiteralPairs() {
+  // the static tree is shared, so its table survives between blocks
+  if (_literalPairsDecoder == _litLenDecoder) {
+    return;
+  }
+  _literalPairsDecoder = _litLenDecoder;
+  for (unsigned i = 0; i < (1 << LITERAL_PAIR_BITS); ++i) {
+    LiteralPair& pair = _literalPairs[i];
+    unsigned symbol = 0, symbol2 = 0;
+    unsigned bits = _litLenDecoder->peekSymbol(i, LITERAL_PAIR_BITS, symbol);
+    pair.count = bits ? 1 : 0;
+    pair.symbol = symbol;
+    pair.bits = bits;
+    if (bits && symbol < 256) {
+      unsigned bits2 = _litLenDecoder->peekSymbol(i >> bits, LITERAL_PAIR_BITS - bits, symbol2);
+      if (bits2 && symbol2 < 256) {
+        pair.count = 2;
+        pair.literal2 = symbol2;
+        pair.bits = bits + bits2;
+      }
+    }
+  }
+}
+
 bool PreflateBlockDecoder::_readDynamicTables(PreflateTokenBlock& block) {
   block.nlen = PreflateConstants::NONLEN_CODE_COUNT + _readBits(5);
   block.ndist = 1 + _readBits(5);
@@ -182,6 +223,7 @@ bool PreflateBlockDecoder::_readDynamicTables(PreflateTokenBlock& block) {
     return false;
   }
   _litLenDecoder = &_dynamicLitLenDecoder;
+  _literalPairsDecoder = nullptr;
 
   _dynamicDistDecoder = HuffmanDecoder(ldBitLengths + block.nlen, block.ndist, true, 15);
   if (_dynamicDistDecoder.error()) {
@@ -55,20 +55,26 @@ private:
     return _input.checkLastBitsOfByteAreZero();
   }
   void _writeLiteral(const unsigned char l) {
-    _output.write(&l, 1);
+    _output.writeByte(l);
+  }
+  void _writeLiterals(const unsigned char l1, const unsigned char l2) {
+    _output.writeByte(l1);
+    _output.writeByte(l2);
   }
   void _writeReference(const size_t dist, const size_t len) {
     _output.reserve(len);
-    if (len <= dist) {
-      _output.write(_output.cacheEnd() - dist, len);
-    } else {
-      const uint8_t* ptr = _output.cacheEnd() - dist;
-      for (size_t i = 0; i < len; ++i) {
-        _output.write(&ptr[i], 1);
-      }
+    // overlapping references repeat the last dist bytes; any multiple
+    // of dist is an equally valid period, so the copied chunk doubles
+    size_t period = dist, left = len;
+    while (left > period) {
+      _output.write(_output.cacheEnd() - period, period);
+      left -= period;
+      period += period;
     }
+    _output.write(_output.cacheEnd() - period, left);
   }
   void _setupStaticTables();
+  void _setupLiteralPairs();
   bool _readDynamicTables(PreflateTokenBlock&);
 
   BitInputStream& _input;
@@ -78,6 +84,20 @@ private:
   const HuffmanDecoder* _distDecoder;
   HuffmanDecoder _dynamicLitLenDecoder;
   HuffmanDecoder _dynamicDistDecoder;
+
+  // Multi-symbol lookup for the literal/length tree: one peek of
+  // LITERAL_PAIR_BITS resolves up to two literals whose codes fit in
+  // together, or a single symbol with a short code. count == 0 means
+  // the code is longer and the regular decoder is used.
+  enum { LITERAL_PAIR_BITS = 11 };
+  struct LiteralPair {
+    unsigned short symbol;
+    unsigned char literal2;
+    unsigned char bits;
+    unsigned char count;
+  };
+  LiteralPair _literalPairs[1 << LITERAL_PAIR_BITS];
+  const HuffmanDecoder* _literalPairsDecoder;
 };
 
 #endif /* PREFLATE_BLOCK_DECODER_H */
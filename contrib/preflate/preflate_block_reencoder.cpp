@@ -27,7 +27,8 @@ PreflateBlockReencoder::PreflateBlockReencoder(
   , _uncompressedDataPos(uncompressedOffset)
   , _errorCode(OK)
   , _dynamicLitLenEncoder(nullptr, 0, false)
-  , _dynamicDistEncoder(nullptr, 0, false) {
+  , _dynamicDistEncoder(nullptr, 0, false)
+  , _lengthCodesEncoder(nullptr) {
 }
 
 bool PreflateBlockReencoder::_error(const ErrorCode code) {
@@ -105,6 +106,7 @@ bool PreflateBlockReencoder::_buildAndWriteDynamicTables(const PreflateTokenBloc
     return _error(BAD_LD_TREE);
   }
   _litLenEncoder = &_dynamicLitLenEncoder;
+  _lengthCodesEncoder = nullptr;
 
   _dynamicDistEncoder = HuffmanEncoder(ldBitLengths + block.nlen, block.ndist, true);
   if (_dynamicDistEncoder.error()) {
@@ -114,34 +116,58 @@ bool PreflateBlockReencoder::_buildAndWriteDynamicTables(const PreflateTokenBloc
   return true;
 }
 
+void PreflateBlockReencoder::_setupLengthCodes() {
+  // the static tree is shared, so its table survives between blocks
+  if (_lengthCodesEncoder == _litLenEncoder) {
+    return;
+  }
+  _lengthCodesEncoder = _litLenEncoder;
+  for (unsigned len = PreflateConstants::MIN_MATCH; len <= PreflateConstants::MAX_MATCH + 1; ++len) {
+    unsigned lencode, extra, extraBits;
+    if (len > PreflateConstants::MAX_MATCH) {
+      lencode = PreflateConstants::LEN_CODE_COUNT - 2;
+      extra = 31;
+      extraBits = 5;
+    } else {
+      lencode = PreflateConstants::LCode(len);
+      extra = len - PreflateConstants::MIN_MATCH - PreflateConstants::lengthBaseTable[lencode];
+      extraBits = PreflateConstants::lengthExtraTable[lencode];
+    }
+    unsigned symbol = PreflateConstants::NONLEN_CODE_COUNT + lencode;
+    unsigned v = symbol < _litLenEncoder->symbolCount() ? _litLenEncoder->packedCode(symbol) : 0;
+    unsigned codeBits = v & 0x1f;
+    _lengthCodes[len] = (((v >> 5) | (extra << codeBits)) << 5) | (codeBits + extraBits);
+  }
+}
+
 bool PreflateBlockReencoder::_writeTokens(const std::vector<PreflateToken>& tokens) {
-  for (size_t i = 0; i < tokens.size(); ++i) {
+  _setupLengthCodes();
+  const unsigned char* data = _uncompressedData.data();
+  const size_t dataSize = _uncompressedData.size();
+  for (size_t i = 0, n = tokens.size(); i < n; ++i) {
     PreflateToken token = tokens[i];
     if (token.len == 1) {
-      if (_uncompressedDataPos >= _uncompressedData.size()) {
+      if (_uncompressedDataPos >= dataSize) {
         return _error(LITERAL_OUT_OF_BOUNDS);
       }
-      unsigned char literal = _uncompressedData[_uncompressedDataPos++];
-      _litLenEncoder->encode(_output, literal);
-    } else {
-      // handle irregular length of 258
-      if (token.irregular258) {
-        _litLenEncoder->encode(_output, PreflateConstants::LITLEN_CODE_COUNT - 2);
-        _output.put(31, 5);
+      unsigned v = _litLenEncoder->packedCode(data[_uncompressedDataPos++]);
+      // two literal codes take at most 30 bits, so they go out together
+      if (i + 1 < n && tokens[i + 1].len == 1 && _uncompressedDataPos < dataSize) {
+        unsigned v2 = _litLenEncoder->packedCode(data[_uncompressedDataPos++]);
+        _output.put((v >> 5) | ((size_t)(v2 >> 5) << (v & 0x1f)), (v & 0x1f) + (v2 & 0x1f));
+        ++i;
       } else {
-        unsigned lencode = PreflateConstants::LCode(token.len);
-        _litLenEncoder->encode(_output, PreflateConstants::NONLEN_CODE_COUNT + lencode);
-        unsigned lenextra = PreflateConstants::lengthExtraTable[lencode];
-        if (lenextra) {
-          _output.put(token.len - PreflateConstants::MIN_MATCH - PreflateConstants::lengthBaseTable[lencode], lenextra);
-        }
+        _output.put(v >> 5, v & 0x1f);
       }
+    } else {
+      // handle irregular length of 258
+      unsigned l = _lengthCodes[token.irregular258 ? PreflateConstants::MAX_MATCH + 1 : token.len];
+      _output.put(l >> 5, l & 0x1f);
       unsigned distcode = PreflateConstants::DCode(token.dist);
-      _distEncoder->encode(_output, distcode);
+      unsigned d = _distEncoder->packedCode(distcode);
       unsigned distextra = PreflateConstants::distExtraTable[distcode];
-      if (distextra) {
-        _output.put(token.dist - 1 - PreflateConstants::distBaseTable[distcode], distextra);
-      }
+      unsigned distvalue = token.dist - 1 - PreflateConstants::distBaseTable[distcode];
+      _output.put((d >> 5) | (distvalue << (d & 0x1f)), (d & 0x1f) + distextra);
       _uncompressedDataPos += token.len;
     }
   }
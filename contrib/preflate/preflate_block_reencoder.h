@@ -61,6 +61,7 @@ private:
 
   void _setupStaticTables();
   bool _buildAndWriteDynamicTables(const PreflateTokenBlock&);
+  void _setupLengthCodes();
   bool _writeTokens(const std::vector<PreflateToken>& tokens);
 
   BitOutputStream& _output;
@@ -72,6 +73,12 @@ private:
   const HuffmanEncoder* _distEncoder;
   HuffmanEncoder _dynamicLitLenEncoder;
   HuffmanEncoder _dynamicDistEncoder;
+
+  // Length code and extra bits of every match length, merged into one
+  // packed code (see HuffmanEncoder::packedCode) for the current tree.
+  // Index MAX_MATCH + 1 holds the irregular encoding of 258.
+  unsigned _lengthCodes[PreflateConstants::MAX_MATCH + 2];
+  const HuffmanEncoder* _lengthCodesEncoder;
 };
 
 #endif /* PREFLATE_BLOCK_REENCODER_H */
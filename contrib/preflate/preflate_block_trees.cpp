@@ -16,11 +16,6 @@
 #include "preflate_block_trees.h"
 #include "support/bit_helper.h"
 
-static HuffmanDecoder* staticLitLenDecoder;
-static HuffmanDecoder* staticDistDecoder;
-static HuffmanEncoder* staticLitLenEncoder;
-static HuffmanEncoder* staticDistEncoder;
-
 static void setLitLenBitLengths(unsigned char(&a)[288]) {
   std::fill(a +   0, a + 144, 8);
   std::fill(a + 144, a + 256, 9);
@@ -31,35 +26,42 @@ static void setDistBitLengths(unsigned char(&a)[32]) {
   std::fill(a, a + 32, 5);
 }
 
+// The static trees are built on first use; function-local statics keep that
+// safe when several threads decode or reencode at the same time
+static HuffmanDecoder* newStaticLitLenDecoder() {
+  unsigned char l_lengths[288];
+  setLitLenBitLengths(l_lengths);
+  return new HuffmanDecoder(l_lengths, 288, true, 15);
+}
+static HuffmanDecoder* newStaticDistDecoder() {
+  unsigned char d_lengths[32];
+  setDistBitLengths(d_lengths);
+  return new HuffmanDecoder(d_lengths, 32, true, 15);
+}
+static HuffmanEncoder* newStaticLitLenEncoder() {
+  unsigned char l_lengths[288];
+  setLitLenBitLengths(l_lengths);
+  return new HuffmanEncoder(l_lengths, 288, true);
+}
+static HuffmanEncoder* newStaticDistEncoder() {
+  unsigned char d_lengths[32];
+  setDistBitLengths(d_lengths);
+  return new HuffmanEncoder(d_lengths, 32, true);
+}
+
 const HuffmanDecoder* PreflateBlockTrees::staticLitLenTreeDecoder() {
-  if (!staticLitLenDecoder) {
-    unsigned char l_lengths[288];
-    setLitLenBitLengths(l_lengths);
-    staticLitLenDecoder = new HuffmanDecoder(l_lengths, 288, true, 15);
-  }
-  return staticLitLenDecoder;
+  static const HuffmanDecoder* decoder = newStaticLitLenDecoder();
+  return decoder;
 }
 const HuffmanDecoder* PreflateBlockTrees::staticDistTreeDecoder() {
-  if (!staticDistDecoder) {
-    unsigned char d_lengths[32];
-    setDistBitLengths(d_lengths);
-    staticDistDecoder = new HuffmanDecoder(d_lengths, 32, true, 15);
-  }
-  return staticDistDecoder;
+  static const HuffmanDecoder* decoder = newStaticDistDecoder();
+  return decoder;
 }
 const HuffmanEncoder* PreflateBlockTrees::staticLitLenTreeEncoder() {
-  if (!staticLitLenEncoder) {
-    unsigned char l_lengths[288];
-    setLitLenBitLengths(l_lengths);
-    staticLitLenEncoder = new HuffmanEncoder(l_lengths, 288, true);
-  }
-  return staticLitLenEncoder;
+  static const HuffmanEncoder* encoder = newStaticLitLenEncoder();
+  return encoder;
 }
 const HuffmanEncoder* PreflateBlockTrees::staticDistTreeEncoder() {
-  if (!staticDistEncoder) {
-    unsigned char d_lengths[32];
-    setDistBitLengths(d_lengths);
-    staticDistEncoder = new HuffmanEncoder(d_lengths, 32, true);
-  }
-  return staticDistEncoder;
+  static const HuffmanEncoder* encoder = newStaticDistEncoder();
+  return encoder;
 }
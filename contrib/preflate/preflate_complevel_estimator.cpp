@@ -20,13 +20,10 @@
 PreflateCompLevelEstimatorState::PreflateCompLevelEstimatorState(
     const int wbits,
     const int mbits,
-    const std::vector<unsigned char>& unpacked_output_,
+    const PreflateInput& unpacked_output_,
     const size_t off0_,
     const std::vector<PreflateTokenBlock>& blocks_)
   : slowHash(unpacked_output_, mbits)
-  , fastL1Hash(unpacked_output_, mbits)
-  , fastL2Hash(unpacked_output_, mbits)
-  , fastL3Hash(unpacked_output_, mbits)
   , blocks(blocks_)
   , wsize(1 << wbits)
   , off0(off0_)
@@ -36,38 +33,37 @@ PreflateCompLevelEstimatorState::PreflateCompLevelEstimatorState(
   updateHash(off0);
 }
 
-void PreflateCompLevelEstimatorState::updateHash(const unsigned len) {
-  if (info.possibleCompressionLevels & (1 << 1)) {
-    fastL1Hash.updateHash(len);
-  }
-  if (info.possibleCompressionLevels & (1 << 2)) {
-    fastL2Hash.updateHash(len);
-  }
-  if (info.possibleCompressionLevels & (1 << 3)) {
-    fastL3Hash.updateHash(len);
+void PreflateCompLevelEstimatorState::ruleOutLevel(const unsigned level) {
+  info.possibleCompressionLevels &= ~(1 << level);
+  if (level >= 1 && level <= 3) {
+    fastHash[level - 1].reset();
   }
-  slowHash.updateHash(len);
 }
-void PreflateCompLevelEstimatorState::updateOrSkipSingleFastHash(
-    PreflateHashChainExt& hash,
-    const unsigned len,
-    const PreflateParserConfig& config) {
-  if (len <= config.max_lazy) {
-    hash.updateHash(len);
-  } else {
-    hash.skipHash(len);
+
+void PreflateCompLevelEstimatorState::updateHash(const unsigned len) {
+  for (unsigned i = 0; i < 3; ++i) {
+    if (fastHash[i]) {
+      fastHash[i]->updateHash(len);
+    }
   }
+  slowHash.updateHash(len);
 }
 
 void PreflateCompLevelEstimatorState::updateOrSkipHash(const unsigned len) {
-  if (info.possibleCompressionLevels & (1 << 1)) {
-    updateOrSkipSingleFastHash(fastL1Hash, len, fastPreflateParserSettings[0]);
-  }
-  if (info.possibleCompressionLevels & (1 << 2)) {
-    updateOrSkipSingleFastHash(fastL2Hash, len, fastPreflateParserSettings[1]);
-  }
-  if (info.possibleCompressionLevels & (1 << 3)) {
-    updateOrSkipSingleFastHash(fastL3Hash, len, fastPreflateParserSettings[2]);
+  for (unsigned i = 0; i < 3; ++i) {
+    if (!(info.possibleCompressionLevels & (1 << (1 + i)))) {
+      continue;
+    }
+    if (len <= fastPreflateParserSettings[i].max_lazy) {
+      if (fastHash[i]) {
+        fastHash[i]->updateHash(len);
+      }
+      continue;
+    }
+    if (!fastHash[i]) {
+      fastHash[i].reset(new PreflateHashChainExt(slowHash));
+    }
+    fastHash[i]->skipHash(len);
   }
   slowHash.updateHash(len);
 }
@@ -89,33 +85,16 @@ unsigned short PreflateCompLevelEstimatorState::matchDepth(
 }
 
 
-bool PreflateCompLevelEstimatorState::checkMatchSingleFastHash(
-    const PreflateToken& token,
-    const PreflateHashChainExt& hash, 
-    const PreflateParserConfig& config,
-    const unsigned hashHead) {
-  unsigned mdepth = matchDepth(hash.getHead(hashHead), token, hash);
-  if (mdepth > config.max_chain) {
-    return false;
-  }
-  return true;
-}
 void PreflateCompLevelEstimatorState::checkMatch(const PreflateToken& token) {
   unsigned hashHead = slowHash.curHash();
   if (slowHash.input().pos() >= token.dist + off0) {
-    if (info.possibleCompressionLevels & (1 << 1)) {
-      if (!checkMatchSingleFastHash(token, fastL1Hash, fastPreflateParserSettings[0], hashHead)) {
-        info.possibleCompressionLevels &= ~(1 << 1);
+    for (unsigned i = 0; i < 3; ++i) {
+      if (!(info.possibleCompressionLevels & (1 << (1 + i)))) {
+        continue;
       }
-    }
-    if (info.possibleCompressionLevels & (1 << 2)) {
-      if (!checkMatchSingleFastHash(token, fastL2Hash, fastPreflateParserSettings[1], hashHead)) {
-        info.possibleCompressionLevels &= ~(1 << 2);
-      }
-    }
-    if (info.possibleCompressionLevels & (1 << 3)) {
-      if (!checkMatchSingleFastHash(token, fastL3Hash, fastPreflateParserSettings[2], hashHead)) {
-        info.possibleCompressionLevels &= ~(1 << 3);
+      const PreflateHashChainExt& hash = fastLevelHash(i);
+      if (matchDepth(hash.getHead(hashHead), token, hash) > fastPreflateParserSettings[i].max_chain) {
+        ruleOutLevel(1 + i);
       }
     }
   }
@@ -147,7 +126,7 @@ void PreflateCompLevelEstimatorState::checkMatch(const PreflateToken& token) {
         }
         const PreflateParserConfig& config = slowPreflateParserSettings[i];
         if (mdepth > config.max_chain) {
-          info.possibleCompressionLevels &= ~(1 << (4 + i));
+          ruleOutLevel(4 + i);
         }
       }
     }
@@ -210,7 +189,7 @@ void PreflateCompLevelEstimatorState::recommend() {
 PreflateCompLevelInfo estimatePreflateCompLevel(
     const int wbits, 
     const int mbits,
-    const std::vector<unsigned char>& unpacked_output,
+    const PreflateInput& unpacked_output,
     const size_t off0,
     const std::vector<PreflateTokenBlock>& blocks,
     const bool early_out) {
@@ -15,6 +15,7 @@
 #ifndef PREFLATE_COMPLEVEL_ESTIMATOR_H
 #define PREFLATE_COMPLEVEL_ESTIMATOR_H
 
+#include <memory>
 #include "preflate_predictor_state.h"
 #include "preflate_token.h"
 
@@ -36,16 +37,18 @@ struct PreflateCompLevelInfo {
 
 struct PreflateCompLevelEstimatorState {
   PreflateHashChainExt slowHash;
-  PreflateHashChainExt fastL1Hash;
-  PreflateHashChainExt fastL2Hash;
-  PreflateHashChainExt fastL3Hash;
+  // Levels 1-3 see the same chain as slowHash until their first match
+  // longer than max_lazy, which they skip instead of inserting. Only
+  // then do they get a chain of their own, and it is dropped again
+  // once the level is ruled out
+  std::unique_ptr<PreflateHashChainExt> fastHash[3];
   const std::vector<PreflateTokenBlock>& blocks;
   PreflateCompLevelInfo info;
   uint16_t wsize;
   size_t off0;
 
   PreflateCompLevelEstimatorState(const int wbits, const int mbits,
-                                  const std::vector<unsigned char>& unpacked_output,
+                                  const PreflateInput& unpacked_output,
                                   const size_t off0,
                                   const std::vector<PreflateTokenBlock>& blocks);
   void updateHash(const unsigned len);
@@ -55,9 +58,10 @@ struct PreflateCompLevelEstimatorState {
   void recommend();
 
 private:
-  void updateOrSkipSingleFastHash(PreflateHashChainExt&, const unsigned len, const PreflateParserConfig&);
-  bool checkMatchSingleFastHash(const PreflateToken& token, const PreflateHashChainExt&, const PreflateParserConfig&,
-                                const unsigned hashHead);
+  const PreflateHashChainExt& fastLevelHash(const unsigned i) const {
+    return fastHash[i] ? *fastHash[i] : slowHash;
+  }
+  void ruleOutLevel(const unsigned level);
   uint16_t matchDepth(const unsigned hashHead, const PreflateToken& targetReference,
                       const PreflateHashChainExt& hash);
   unsigned windowSize() const {
@@ -68,7 +72,7 @@ private:
 PreflateCompLevelInfo estimatePreflateCompLevel(
     const int wbits, 
     const int mbits,
-    const std::vector<unsigned char>& unpacked_output,
+    const PreflateInput& unpacked_output,
     const size_t off0,
     const std::vector<PreflateTokenBlock>& blocks,
     const bool early_out);
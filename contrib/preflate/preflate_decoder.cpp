@@ -36,6 +36,9 @@ public:
   bool error() const {
     return encoder.error();
   }
+  size_t reconDataSize() const {
+    return encoder.reconDataSize();
+  }
 
   virtual uint32_t setModel(const PreflateStatisticsCounter& counters, const PreflateParameters& parameters) {
     return encoder.addModel(counters, parameters);
@@ -60,30 +63,39 @@ private:
 PreflateDecoderTask::PreflateDecoderTask(PreflateDecoderTask::Handler& handler_,
                                          const uint32_t metaBlockId_,
                                          std::vector<PreflateTokenBlock>&& tokenData_,
-                                         std::vector<uint8_t>&& uncompressedData_,
+                                         const std::shared_ptr<const std::vector<uint8_t>>& uncompressedBuffer_,
+                                         const uint8_t* uncompressedData_,
+                                         const size_t uncompressedSize_,
                                          const size_t uncompressedOffset_,
                                          const bool lastMetaBlock_,
                                          const uint32_t paddingBits_)
   : handler(handler_)
   , metaBlockId(metaBlockId_)
-  , tokenData(tokenData_)
+  , tokenData(std::move(tokenData_))
+  , uncompressedBuffer(uncompressedBuffer_)
   , uncompressedData(uncompressedData_)
+  , uncompressedSize(uncompressedSize_)
   , uncompressedOffset(uncompressedOffset_)
   , lastMetaBlock(lastMetaBlock_)
   , paddingBits(paddingBits_) {
 }
 
 bool PreflateDecoderTask::analyze() {
-  params = estimatePreflateParameters(uncompressedData, uncompressedOffset, tokenData);
+  PreflateInput input(uncompressedData, uncompressedSize);
+  params = estimatePreflateParameters(input, uncompressedOffset, tokenData);
   memset(&counter, 0, sizeof(counter));
-  tokenPredictor.reset(new PreflateTokenPredictor(params, uncompressedData, uncompressedOffset));
-  treePredictor.reset(new PreflateTreePredictor(uncompressedData, uncompressedOffset));
+  tokenPredictor.reset(new PreflateTokenPredictor(params, input, uncompressedOffset));
+  treePredictor.reset(new PreflateTreePredictor(input, uncompressedOffset));
   for (unsigned i = 0, n = tokenData.size(); i < n; ++i) {
     tokenPredictor->analyzeBlock(i, tokenData[i]);
     treePredictor->analyzeBlock(i, tokenData[i]);
     if (tokenPredictor->predictionFailure || treePredictor->predictionFailure) {
       return false;
     }
+    // encoding only needs the analysis results, so queued tasks
+    // don't keep the tokens around until it's their turn
+    std::vector<PreflateToken>().swap(tokenData[i].tokens);
+    std::vector<unsigned char>().swap(tokenData[i].treecodes);
     tokenPredictor->updateCounters(&counter, i);
     treePredictor->updateCounters(&counter, i);
     handler.markProgress();
@@ -118,7 +130,25 @@ bool PreflateDecoderTask::encode() {
       }
     }
   }
-  return handler.endEncoding(metaBlockId, pcodec, uncompressedData.size() - uncompressedOffset);
+  return handler.endEncoding(metaBlockId, pcodec, uncompressedSize - uncompressedOffset);
+}
+
+size_t preflate_adaptive_meta_block_size(const uint64_t expectedSize) {
+  const size_t minSize = 1 << 18, maxSize = 1 << 24;
+  // splitting only pays off when the meta blocks can be processed in parallel
+  if (globalTaskPool.extraThreadCount() == 0) {
+    return PREFLATE_DEFAULT_META_BLOCK_SIZE;
+  }
+  // about two meta blocks per thread keep all of them busy; every block
+  // beyond that only adds another model to the reconstruction data
+  size_t threads = globalTaskPool.extraThreadCount() + 1;
+  uint64_t size = expectedSize / (2 * threads);
+  // the tasks in flight (up to two per extra thread, each holding up to
+  // 1.5 meta blocks) must fit the memory limit of the task pool
+  size_t extraThreads = std::max<size_t>(globalTaskPool.extraThreadCount(), 1);
+  size_t memorySize = globalTaskPool.queueMemoryLimit() / (3 * extraThreads);
+  size = std::min<uint64_t>(size, std::min(memorySize, maxSize));
+  return (size_t)std::max<uint64_t>(size, minSize);
 }
 
 bool preflate_decode(OutputStream& unpacked_output,
@@ -127,7 +157,10 @@ bool preflate_decode(OutputStream& unpacked_output,
                      InputStream& deflate_raw,
                      std::function<void(void)> block_callback,
                      const size_t min_deflate_size,
-                     const size_t metaBlockSize) {
+                     const size_t metaBlockSize,
+                     std::function<bool(void)> abort_callback,
+                     const PreflateDecodeLimits& limits,
+                     const uint64_t expectedSize) {
   deflate_size = 0;
   uint64_t deflate_bits = 0;
   size_t prevBitPos = 0;
@@ -144,17 +177,43 @@ bool preflate_decode(OutputStream& unpacked_output,
   uint64_t sumBlockSizes = 0;
   uint64_t lastEndPos = 0;
   uint64_t uncompressedMetaStart = 0;
-  size_t MBSize = std::min<size_t>(std::max<size_t>(metaBlockSize, 1u << 18), (1u << 31) - 1);
+  // meta block sizes are stored in the reconstruction data, so they
+  // can change from one meta block to the next
+  const bool adaptiveMBSize = metaBlockSize == 0;
+  size_t MBSize = adaptiveMBSize ? preflate_adaptive_meta_block_size(expectedSize)
+                : std::min<size_t>(std::max<size_t>(metaBlockSize, 1u << 18), (1u << 31) - 1);
   size_t MBThreshold = (MBSize * 3) >> 1;
   PreflateDecoderHandler encoder(block_callback);
   size_t MBcount = 0;
 
+  uint64_t storedSize = 0, totalSize = 0;
+  // check if the stream is still worth the effort, judging from what was seen so far
+  auto unprofitable = [&]() {
+    uint64_t deflateSize = (deflate_bits + 7) >> 3;
+    if (deflateSize < limits.checkAfter) {
+      return false;
+    }
+    if (limits.maxStoredPercent > 0 && storedSize * 100 > totalSize * limits.maxStoredPercent) {
+      return true;
+    }
+    if (limits.maxReconPercent > 0 && encoder.reconDataSize() * 100 > deflateSize * limits.maxReconPercent) {
+      return true;
+    }
+    return false;
+  };
+
   std::queue<std::future<std::shared_ptr<PreflateDecoderTask>>> futureQueue;
-  size_t queueLimit = std::min(2 * globalTaskPool.extraThreadCount(), (1 << 26) / MBThreshold);
+  size_t queueLimit = std::min(2 * globalTaskPool.extraThreadCount(), globalTaskPool.queueMemoryLimit() / MBThreshold);
   bool fail = false;
 
+  // blocks are decoded into one reused token buffer and copied out at their
+  // final size, so the blocks of a meta block carry no growth slack
+  std::vector<PreflateToken> tokenBuffer;
+
   do {
     PreflateTokenBlock newBlock;
+    newBlock.tokens.swap(tokenBuffer);
+    newBlock.tokens.clear();
 
     bool ok = bdec.readBlock(newBlock, last);
     if (!ok) {
@@ -170,15 +229,45 @@ bool preflate_decode(OutputStream& unpacked_output,
       break;
     }
 
-    blocks.push_back(newBlock);
+    if (newBlock.type == PreflateTokenBlock::STORED) {
+      storedSize += blockSize;
+    }
+    totalSize += blockSize;
+    tokenBuffer.swap(newBlock.tokens);
+    newBlock.tokens.assign(tokenBuffer.begin(), tokenBuffer.end());
+    blocks.push_back(std::move(newBlock));
     blockSizes.push_back(blockSize);
     ++i;
     block_callback();
+    if (abort_callback && abort_callback()) {
+      fail = true;
+      break;
+    }
 
     deflate_bits += decInBits.bitPos() - prevBitPos;
     prevBitPos = decInBits.bitPos();
+    if (unprofitable()) {
+      fail = true;
+      break;
+    }
+    if (last && ((deflate_bits + 7) >> 3) < min_deflate_size) {
+      // too small anyway, don't bother analyzing the rest
+      fail = true;
+      break;
+    }
 
     sumBlockSizes += blockSize;
+    if (adaptiveMBSize && totalSize > expectedSize) {
+      // without a (correct) size estimate, assume the stream is about as
+      // big as what was seen so far; the number of meta blocks then only
+      // grows logarithmically with the stream size
+      size_t newMBSize = preflate_adaptive_meta_block_size(totalSize);
+      if (newMBSize != MBSize) {
+        MBSize = newMBSize;
+        MBThreshold = (MBSize * 3) >> 1;
+        queueLimit = std::min(2 * globalTaskPool.extraThreadCount(), globalTaskPool.queueMemoryLimit() / MBThreshold);
+      }
+    }
     if (last || sumBlockSizes >= MBThreshold) {
       size_t blockCount, blockSizeSum;
       if (last) {
@@ -205,9 +294,11 @@ bool preflate_decode(OutputStream& unpacked_output,
 
       size_t uncompressedOffset = MBcount == 0 ? 0 : 1 << 15;
 
-      std::vector<uint8_t> uncompressedDataForMeta(
-        decOutCache.cacheData(uncompressedMetaStart - uncompressedOffset),
-        decOutCache.cacheData(uncompressedMetaStart - uncompressedOffset) + blockSizeSum + uncompressedOffset);
+      // the task reads the window and meta block in place; the cache
+      // keeps this buffer untouched for as long as the task holds it
+      std::shared_ptr<const std::vector<uint8_t>> uncompressedBuffer = decOutCache.shareCache();
+      const uint8_t* uncompressedDataForMeta = decOutCache.cacheData(uncompressedMetaStart - uncompressedOffset);
+      size_t uncompressedSizeForMeta = blockSizeSum + uncompressedOffset;
       uncompressedMetaStart += blockSizeSum;
 
       size_t paddingBits = 0;
@@ -221,7 +312,9 @@ bool preflate_decode(OutputStream& unpacked_output,
       if (futureQueue.empty() && (queueLimit == 0 || last)) {
         PreflateDecoderTask task(encoder, MBcount,
                                  std::move(blocksForMeta),
-                                 std::move(uncompressedDataForMeta),
+                                 uncompressedBuffer,
+                                 uncompressedDataForMeta,
+                                 uncompressedSizeForMeta,
                                  uncompressedOffset,
                                  last, paddingBits);
         if (!task.analyze() || !task.encode()) {
@@ -241,7 +334,9 @@ bool preflate_decode(OutputStream& unpacked_output,
         std::shared_ptr<PreflateDecoderTask> ptask;
         ptask.reset(new PreflateDecoderTask(encoder, MBcount,
                                             std::move(blocksForMeta),
-                                            std::move(uncompressedDataForMeta),
+                                            uncompressedBuffer,
+                                            uncompressedDataForMeta,
+                                            uncompressedSizeForMeta,
                                             uncompressedOffset,
                                             last, paddingBits));
         futureQueue.push(globalTaskPool.addTask([ptask,&fail]() {
@@ -262,7 +357,7 @@ bool preflate_decode(OutputStream& unpacked_output,
     std::future<std::shared_ptr<PreflateDecoderTask>> first = std::move(futureQueue.front());
     futureQueue.pop();
     std::shared_ptr<PreflateDecoderTask> data = first.get();
-    if (fail || !data || !data->encode()) {
+    if (fail || !data || !data->encode() || unprofitable()) {
       fail = true;
     }
   }
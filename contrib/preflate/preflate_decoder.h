@@ -16,6 +16,7 @@
 #define PREFLATE_DECODER_H
 
 #include <functional>
+#include <memory>
 #include <queue>
 #include <vector>
 #include "preflate_statistical_codec.h"
@@ -40,7 +41,9 @@ public:
   PreflateDecoderTask(Handler& handler,
                       const uint32_t metaBlockId, 
                       std::vector<PreflateTokenBlock>&& tokenData,
-                      std::vector<uint8_t>&& uncompressedData,
+                      const std::shared_ptr<const std::vector<uint8_t>>& uncompressedBuffer,
+                      const uint8_t* uncompressedData,
+                      const size_t uncompressedSize,
                       const size_t uncompressedOffset,
                       const bool lastMetaBlock,
                       const uint32_t paddingBits);
@@ -55,7 +58,12 @@ private:
   Handler& handler;
   uint32_t metaBlockId;
   std::vector<PreflateTokenBlock> tokenData;
-  std::vector<uint8_t> uncompressedData;
+  // uncompressedData points into uncompressedBuffer (shared with the
+  // decompressor's output cache), starting uncompressedOffset bytes
+  // before the meta block to cover the window
+  std::shared_ptr<const std::vector<uint8_t>> uncompressedBuffer;
+  const uint8_t* uncompressedData;
+  size_t uncompressedSize;
   size_t uncompressedOffset;
   bool lastMetaBlock;
   uint32_t paddingBits;
@@ -66,13 +74,37 @@ private:
   std::unique_ptr<PreflateTreePredictor> treePredictor;
 };
 
+// thresholds to give up early on streams that aren't worth recompressing
+struct PreflateDecodeLimits {
+  PreflateDecodeLimits()
+    : maxReconPercent(0)
+    , maxStoredPercent(0)
+    , checkAfter(1 << 16) {}
+
+  unsigned maxReconPercent;  // max. size of the reconstruction data in percent of the deflate size, 0 = off
+  unsigned maxStoredPercent; // max. share of stored blocks in percent of the uncompressed size, 0 = off
+  uint64_t checkAfter;       // only check the ratios after this many deflate bytes
+};
+
+// Fixed meta block size, also used in adaptive mode when there are no
+// extra threads that smaller meta blocks could keep busy
+const size_t PREFLATE_DEFAULT_META_BLOCK_SIZE = 1 << 21;
+
+// Meta block size used when preflate_decode is called with metaBlockSize 0,
+// for a stream expected to have expectedSize uncompressed bytes. It is
+// picked from the thread count and the memory limit of the task pool.
+size_t preflate_adaptive_meta_block_size(const uint64_t expectedSize);
+
 bool preflate_decode(OutputStream& unpacked_output,
                      std::vector<unsigned char>& preflate_diff,
                      uint64_t& deflate_size,
                      InputStream& deflate_raw,
                      std::function<void(void)> block_callback,
                      const size_t min_deflate_size,
-                     const size_t metaBlockSize = INT32_MAX);
+                     const size_t metaBlockSize = INT32_MAX, // 0 = adaptive
+                     std::function<bool(void)> abort_callback = nullptr, // returning true cancels decoding
+                     const PreflateDecodeLimits& limits = PreflateDecodeLimits(),
+                     const uint64_t expectedSize = 0); // uncompressed size, if known (for adaptive meta block size)
 
 bool preflate_decode(std::vector<unsigned char>& unpacked_output,
                      std::vector<unsigned char>& preflate_diff,
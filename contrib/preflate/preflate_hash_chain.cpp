@@ -13,34 +13,59 @@
    limitations under the License. */
 
 #include <algorithm>
+#include <new>
+#include <stdlib.h>
 #include <string.h>
 #include "preflate_constants.h"
 #include "preflate_hash_chain.h"
 
 PreflateHashChainExt::PreflateHashChainExt(
-    const std::vector<unsigned char>& input_,
+    const PreflateInput& input_,
     const unsigned char memLevel)
   : _input(input_)
   , totalShift(-8) {
   hashBits = memLevel + 7;
   hashShift = (hashBits + PreflateConstants::MIN_MATCH - 1) / PreflateConstants::MIN_MATCH;
   hashMask = (1 << hashBits) - 1;
-  head = new unsigned short[hashMask + 1];
-  prev = new unsigned short[1 << 16];
-  chainDepth = new unsigned[1 << 16];
-  memset(head, 0, sizeof(short) * (hashMask + 1));
-  memset(prev, 0, sizeof(short) * (1 << 16));
-  memset(chainDepth, 0, sizeof(unsigned) * (1 << 16));
+  // nodes and heads share one allocation. Unless the input is long
+  // enough to trigger a reshift, nodes past its end are never touched,
+  // so short streams skip zeroing most of the 64k-entry window
+  nodes = (PreflateHashNode*)malloc(sizeof(PreflateHashNode) * (1 << 16)
+                                    + sizeof(unsigned short) * (hashMask + 1));
+  if (!nodes) {
+    throw std::bad_alloc();
+  }
+  head = (unsigned short*)(nodes + (1 << 16));
+  unsigned usedNodes = _input.size() + 8 < 0xfe08 ? _input.size() + 8 : 1 << 16;
+  memset(nodes, 0, sizeof(PreflateHashNode) * usedNodes);
+  memset(head, 0, sizeof(unsigned short) * (hashMask + 1));
   runningHash = 0;
   if (_input.remaining() > 2) {
     updateRunningHash(_input.curChar(0));
     updateRunningHash(_input.curChar(1));
   }
 }
+PreflateHashChainExt::PreflateHashChainExt(const PreflateHashChainExt& other)
+  : _input(other._input)
+  , hashBits(other.hashBits)
+  , hashShift(other.hashShift)
+  , runningHash(other.runningHash)
+  , hashMask(other.hashMask)
+  , totalShift(other.totalShift) {
+  nodes = (PreflateHashNode*)malloc(sizeof(PreflateHashNode) * (1 << 16)
+                                    + sizeof(unsigned short) * (hashMask + 1));
+  if (!nodes) {
+    throw std::bad_alloc();
+  }
+  head = (unsigned short*)(nodes + (1 << 16));
+  // same node range as the constructor zeroes, everything else is
+  // written before it is read
+  unsigned usedNodes = _input.size() + 8 < 0xfe08 ? _input.size() + 8 : 1 << 16;
+  memcpy(nodes, other.nodes, sizeof(PreflateHashNode) * usedNodes);
+  memcpy(head, other.head, sizeof(unsigned short) * (hashMask + 1));
+}
 PreflateHashChainExt::~PreflateHashChainExt() {
-  delete[] head;
-  delete[] chainDepth;
-  delete[] prev;
+  free(nodes);
 }
 
 void PreflateHashChainExt::updateHash(const unsigned l) {
@@ -63,8 +88,8 @@ void PreflateHashChainExt::updateHash(const unsigned l) {
     updateRunningHash(b[i]);
     unsigned h = runningHash & hashMask;
     unsigned p = (pos + i - 2) - totalShift;
-    chainDepth[p] = chainDepth[head[h]] + 1;
-    prev[p] = head[h];
+    nodes[p].depth = nodes[head[h]].depth + 1;
+    nodes[p].prev = head[h];
     head[h] = p;
   }
   _input.advance(l);
@@ -80,8 +105,8 @@ void PreflateHashChainExt::skipHash(const unsigned l) {
     updateRunningHash(b[2]);
     unsigned h = runningHash & hashMask;
     unsigned p = (pos) - totalShift;
-    chainDepth[p] = chainDepth[head[h]] + 1;
-    prev[p] = head[h];
+    nodes[p].depth = nodes[head[h]].depth + 1;
+    nodes[p].prev = head[h];
     head[h] = p;
 
     // Skipped data is not inserted into the hash chain,
@@ -90,7 +115,7 @@ void PreflateHashChainExt::skipHash(const unsigned l) {
     // --------------------
     for (unsigned i = 1; i < l; ++i) {
       unsigned p = (pos + i) - totalShift;
-      chainDepth[p] = 0xffff8000;
+      nodes[p].depth = 0xffff8000;
     }
     // l must be at least 3
     if (remaining > l) {
@@ -107,9 +132,11 @@ void PreflateHashChainExt::reshift() {
   for (unsigned i = 0, n = hashMask + 1; i < n; ++i) {
     head[i] = std::max(head[i], delta) - delta;
   }
+  // nodes move down by delta, so a forward pass never reads
+  // an already rewritten node
   for (unsigned i = delta + 8, n = 1 << 16; i < n; ++i) {
-    prev[i - delta] = std::max(prev[i], delta) - delta;
+    nodes[i - delta].depth = nodes[i].depth;
+    nodes[i - delta].prev = std::max(nodes[i].prev, delta) - delta;
   }
-  memmove(chainDepth + 8, chainDepth + 8 + delta, (0x10000 - 8 - delta) * sizeof(chainDepth[0]));
   totalShift += delta;
 }
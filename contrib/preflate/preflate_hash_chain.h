@@ -18,22 +18,26 @@
 #include <algorithm>
 #include "preflate_input.h"
 
+// Per-position chain data, kept together so that walking a chain
+// touches a single cache line per hop
+struct PreflateHashNode {
+  unsigned depth;
+  unsigned short prev;
+};
+
 struct PreflateHashIterator {
-  const unsigned short* chain;
-  const unsigned * chainDepth;
+  const PreflateHashNode* nodes;
   const unsigned refPos;
   const unsigned maxDist;
   unsigned curPos, curDist;
   bool isValid;
 
   PreflateHashIterator(
-      const unsigned short* chain_,
-      const unsigned * depth_,
+      const PreflateHashNode* nodes_,
       const unsigned refPos_,
       const unsigned maxDist_,
       unsigned startPos_)
-    : chain(chain_)
-    , chainDepth(depth_)
+    : nodes(nodes_)
     , refPos(refPos_)
     , maxDist(maxDist_)
     , curPos(startPos_)
@@ -54,10 +58,10 @@ struct PreflateHashIterator {
     return curDist;
   }
   inline unsigned depth() const {
-    return chainDepth[curPos];
+    return nodes[curPos].depth;
   }
   inline bool next() {
-    curPos = chain[curPos];
+    curPos = nodes[curPos].prev;
     curDist = dist(refPos, curPos);
     isValid = curPos > 0 && curDist <= maxDist;
     return isValid;
@@ -66,14 +70,14 @@ struct PreflateHashIterator {
 
 struct PreflateHashChainExt {
   PreflateInput _input;
+  PreflateHashNode* nodes;
   unsigned short* head;
-  unsigned * chainDepth;
-  unsigned short* prev;
   unsigned char hashBits, hashShift;
   unsigned short runningHash, hashMask;
   unsigned totalShift;
 
-  PreflateHashChainExt(const std::vector<unsigned char>& input_, const unsigned char memLevel);
+  PreflateHashChainExt(const PreflateInput& input_, const unsigned char memLevel);
+  PreflateHashChainExt(const PreflateHashChainExt& other);
   ~PreflateHashChainExt();
 
   unsigned nextHash(const unsigned char b) const {
@@ -90,20 +94,20 @@ struct PreflateHashChainExt {
     return head[hash & hashMask];
   }
   unsigned getNodeDepth(const unsigned node) const {
-    return chainDepth[node];
+    return nodes[node].depth;
   }
   unsigned getRelPosDepth(const unsigned refPos, const unsigned head) const {
-    return chainDepth[head] - chainDepth[refPos - totalShift];
+    return nodes[head].depth - nodes[refPos - totalShift].depth;
   }
 
   PreflateHashIterator iterateFromHead(const unsigned hash, const unsigned refPos, const unsigned maxDist) const {
-    return PreflateHashIterator(prev, chainDepth, refPos - totalShift, maxDist, head[hash & hashMask]);
+    return PreflateHashIterator(nodes, refPos - totalShift, maxDist, head[hash & hashMask]);
   }
   PreflateHashIterator iterateFromNode(const unsigned node, const unsigned refPos, const unsigned maxDist) const {
-    return PreflateHashIterator(prev, chainDepth, refPos - totalShift, maxDist, node);
+    return PreflateHashIterator(nodes, refPos - totalShift, maxDist, node);
   }
   PreflateHashIterator iterateFromPos(const unsigned pos, const unsigned refPos, const unsigned maxDist) const {
-    return PreflateHashIterator(prev, chainDepth, refPos - totalShift, maxDist, pos - totalShift);
+    return PreflateHashIterator(nodes, refPos - totalShift, maxDist, pos - totalShift);
   }
   const PreflateInput& input() const {
     return _input;
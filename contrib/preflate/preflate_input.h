@@ -15,31 +15,34 @@
 #ifndef PREFLATE_INPUT_H
 #define PREFLATE_INPUT_H
 
+#include <cstddef>
 #include <vector>
 
 class PreflateInput {
 public:
   PreflateInput(const std::vector<unsigned char>& v)
     : _data(v.size() > 0 ? &v[0] : nullptr), _size(v.size()), _pos(0) {}
+  PreflateInput(const unsigned char* data, const size_t size)
+    : _data(data), _size(size), _pos(0) {}
 
-  const unsigned pos() const {
+  unsigned pos() const {
     return _pos;
   }
 
-  const unsigned size() const {
+  unsigned size() const {
     return _size;
   }
 
   const unsigned char* curChars(int offset = 0) const {
     return _data + _pos + offset;
   }
-  const unsigned char curChar(int offset = 0) const {
+  unsigned char curChar(int offset = 0) const {
     return _data[_pos + offset];
   }
   void advance(const unsigned l) {
     _pos += l;
   }
-  const unsigned remaining() const {
+  unsigned remaining() const {
     return _size - _pos;
   }
 
@@ -49,6 +49,7 @@
 */
 
 #include "preflate_info.h"
+#include "preflate_input.h"
 #include "preflate_parser_config.h"
 #include "preflate_token.h"
 
@@ -103,7 +104,7 @@ PreflateStrategy estimatePreflateStrategy(const PreflateStreamInfo&);
 PreflateHuffStrategy estimatePreflateHuffStrategy(const PreflateStreamInfo&);
 unsigned char estimatePreflateWindowBits(const unsigned maxDist);
 
-PreflateParameters estimatePreflateParameters(const std::vector<unsigned char>& unpacked_output,
+PreflateParameters estimatePreflateParameters(const PreflateInput& unpacked_output,
                                               const size_t off0,
                                               const std::vector<PreflateTokenBlock>& blocks);
 
@@ -14,6 +14,7 @@
 
 #include "preflate_constants.h"
 #include "preflate_predictor_state.h"
+#include "support/byte_compare.h"
 #include <algorithm>
 
 PreflatePredictorState::PreflatePredictorState(
@@ -74,23 +75,10 @@ unsigned PreflatePredictorState::prefixCompare(
     return 0;
   }
 
-  const unsigned char* scan  = s2 + 3;
-  const unsigned char* match = s1 + 3;
-  const unsigned char* scanend = s2 + maxLen;
-
-/* while (scan < scanend
-          && *++scan == *++match && *++scan == *++match
-          && *++scan == *++match && *++scan == *++match
-          && *++scan == *++match && *++scan == *++match
-          && *++scan == *++match && *++scan == *++match) {
- }*/
-  while (scan < scanend
-          && *scan == *match) {
-    ++scan;
-    ++match;
+  if (maxLen <= 3) {
+    return 3;
   }
-
-  return scan - s2;
+  return 3 + byteCompareLength(s1 + 3, s2 + 3, maxLen - 3);
 }
 
 unsigned PreflatePredictorState::suffixCompare(
@@ -101,10 +89,7 @@ unsigned PreflatePredictorState::suffixCompare(
   if (s1[bestLen] != s2[bestLen]) {
     return 0;
   }
-  unsigned len = 0;
-  while (s1[len] == s2[len] && ++len < maxLen) {
-  }
-  return len;
+  return byteCompareLength(s1, s2, maxLen);
 }
 
 bool PreflatePredictorState::createMatchHelper(
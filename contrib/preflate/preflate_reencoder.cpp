@@ -153,7 +153,7 @@ bool preflate_reencode(OutputStream& os,
   for (size_t j = 0, n = decoder.metaBlockCount(); j < n; ++j) {
     maxMetaBlockSize = std::max(maxMetaBlockSize, decoder.metaBlockUncompressedSize(j));
   }
-  size_t queueLimit = std::min(2 * globalTaskPool.extraThreadCount(), (1 << 26) / maxMetaBlockSize);
+  size_t queueLimit = std::min(2 * globalTaskPool.extraThreadCount(), globalTaskPool.queueMemoryLimit() / maxMetaBlockSize);
   bool fail = false;
   for (size_t j = 0, n = decoder.metaBlockCount(); j < n; ++j) {
     size_t curUncSize = uncompressedData.size();
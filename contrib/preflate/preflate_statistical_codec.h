@@ -559,6 +559,9 @@ struct PreflateMetaEncoder {
   bool beginMetaBlockWithModel(PreflatePredictionEncoder&, const unsigned modelId);
   bool endMetaBlock(PreflatePredictionEncoder&, const size_t uncompressed);
   std::vector<unsigned char> finish();
+  size_t reconDataSize() const {
+    return reconData.size();
+  }
 
 private:
   struct modelType {
@@ -38,6 +38,8 @@ struct PreflateToken {
   PreflateToken(typeRef r, unsigned short l, unsigned short d, bool irregular258_ = false) 
     : len(l), irregular258(irregular258_), dist(d) {}
 };
+// a token block holds one of these per literal or match, keep it packed
+static_assert(sizeof(PreflateToken) == 4, "PreflateToken should fit in 32 bits");
 
 struct PreflateTokenBlock {
   enum Type {
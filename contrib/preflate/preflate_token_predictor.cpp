@@ -20,7 +20,7 @@
 
 PreflateTokenPredictor::PreflateTokenPredictor(
     const PreflateParameters& params_,
-    const std::vector<unsigned char>& dump,
+    const PreflateInput& dump,
     const size_t offset)
   : state(hash, seq, params_.config(), params_.windowBits, params_.memLevel)
   , hash(dump, params_.memLevel)
@@ -120,22 +120,20 @@ public:
   }
   
 private:
-  unsigned _findIndex(const unsigned bounds[],
-                      const unsigned N,
-                      const unsigned val) {
-    for (unsigned i = N; i > 1; --i) {
-      if (val >= bounds[i - 1]) {
-        return i - 1;
-      }
-    }
-    return 0;
-  }
-
+  // Models keep their bounds sorted by probability, so searching from
+  // the top finds the dominant symbol with the first comparison.
+  // (_value - _low) / step >= bounds[i] is tested as
+  // _value - _low >= step * bounds[i], which saves the division;
+  // step * bounds[N] never exceeds the range, so nothing overflows.
   unsigned _decode(const uint32_t step, const unsigned bounds[], const unsigned N) {
-    uint32_t val = (_value - _low) / step;
-    unsigned result = _findIndex(bounds, N, val);
+    uint32_t offset = _value - _low;
+    unsigned result = N - 1;
+    uint32_t low = step * bounds[result];
+    while (low > offset && result > 0) {
+      low = step * bounds[--result];
+    }
     _high = _low + step * bounds[result + 1] - 1;
-    _low += step * bounds[result];
+    _low += low;
     _checkNormalize();
     return result;
   }
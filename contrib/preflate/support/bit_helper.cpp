@@ -13,14 +13,24 @@
    limitations under the License. */
 
 #include "bit_helper.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 unsigned bitLength(unsigned value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return value ? 32 - __builtin_clz(value) : 0;
+#elif defined(_MSC_VER)
+  unsigned long index;
+  return _BitScanReverse(&index, value) ? index + 1 : 0;
+#else
   unsigned l = 0;
   while (value > 0) {
     l++;
     value >>= 1;
   }
   return l;
+#endif
 }
 
 static unsigned char reverse4[16] = {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
@@ -43,11 +53,18 @@ unsigned bitReverse(const unsigned value, const unsigned bits) {
   return bitReverse32(value) >> (32 - bits);
 }
 
-static unsigned char leading4[16] = {4, 3, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
 unsigned bitLeadingZeroes(const unsigned value_) {
   if (value_ == 0) {
     return 32;
   }
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_clz(value_);
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse(&index, value_);
+  return 31 - index;
+#else
+  static unsigned char leading4[16] = {4, 3, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
   unsigned value = value_;
   unsigned result = 0;
   while ((value & 0xf0000000) == 0) {
@@ -55,12 +72,20 @@ unsigned bitLeadingZeroes(const unsigned value_) {
     result += 4;
   }
   return result + leading4[value >> 28];
+#endif
 }
-static unsigned char trailing4[16] = {4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0};
 unsigned bitTrailingZeroes(const unsigned value_) {
   if (value_ == 0) {
     return 32;
   }
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(value_);
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, value_);
+  return index;
+#else
+  static unsigned char trailing4[16] = {4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0};
   unsigned value = value_;
   unsigned result = 0;
   while ((value & 0xf) == 0) {
@@ -68,5 +93,6 @@ unsigned bitTrailingZeroes(const unsigned value_) {
     result += 4;
   }
   return result + trailing4[value & 0xf];
+#endif
 }
 
@@ -16,22 +16,38 @@
 #include <memory.h>
 #include "bitstream.h"
 
+#if defined(BIT64) || defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64)
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_ARM64)
+#define BITSTREAM_WORD_ACCESS 1
+#endif
+#endif
+
 BitInputStream::BitInputStream(InputStream& is)
   : _input(is)
+  , _buf(_buffer)
   , _bufPos(0)
   , _bufSize(0)
   , _bufFastLimit(0)
   , _eof(false)
   , _bits(0)
   , _bitsRemaining(0)
-  , _totalBitPos(0)
-{}
+  , _totalBitPos(0) {
+  // input held in memory is read in place instead of being copied to _buffer
+  size_t size;
+  const unsigned char* data = is.span(size);
+  if (data) {
+    _buf = data;
+    _bufSize = size;
+    _bufFastLimit = size > PRE_BUF_EXTRA ? size - PRE_BUF_EXTRA : 0;
+    _eof = true;
+  }
+}
 
 void BitInputStream::_fillBytes() {
   // free space in bit buffer
   if (_bufPos >= _bufFastLimit) {
     if (!_eof) {
-      unsigned remaining = _bufSize - _bufPos;
+      size_t remaining = _bufSize - _bufPos;
       memcpy(_buffer + PRE_BUF_EXTRA - remaining,
              _buffer + _bufPos, remaining);
       _bufPos = PRE_BUF_EXTRA - remaining;
@@ -48,15 +64,26 @@ void BitInputStream::_fill() {
       _fillBytes();
     }
     while (_bitsRemaining <= BITS - 8 && _bufPos < _bufSize) {
-      _bits |= ((size_t)_buffer[_bufPos++]) << _bitsRemaining;
+      _bits |= ((size_t)_buf[_bufPos++]) << _bitsRemaining;
       _bitsRemaining += 8;
     }
     return;
   }
+#if BITSTREAM_WORD_ACCESS
+  // at least PRE_BUF_EXTRA bytes are left in the buffer: load a whole word
+  // and advance by the number of complete bytes that fit. Bits of the next,
+  // partially loaded byte are or'ed in again identically on the next fill.
+  uint64_t word;
+  memcpy(&word, _buf + _bufPos, sizeof(word));
+  _bits |= (size_t)word << _bitsRemaining;
+  _bufPos += (BITS - 1 - _bitsRemaining) >> 3;
+  _bitsRemaining |= BITS - 8;
+#else
   while (_bitsRemaining <= BITS - 8) {
-    _bits |= ((size_t)_buffer[_bufPos++]) << _bitsRemaining;
+    _bits |= ((size_t)_buf[_bufPos++]) << _bitsRemaining;
     _bitsRemaining += 8;
   }
+#endif
 }
 size_t BitInputStream::copyBytesTo(OutputStream& output, const size_t len) {
   if (_bitsRemaining & 7) {
@@ -74,9 +101,14 @@ size_t BitInputStream::copyBytesTo(OutputStream& output, const size_t len) {
   if (w != l) {
     return w;
   }
+  if (l < len) {
+    // the word refill may have left bits of the following bytes in
+    // _bits, but those bytes are now taken from the buffer directly
+    _bits = 0;
+  }
   while (l < len) {
-    unsigned todo = std::min(len - l, (size_t)(_bufSize - _bufPos));
-    w = output.write(_buffer + _bufPos, todo);
+    size_t todo = std::min(len - l, _bufSize - _bufPos);
+    w = output.write(_buf + _bufPos, todo);
     _totalBitPos += 8 * w;
     _bufPos += w;
     l += w;
@@ -97,9 +129,12 @@ size_t BitInputStream::getBytes(uint8_t* data, const size_t size_) {
     _totalBitPos += 8;
     size--;
   }
+  if (size > 0) {
+    _bits = 0;
+  }
   while (size > 0) {
-    unsigned todo = std::min(size, (size_t)(_bufSize - _bufPos));
-    memcpy(data, _buffer + _bufPos, todo);
+    size_t todo = std::min(size, _bufSize - _bufPos);
+    memcpy(data, _buf + _bufPos, todo);
     data += todo;
     _totalBitPos += 8 * todo;
     _bufPos += todo;
@@ -133,11 +168,21 @@ BitOutputStream::BitOutputStream(OutputStream& output)
   , _bitPos(0) {}
 
 void BitOutputStream::_flush() {
+#if BITSTREAM_WORD_ACCESS
+  // BUF_EXTRA leaves room to store the whole word; only the complete
+  // bytes are kept, the partial one is stored again by the next flush
+  uint64_t word = _bits;
+  memcpy(_buffer + _bufPos, &word, sizeof(word));
+  _bufPos += _bitPos >> 3;
+  _bits >>= _bitPos & ~7;
+  _bitPos &= 7;
+#else
   while (_bitPos >= 8) {
     _buffer[_bufPos++] = _bits & 0xff;
     _bits >>= 8;
     _bitPos -= 8;
   }
+#endif
   if (_bufPos >= BUF_SIZE) {
     _output.write(_buffer, BUF_SIZE);
     memcpy(_buffer, _buffer + BUF_SIZE, _bufPos - BUF_SIZE);
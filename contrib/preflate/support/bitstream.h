@@ -82,7 +82,9 @@ private:
 
   InputStream& _input;
   unsigned char _buffer[PRE_BUF_EXTRA + BUF_SIZE];
-  unsigned _bufPos, _bufSize, _bufFastLimit;
+  // _buffer, or the input itself if it is directly addressable
+  const unsigned char* _buf;
+  size_t _bufPos, _bufSize, _bufFastLimit;
   bool _eof;
   size_t _bits;
   unsigned _bitsRemaining;
@@ -104,6 +106,10 @@ public:
     put(bitReverse(value, n), n);
   }
   void fillByte() {
+    // never let the padding complete the word, _flush can't shift it out
+    if (_bitPos > BITS - 8) {
+      _flush();
+    }
     _bitPos = (_bitPos + 7) & ~7;
   }
   void flush();
@@ -117,7 +123,7 @@ private:
   void _flush();
 
   enum {
-    BUF_SIZE = 1024, BUF_EXTRA = 64, BITS = sizeof(size_t) * 8
+    BUF_SIZE = 16384, BUF_EXTRA = 64, BITS = sizeof(size_t) * 8
   };
 
   OutputStream& _output;
@@ -0,0 +1,155 @@
+/* Copyright 2021 Precomp contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <stdint.h>
+#include <string.h>
+#include "bit_helper.h"
+#include "byte_compare.h"
+#include "cpu_features.h"
+
+#ifdef CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
+
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) \
+    || defined(_M_X64) || defined(_M_IX86) || defined(_M_ARM64)
+#define BYTE_COMPARE_LITTLE_ENDIAN
+#endif
+
+static unsigned compareBytewise(const unsigned char* s1,
+                                const unsigned char* s2,
+                                const unsigned maxLen) {
+  unsigned len = 0;
+  while (len < maxLen && s1[len] == s2[len]) {
+    ++len;
+  }
+  return len;
+}
+
+#ifdef BYTE_COMPARE_LITTLE_ENDIAN
+// Compares 8 bytes at a time; the first differing byte is the lowest
+// non-zero byte of the xor'ed words
+static unsigned compareWordwise(const unsigned char* s1,
+                                const unsigned char* s2,
+                                const unsigned maxLen) {
+  unsigned len = 0;
+  while (len + 8 <= maxLen) {
+    uint64_t w1, w2;
+    memcpy(&w1, s1 + len, 8);
+    memcpy(&w2, s2 + len, 8);
+    uint64_t diff = w1 ^ w2;
+    if (diff) {
+      uint32_t lo = (uint32_t)diff;
+      return len + (lo ? bitTrailingZeroes(lo) : 32 + bitTrailingZeroes((uint32_t)(diff >> 32))) / 8;
+    }
+    len += 8;
+  }
+  return len + compareBytewise(s1 + len, s2 + len, maxLen - len);
+}
+#else
+#define compareWordwise compareBytewise
+#endif
+
+#ifdef CPU_FEATURES_X86
+CPU_FEATURES_TARGET("sse2")
+static unsigned compareSSE2(const unsigned char* s1,
+                            const unsigned char* s2,
+                            const unsigned maxLen) {
+  unsigned len = 0;
+  while (len + 16 <= maxLen) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(s1 + len));
+    __m128i b = _mm_loadu_si128((const __m128i*)(s2 + len));
+    uint32_t mask = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+    if (mask) {
+      return len + bitTrailingZeroes(mask);
+    }
+    len += 16;
+  }
+  return len + compareWordwise(s1 + len, s2 + len, maxLen - len);
+}
+
+CPU_FEATURES_TARGET("avx2")
+static unsigned compareAVX2(const unsigned char* s1,
+                            const unsigned char* s2,
+                            const unsigned maxLen) {
+  unsigned len = 0;
+  while (len + 32 <= maxLen) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(s1 + len));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(s2 + len));
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    if (mask) {
+      return len + bitTrailingZeroes(mask);
+    }
+    len += 32;
+  }
+  return len + compareSSE2(s1 + len, s2 + len, maxLen - len);
+}
+#endif
+
+bool byteCompareKernelAvailable(const ByteCompareKernel kernel) {
+  switch (kernel) {
+  case BYTE_COMPARE_BYTEWISE:
+  case BYTE_COMPARE_WORDWISE:
+    return true;
+#ifdef CPU_FEATURES_X86
+  case BYTE_COMPARE_SSE2:
+    return cpuHasSSE2();
+  case BYTE_COMPARE_AVX2:
+    return cpuHasSSE2() && cpuHasAVX2();
+#endif
+  default:
+    return false;
+  }
+}
+
+ByteCompareFunc byteCompareKernelFunc(const ByteCompareKernel kernel) {
+  if (!byteCompareKernelAvailable(kernel)) {
+    return nullptr;
+  }
+  switch (kernel) {
+  case BYTE_COMPARE_BYTEWISE:
+    return compareBytewise;
+  case BYTE_COMPARE_WORDWISE:
+    return compareWordwise;
+#ifdef CPU_FEATURES_X86
+  case BYTE_COMPARE_SSE2:
+    return compareSSE2;
+  case BYTE_COMPARE_AVX2:
+    return compareAVX2;
+#endif
+  default:
+    return nullptr;
+  }
+}
+
+const char* byteCompareKernelName(const ByteCompareKernel kernel) {
+  static const char* const names[BYTE_COMPARE_KERNEL_COUNT] = {
+    "bytewise", "wordwise", "sse2", "avx2"
+  };
+  return kernel < BYTE_COMPARE_KERNEL_COUNT ? names[kernel] : "unknown";
+}
+
+ByteCompareKernel byteCompareActiveKernel() {
+  static const ByteCompareKernel active = []() {
+    for (int k = BYTE_COMPARE_KERNEL_COUNT - 1; k > BYTE_COMPARE_WORDWISE; --k) {
+      if (byteCompareKernelAvailable((ByteCompareKernel)k)) {
+        return (ByteCompareKernel)k;
+      }
+    }
+    return BYTE_COMPARE_WORDWISE;
+  }();
+  return active;
+}
+
+const ByteCompareFunc byteCompareLength = byteCompareKernelFunc(byteCompareActiveKernel());
@@ -0,0 +1,41 @@
+/* Copyright 2021 Precomp contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#ifndef BYTE_COMPARE_H
+#define BYTE_COMPARE_H
+
+// Returns the number of identical leading bytes of s1 and s2,
+// comparing at most maxLen bytes. Never reads beyond s1[maxLen - 1]
+// or s2[maxLen - 1].
+typedef unsigned (*ByteCompareFunc)(const unsigned char* s1,
+                                    const unsigned char* s2,
+                                    const unsigned maxLen);
+
+enum ByteCompareKernel {
+  BYTE_COMPARE_BYTEWISE,
+  BYTE_COMPARE_WORDWISE,
+  BYTE_COMPARE_SSE2,
+  BYTE_COMPARE_AVX2,
+  BYTE_COMPARE_KERNEL_COUNT
+};
+
+// Fastest kernel supported by the running CPU, selected once at startup
+extern const ByteCompareFunc byteCompareLength;
+
+bool byteCompareKernelAvailable(const ByteCompareKernel);
+ByteCompareFunc byteCompareKernelFunc(const ByteCompareKernel);
+const char* byteCompareKernelName(const ByteCompareKernel);
+ByteCompareKernel byteCompareActiveKernel();
+
+#endif /* BYTE_COMPARE_H */
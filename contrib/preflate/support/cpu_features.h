@@ -0,0 +1,36 @@
+/* Copyright 2021 Precomp contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_FEATURES_X86
+#endif
+
+// Compiles a vector kernel for an instruction set extension the build
+// doesn't enable, so call it only after checking the CPU supports it
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_FEATURES_TARGET(x) __attribute__((target(x)))
+#else
+#define CPU_FEATURES_TARGET(x)
+#endif
+
+// Instruction set extensions of the running CPU, for picking
+// vector kernels at runtime. Always false on non-x86 targets.
+bool cpuHasSSE2();
+bool cpuHasSSSE3();
+bool cpuHasAVX2();
+
+#endif /* CPU_FEATURES_H */
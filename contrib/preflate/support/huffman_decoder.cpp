@@ -46,6 +46,32 @@ size_t HuffmanDecoder::_decodeDeeper(
     tableId = ~w;
   } while (true);
 }
+unsigned HuffmanDecoder::peekSymbol(
+    const size_t bits_,
+    const unsigned bitCount,
+    unsigned& symbol
+) const {
+  size_t bits = bits_;
+  unsigned consumed = 0;
+  const Table* table = &_table0;
+  while (true) {
+    signed short w = table->lookup[bits & ((1 << table->peekBits) - 1)];
+    if (w >= 0) {
+      unsigned len = consumed + (w & 0xf);
+      if (len == 0 || len > bitCount) {
+        return 0;
+      }
+      symbol = w >> 4;
+      return len;
+    }
+    consumed += table->peekBits;
+    if (consumed >= bitCount) {
+      return 0;
+    }
+    bits >>= table->peekBits;
+    table = &_tables[~w];
+  }
+}
 bool HuffmanDecoder::_constructTables(
     const unsigned char* symbolBitLengths,
     const size_t symbolCount,
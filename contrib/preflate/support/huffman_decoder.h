@@ -39,6 +39,10 @@ public:
     }
     return _decodeDeeper(bis, ~w);
   }
+  // Resolves the symbol whose code starts at the lowest bit of "bits",
+  // if that code is at most bitCount bits long. Returns the code length,
+  // or 0 if the symbol cannot be determined from bitCount bits.
+  unsigned peekSymbol(const size_t bits, const unsigned bitCount, unsigned& symbol) const;
 
 private:
   size_t _decodeDeeper(BitInputStream& bis, const size_t tableId) const;
@@ -33,6 +33,14 @@ public:
     unsigned v = _lookup[symbol];
     bos.put(v >> 5, v & 0x1f);
   }
+  // Bit-reversed code of the symbol in the upper bits, code length in the
+  // lowest 5 bits. Lets callers merge several codes into a single put.
+  unsigned packedCode(const unsigned symbol) const {
+    return _lookup[symbol];
+  }
+  unsigned symbolCount() const {
+    return _lookup.size();
+  }
 
 private:
   bool _constructTables(const unsigned char* symbolBitLengths,
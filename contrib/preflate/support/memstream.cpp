@@ -35,6 +35,12 @@ size_t MemStream::read(unsigned char* buffer, const size_t size) {
   _pos += toCopy;
   return toCopy;
 }
+const unsigned char* MemStream::span(size_t& size) {
+  size = _data.size() - _pos;
+  const unsigned char* result = _data.data() + _pos;
+  _pos = _data.size();
+  return result;
+}
 
 size_t MemStream::write(const unsigned char* buffer, const size_t size) {
   size_t remaining = _data.size() - _pos;
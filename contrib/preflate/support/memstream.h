@@ -27,6 +27,7 @@ public:
 
   virtual bool eof() const;
   virtual size_t read(unsigned char* buffer, const size_t size);
+  virtual const unsigned char* span(size_t& size);
 
   virtual size_t write(const unsigned char* buffer, const size_t size);
 
@@ -13,17 +13,54 @@
    limitations under the License. */
 
 #include <algorithm>
+#include <atomic>
 #include "outputcachestream.h"
 
 OutputCacheStream::OutputCacheStream(OutputStream& os)
   : _os(os)
-  , _cacheStartPos(0) {}
+  , _cache(std::make_shared<std::vector<unsigned char>>())
+  , _cacheStartPos(0)
+  , _shared(false) {}
 OutputCacheStream::~OutputCacheStream() {
 }
 
 void OutputCacheStream::flushUpTo(const uint64_t newStartPos) {
-  size_t toWrite = std::min(newStartPos - _cacheStartPos, (uint64_t)_cache.size());
-  size_t written = _os.write(_cache.data(), toWrite);
+  size_t toWrite = std::min(newStartPos - _cacheStartPos, (uint64_t)_cache->size());
+  size_t written = _os.write(_cache->data(), toWrite);
   _cacheStartPos += written;
-  _cache.erase(_cache.begin(), _cache.begin() + written);
+  if (_shared) {
+    _unshare(written);
+  } else {
+    _cache->erase(_cache->begin(), _cache->begin() + written);
+  }
+}
+
+void OutputCacheStream::_unshare(const size_t dropBytes) {
+  _shared = false;
+  if (_cache.use_count() == 1) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    _cache->erase(_cache->begin(), _cache->begin() + dropBytes);
+    return;
+  }
+  // reuse one buffer that all readers have released, free the others
+  std::shared_ptr<std::vector<unsigned char>> fresh;
+  for (auto& r : _retired) {
+    if (r.use_count() == 1) {
+      if (!fresh) {
+        fresh.swap(r);
+      } else {
+        r.reset();
+      }
+    }
+  }
+  _retired.erase(std::remove(_retired.begin(), _retired.end(), nullptr), _retired.end());
+  // pairs with the release done by the last reader dropping its reference
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!fresh) {
+    fresh = std::make_shared<std::vector<unsigned char>>();
+    fresh->reserve(_cache->capacity());
+  }
+  fresh->assign(_cache->begin() + dropBytes, _cache->end());
+  _retired.push_back(std::move(_cache));
+  _cache = std::move(fresh);
 }
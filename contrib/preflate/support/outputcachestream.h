@@ -16,6 +16,7 @@
 #define OUTPUTCACHESTREAM_H
 
 #include <algorithm>
+#include <memory>
 #include <vector>
 #include "stream.h"
 
@@ -25,17 +26,25 @@ public:
   virtual ~OutputCacheStream();
 
   size_t write(const unsigned char* buffer, const size_t size) {
-/*    if (size == 1) {
-      _cache.push_back(*buffer);
-      return 1;
-    }*/
-    _cache.insert(_cache.end(), buffer, buffer + size);
+    if (_shared) {
+      _unshare(0);
+    }
+    _cache->insert(_cache->end(), buffer, buffer + size);
     return size;
   }
+  void writeByte(const unsigned char c) {
+    if (_shared) {
+      _unshare(0);
+    }
+    _cache->push_back(c);
+  }
   void reserve(const size_t len) {
-    size_t cap = _cache.capacity();
-    if (_cache.size() + len > cap) {
-      _cache.reserve(cap + std::max(cap >> 1, len));
+    if (_shared) {
+      _unshare(0);
+    }
+    size_t cap = _cache->capacity();
+    if (_cache->size() + len > cap) {
+      _cache->reserve(cap + std::max(cap >> 1, len));
     }
   }
   void flush() {
@@ -46,22 +55,35 @@ public:
     return _cacheStartPos;
   }
   uint64_t cacheEndPos() const {
-    return _cacheStartPos + _cache.size();
+    return _cacheStartPos + _cache->size();
   }
   const unsigned char* cacheData(const uint64_t pos) const {
-    return _cache.data() + (std::ptrdiff_t)(pos - _cacheStartPos);
+    return _cache->data() + (std::ptrdiff_t)(pos - _cacheStartPos);
   }
   const unsigned char* cacheEnd() const {
-    return _cache.data() + _cache.size();
+    return _cache->data() + _cache->size();
   }
   const size_t cacheSize() const {
-    return _cache.size();
+    return _cache->size();
+  }
+  // Hands out a reference to the current cache buffer. The cached bytes
+  // (and pointers from cacheData()) stay valid while it is held: the next
+  // write or flush moves the data that is still needed to another buffer
+  // instead of modifying the shared one.
+  std::shared_ptr<const std::vector<unsigned char>> shareCache() {
+    _shared = true;
+    return _cache;
   }
 
 private:
+  void _unshare(const size_t dropBytes);
+
   OutputStream& _os;
-  std::vector<unsigned char> _cache;
+  std::shared_ptr<std::vector<unsigned char>> _cache;
+  // buffers handed out by shareCache() earlier, reused once released
+  std::vector<std::shared_ptr<std::vector<unsigned char>>> _retired;
   uint64_t _cacheStartPos;
+  bool _shared;
 };
 
 #endif /* OUTPUTCACHESTREAM_H */
@@ -15,6 +15,7 @@
 #ifndef STREAM_H
 #define STREAM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 class InputStream {
@@ -23,6 +24,12 @@ public:
 
   virtual bool eof() const = 0;
   virtual size_t read(unsigned char* buffer, const size_t size) = 0;
+  // Streams that hold their data in memory return the unread rest and
+  // count it as read. The data must stay valid and unchanged while it is used.
+  virtual const unsigned char* span(size_t& size) {
+    size = 0;
+    return nullptr;
+  }
 };
 
 class OutputStream {
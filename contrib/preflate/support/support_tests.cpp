@@ -12,10 +12,13 @@
    See the License for the specific language governing permissions and
    limitations under the License. */
 
+#include <algorithm>
 #include <stdio.h>
+#include "arithmetic_coder.h"
 #include "array_helper.h"
 #include "bit_helper.h"
 #include "bitstream.h"
+#include "byte_compare.h"
 #include "const_division.h"
 #include "huffman_decoder.h"
 #include "huffman_encoder.h"
@@ -24,6 +27,43 @@
 #include "outputcachestream.h"
 #include "stream.h"
 
+// Passes on the data of a MemStream without a span, so BitInputStream
+// has to go through its own buffer
+class BufferedInputStream : public InputStream {
+public:
+  BufferedInputStream(MemStream& mem) : _mem(mem) {}
+
+  virtual bool eof() const {
+    return _mem.eof();
+  }
+  virtual size_t read(unsigned char* buffer, const size_t size) {
+    return _mem.read(buffer, size);
+  }
+
+private:
+  MemStream& _mem;
+};
+
+// Bit fields, then raw bytes read after several word refills
+static bool checkBitsAndBytes(BitInputStream& bis) {
+  for (unsigned i = 0; i < 3000; ++i) {
+    if (bis.get(7) != (i & 127)) {
+      return false;
+    }
+  }
+  bis.skipToByte();
+  uint8_t data[2000];
+  if (bis.getBytes(data, sizeof(data)) != sizeof(data)) {
+    return false;
+  }
+  for (unsigned i = 0; i < sizeof(data); ++i) {
+    if (data[i] != (uint8_t)(i * 7)) {
+      return false;
+    }
+  }
+  return bis.get(13) == 0x1234;
+}
+
 bool support_self_tests() {
   unsigned arr[] = {1,2,3,4,5};
   if (sumArray(arr) != 15
@@ -43,6 +83,13 @@ bool support_self_tests() {
     printf("bitReverse failed\n");
     return false;
   }
+  if (bitLeadingZeroes(0) != 32 || bitLeadingZeroes(1) != 31
+      || bitLeadingZeroes(0x00012345) != 15
+      || bitTrailingZeroes(0) != 32 || bitTrailingZeroes(0x80000000) != 31
+      || bitTrailingZeroes(0x00012340) != 6) {
+    printf("bitLeading/TrailingZeroes failed\n");
+    return false;
+  }
 
   MemStream mem;
   mem.write((const uint8_t*)"Hello", 5);
@@ -96,6 +143,70 @@ bool support_self_tests() {
     }
   }
 
+  mem.seek(0);
+  {
+    BitOutputStream bos(mem);
+    for (unsigned i = 0; i < 3000; ++i) {
+      bos.put(i & 127, 7);
+    }
+    bos.fillByte();
+    uint8_t data[2000];
+    for (unsigned i = 0; i < sizeof(data); ++i) {
+      data[i] = (uint8_t)(i * 7);
+    }
+    bos.putBytes(data, sizeof(data));
+    bos.put(0x1234, 13);
+    bos.flush();
+  }
+  mem.seek(0);
+  {
+    BitInputStream bis(mem);
+    if (!checkBitsAndBytes(bis)) {
+      printf("BitStreams/span failed\n");
+      return false;
+    }
+  }
+  mem.seek(0);
+  {
+    BufferedInputStream buffered(mem);
+    BitInputStream bis(buffered);
+    if (!checkBitsAndBytes(bis)) {
+      printf("BitStreams/buffered failed\n");
+      return false;
+    }
+  }
+
+  // padding that ends exactly on a full bit buffer
+  mem.seek(0);
+  {
+    BitOutputStream bos(mem);
+    for (unsigned i = 0; i < 20; ++i) {
+      bos.put(i, 5);
+      bos.fillByte();
+      bos.put(0x1ff, 9);
+      bos.put(0x7ff, 11);
+      bos.put(0x3ffffff, 26);
+      bos.put(0x2a, 5);
+      bos.fillByte();
+    }
+    bos.flush();
+  }
+  mem.seek(0);
+  {
+    BitInputStream bis(mem);
+    for (unsigned i = 0; i < 20; ++i) {
+      bool ok = bis.get(5) == i;
+      bis.skipToByte();
+      ok = ok && bis.get(9) == 0x1ff && bis.get(11) == 0x7ff
+              && bis.get(26) == 0x3ffffff && bis.get(5) == 0x0a;
+      bis.skipToByte();
+      if (!ok) {
+        printf("BitStreams/padding failed\n");
+        return false;
+      }
+    }
+  }
+
   unsigned char lengths[] = {
     1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,
     17,18,19,20,21,22,23,24,25,25
@@ -119,6 +230,13 @@ bool support_self_tests() {
   {
     BitInputStream bis(mem);
     for (unsigned i = 0; i < count; ++i) {
+      unsigned symbol = ~0u;
+      unsigned bits = hdec.peekSymbol(bis.peek(11), 11, symbol);
+      if (bits != (lengths[i] <= 11 ? lengths[i] : 0)
+          || (bits && symbol != i)) {
+        printf("HuffmanDecoder peek failed\n");
+        return false;
+      }
       if (hdec.decode(bis) != i) {
         printf("HuffmanDecoder failed\n");
         return false;
@@ -176,5 +294,54 @@ bool support_self_tests() {
       }
     }
   }
+  // sorted bounds with a dominant last symbol and an empty one
+  unsigned acBounds[6] = {0, 0, 70, 400, 1200, 1 << 16};
+  mem.seek(0);
+  {
+    BitOutputStream bos(mem);
+    ArithmeticEncoder enc(bos);
+    for (unsigned i = 0; i < 5000; ++i) {
+      unsigned sym = (i * 7919) % 97 < 90 ? 4 : 1 + (i % 4);
+      enc.encodeShiftScale(16, acBounds[sym], acBounds[sym + 1]);
+    }
+    enc.flush();
+    bos.flush();
+  }
+  mem.seek(0);
+  {
+    BitInputStream bis(mem);
+    ArithmeticDecoder dec(bis);
+    for (unsigned i = 0; i < 5000; ++i) {
+      unsigned sym = (i * 7919) % 97 < 90 ? 4 : 1 + (i % 4);
+      if (dec.decodeShiftScale(16, acBounds, 5) != sym) {
+        printf("ArithmeticDecoder failed\n");
+        return false;
+      }
+    }
+  }
+
+  unsigned char cmp1[300], cmp2[300];
+  for (unsigned i = 0; i < sizeof(cmp1); ++i) {
+    cmp1[i] = cmp2[i] = (unsigned char)(i * 7 + 3);
+  }
+  for (int k = 0; k < BYTE_COMPARE_KERNEL_COUNT; ++k) {
+    ByteCompareFunc cmp = byteCompareKernelFunc((ByteCompareKernel)k);
+    if (!cmp) {
+      continue;
+    }
+    for (unsigned diff = 0; diff <= 260; ++diff) {
+      cmp2[diff] ^= 0x80;
+      for (unsigned offset = 0; offset < 4; ++offset) {
+        for (unsigned maxLen = 0; maxLen + offset <= 264; maxLen += 5) {
+          unsigned expected = diff < offset ? maxLen : std::min(diff - offset, maxLen);
+          if (cmp(cmp1 + offset, cmp2 + offset, maxLen) != expected) {
+            printf("byteCompareLength (%s) failed\n", byteCompareKernelName((ByteCompareKernel)k));
+            return false;
+          }
+        }
+      }
+      cmp2[diff] ^= 0x80;
+    }
+  }
   return true;
 }
@@ -20,7 +20,8 @@ TaskPool globalTaskPool;
 
 TaskPool::TaskPool()
   : _state(INIT)
-  , _threadLimit(std::max(1u, std::thread::hardware_concurrency()) - 1) {
+  , _threadLimit(std::max(1u, std::thread::hardware_concurrency()) - 1)
+  , _queueMemoryLimit(1 << 26) {
 }
 
 void TaskPool::_init() {
@@ -36,12 +36,14 @@ public:
     auto task = std::make_shared<std::packaged_task<R()>>(
       std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
-    if (_state == INIT) {
-      _init();
-    }
     std::future<R> res = task->get_future();
     {
+      // tasks may be added from more than one thread,
+      // so the workers are started under the lock
       std::unique_lock<std::mutex> lock(_mutex);
+      if (_state == INIT) {
+        _init();
+      }
       _tasks.emplace([task]() { (*task)(); });
     }
     _condition.notify_one();
@@ -51,6 +53,14 @@ public:
   size_t extraThreadCount() const {
     return _threadLimit;
   }
+  // upper bound for the input data of tasks queued by one caller,
+  // limits how many tasks can be in flight at the same time
+  size_t queueMemoryLimit() const {
+    return _queueMemoryLimit;
+  }
+  void setQueueMemoryLimit(const size_t limit) {
+    _queueMemoryLimit = limit;
+  }
 
 private:
   enum State { INIT, RUN, FINISH };
@@ -59,6 +69,7 @@ private:
 
   State _state;
   size_t _threadLimit;
+  size_t _queueMemoryLimit;
   std::vector<std::thread> _workers;
   std::mutex _mutex;
   std::condition_variable _condition;
@@ -19,7 +19,7 @@
 // version information
 #define V_MAJOR 0
 #define V_MINOR 4
-#define V_MINOR2 8
+#define V_MINOR2 9
 //#define V_STATE "ALPHA"
 #define V_STATE "DEVELOPMENT"
 //#define V_MSG "USE FOR TESTING ONLY"
@@ -67,6 +67,11 @@
 #include <signal.h>
 #include <thread>
 #include <set>
+#include <map>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <mutex>
 #ifdef MINGW
 #ifndef _GLIBCXX_HAS_GTHREADS
 #include "contrib\mingw_std_threads\mingw.thread.h"
@@ -87,6 +92,9 @@
 #include <time.h>
 #include <sys/time.h>
 #include <errno.h>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
 #define PATH_DELIM '/'
 #endif
 
@@ -98,6 +106,13 @@ using namespace std;
 #include "contrib/packmp3/precomp_mp3.h"
 #include "contrib/zlib/zlib.h"
 #include "contrib/preflate/preflate.h"
+#include "contrib/preflate/support/task_pool.h"
+#include "contrib/preflate/support/bit_helper.h"
+#include "contrib/preflate/support/byte_compare.h"
+#include "contrib/preflate/support/cpu_features.h"
+#ifdef CPU_FEATURES_X86
+#include <immintrin.h>
+#endif
 #include "contrib/brunsli/c/include/brunsli/brunsli_encode.h"
 #include "contrib/brunsli/c/include/brunsli/brunsli_decode.h"
 #include "contrib/brunsli/c/include/brunsli/jpeg_data_reader.h"
@@ -115,6 +130,16 @@ using namespace std;
 
 #define MAX_IO_BUFFER_SIZE 64 * 1024 * 1024
 unsigned char* decomp_io_buf = NULL;
+long long decomp_io_buf_size = 0;
+
+// scratch buffer pool, buffers are grouped in power-of-two size classes
+// (16 KiB .. 64 MiB) and recycled instead of being freed
+#define SCRATCH_POOL_MIN_SIZE (16 * 1024)
+#define SCRATCH_POOL_CLASSES 13
+std::vector<unsigned char*> scratch_pool_free[SCRATCH_POOL_CLASSES];
+std::map<unsigned char*, int> scratch_pool_used;
+std::map<unsigned char*, size_t> scratch_pool_unpooled_size;
+std::mutex scratch_pool_mutex;
 
 unsigned char copybuf[COPY_BUF_SIZE];
 
@@ -125,18 +150,37 @@ int cb; // "checkbuf"
 unsigned char in[CHUNK];
 unsigned char out[CHUNK];
 
-// name of temporary files
-char metatempfile[18] = "~temp00000000.dat";
-char tempfile0[19] = "~temp000000000.dat";
-char tempfile1[19] = "~temp000000001.dat";
-char tempfile2[19] = "~temp000000002.dat";
-char tempfile3[19] = "~temp000000003.dat";
+// name of temporary files, prefixed with the temp directory (if set)
+#define TEMP_DIR_MAX_LEN 256
+#define TEMPFILE_NAME_SIZE (TEMP_DIR_MAX_LEN + 20)
+char metatempfile[TEMPFILE_NAME_SIZE] = "~temp00000000.dat";
+char tempfile0[TEMPFILE_NAME_SIZE] = "~temp000000000.dat";
+char tempfile1[TEMPFILE_NAME_SIZE] = "~temp000000001.dat";
+char tempfile2[TEMPFILE_NAME_SIZE] = "~temp000000002.dat";
+char tempfile3[TEMPFILE_NAME_SIZE] = "~temp000000003.dat";
+char temp_dir[TEMP_DIR_MAX_LEN + 1] = ""; // including trailing path delimiter
+// on Linux, temporary files are anonymous (O_TMPFILE) and accessed by their
+// /proc/self/fd/ name, so no name probing or removing is needed
+#define ANONYMOUS_TEMPFILE_PREFIX "/proc/self/fd/"
+#ifdef __linux__
+// descriptors of the open anonymous temporary files, a /proc/self/fd/ name
+// only refers to one of them while its descriptor is in this set
+std::set<int> anonymous_temp_fds;
+std::mutex anonymous_temp_mutex;
+#endif
 char* tempfilelist;
 int tempfilelist_count = 0;
 int tempfile_instance = 0;
 
 #include "precomp.h"
 
+// JPGs queued for recompression on worker threads, ordered by position, see jpg_batch_start
+std::deque<std::shared_ptr<jpg_batch_frame>> jpg_batch;
+// GIFs queued for recompression on worker threads, ordered by position, see gif_batch_start
+std::deque<std::shared_ptr<gif_batch_stream>> gif_batch;
+// MP3s queued for recompression on worker threads, ordered by position, see mp3_batch_start
+std::deque<std::shared_ptr<mp3_batch_stream>> mp3_batch;
+
 static char work_signs[5] = "|/-\\";
 int work_sign_var = 0;
 long long work_sign_start_time = get_time_ms();
@@ -168,6 +212,10 @@ int otf_xz_filter_used_count = 0;
 int compression_otf_method = OTF_XZ_MT;
 uint64_t compression_otf_max_memory = 0;
 int compression_otf_thread_count = 0;
+
+// global memory budget in MiB, 0 = use the fixed limits per stream type
+unsigned int memory_budget = 0;
+long long memory_budget_used = 0; // bytes currently allocated through the scratch pool
 int conversion_from_method;
 int conversion_to_method;
 bool decompress_otf_end = false;
@@ -214,8 +262,11 @@ bool level_switch_used = false;
 bool non_zlib_was_used;
 
 // preflate config
-size_t preflate_meta_block_size = 1 << 21; // 2 MB blocks by default
+size_t preflate_meta_block_size = PREFLATE_DEFAULT_META_BLOCK_SIZE; // 2 MB blocks by default, 0 = adaptive
+uint64_t preflate_expected_size = 0; // uncompressed size of the next deflate stream if the container tells it, else 0
 bool preflate_verify = false;
+size_t preflate_min_deflate_size = 0;
+PreflateDecodeLimits preflate_limits; // early cutoffs for unprofitable streams, off by default
 
 // statistics
 unsigned int recompressed_streams_count = 0;
@@ -260,6 +311,14 @@ unsigned int decompressed_brute_count = 0;   // brute mode
 #define P_CONVERT 3
 int comp_decomp_state = P_NONE;
 
+// per-stream time budget in ms (0 = unlimited), streams exceeding it are skipped
+long long stream_time_budget = 0;
+long long stream_deadline = 0;
+// deadline of the stream whose data the current recursion level processes, 0 = none;
+// streams found inside it have to finish before it
+long long outer_stream_deadline = 0;
+bool stream_time_exceeded_reported = false;
+
 // penalty bytes
 #define MAX_PENALTY_BYTES 16384
 #ifndef PRECOMPDLL
@@ -293,9 +352,15 @@ long long suppress_mp3_big_value_pairs_sum;
 long long suppress_mp3_non_zero_padbits_sum;
 long long suppress_mp3_inconsistent_emphasis_sum;
 long long suppress_mp3_inconsistent_original_bit;
-long long mp3_parsing_cache_second_frame;
-long long mp3_parsing_cache_n;
-long long mp3_parsing_cache_mp3_length;
+
+// Frames of the last MPEG-1 Layer III stream that was parsed, see mp3_parse_frames. All of them
+// share the header fields of the first frame, so any frame can be the start of a shorter stream.
+struct mp3_frame_index {
+  long long start = -1;
+  std::vector<unsigned int> offsets; // frame offsets relative to start, followed by the end of the last frame
+  bool valid = false; // false if one of the frames failed is_valid_mp3_frame
+};
+mp3_frame_index* mp3_index = new mp3_frame_index();
 
 bool fast_mode = false;
 bool intense_mode = false;
@@ -370,6 +435,9 @@ void setSwitches(Switches switches) {
   min_ident_size = switches.min_ident_size;
   compression_otf_max_memory = switches.compression_otf_max_memory;
   compression_otf_thread_count = switches.compression_otf_thread_count;
+  memory_budget = switches.memory_budget;
+  stream_time_budget = switches.stream_time_budget;
+  init_memory_budget();
   use_pdf = switches.use_pdf;
   use_zip = switches.use_zip;
   use_gzip = switches.use_gzip;
@@ -655,7 +723,8 @@ int init(int argc, char* argv[]) {
   suppress_mp3_non_zero_padbits_sum = -1;
   suppress_mp3_inconsistent_emphasis_sum = -1;
   suppress_mp3_inconsistent_original_bit = -1;
-  mp3_parsing_cache_second_frame = -1;
+  mp3_index->start = -1;
+  mp3_index->offsets.clear();
   
   // init LZMA filters
   memset(&otf_xz_extra_params, 0, sizeof(otf_xz_extra_params));
@@ -671,6 +740,7 @@ int init(int argc, char* argv[]) {
   bool lzma_max_memory_set = false;
   bool lzma_thread_count_set = false;
   bool lzma_filters_set = false;
+  bool memory_budget_set = false;
   bool long_help = false;
   bool preserve_extension = false;
 
@@ -714,6 +784,15 @@ int init(int argc, char* argv[]) {
           }
         case 'S':
           {
+            if (parsePrefixText(argv[i] + 1, "selftest")) { // check the vector kernels and exit
+              if (!kernel_self_tests()) exit(1);
+              printf("Kernel self tests passed\n");
+              exit(0);
+            }
+            if (parsePrefixText(argv[i] + 1, "streamtime")) { // per-stream time budget
+              stream_time_budget = parseIntUntilEnd(argv[i] + 11, "stream time budget");
+              break;
+            }
             if (min_ident_size_set) {
               error(ERR_ONLY_SET_MIN_SIZE_ONCE);
             }
@@ -887,6 +966,16 @@ int init(int argc, char* argv[]) {
                   exit(1);
                 }
                 preflate_meta_block_size = mbsize * 1024;
+              } else if (parsePrefixText(argv[i] + 1, "pfmin")) {
+                preflate_min_deflate_size = parseIntUntilEnd(argv[i] + 6, "preflate minimal deflate stream size");
+              } else if (parsePrefixText(argv[i] + 1, "pfrecon")) {
+                preflate_limits.maxReconPercent = parseIntUntilEnd(argv[i] + 8, "preflate maximal reconstruction data percentage");
+              } else if (parsePrefixText(argv[i] + 1, "pfstored")) {
+                preflate_limits.maxStoredPercent = parseIntUntilEnd(argv[i] + 9, "preflate maximal stored block percentage");
+                if (preflate_limits.maxStoredPercent > 100) {
+                  printf("ERROR: Stored block percentage must be inside 0..100\n");
+                  exit(1);
+                }
               } else {
                 printf("ERROR: Unknown switch \"%s\"\n", argv[i]);
                 exit(1);
@@ -896,6 +985,10 @@ int init(int argc, char* argv[]) {
           }
         case 'T':
           {
+            if (parsePrefixText(argv[i] + 1, "tmpdir")) { // directory for temporary files
+              set_temp_dir(argv[i] + 7);
+              break;
+            }
             bool set_to;
             switch (argv[i][2]) {
               case '+':
@@ -1100,7 +1193,14 @@ int init(int argc, char* argv[]) {
 
         case 'M':
           {
-            if (!parseSwitch(use_mjpeg, argv[i] + 1, "mjpeg")) {
+            if (parsePrefixText(argv[i] + 1, "mem")) { // global memory budget
+              if (memory_budget_set) {
+                printf("ERROR: Memory budget can only be set once\n");
+                exit(1);
+              }
+              memory_budget = parseIntUntilEnd(argv[i] + 4, "memory budget");
+              memory_budget_set = true;
+            } else if (!parseSwitch(use_mjpeg, argv[i] + 1, "mjpeg")) {
               printf("ERROR: Unknown switch \"%s\"\n", argv[i]);
               exit(1);
             }
@@ -1190,9 +1290,11 @@ int init(int argc, char* argv[]) {
     printf("  r            \"Recompress\" PCF file (restore original file)\n");
     printf("  o[filename]  Write output to [filename] <[input_file].pcf or file in header>\n");
     printf("  e            preserve original extension of input name for output name <off>\n");
+    printf("  tmpdir[path] Directory for temporary files <current directory>\n");
     printf("  c[lbn]       Compression method to use, l = lzma2, b = bZip2, n = none <l>\n");
     printf("  lm[amount]   Set maximal LZMA memory in MiB <%i>\n", lzma_max_memory_default());
     printf("  lt[count]    Set LZMA thread count <auto-detect: %i>\n", auto_detected_thread_count());
+    printf("  mem[amount]  Set global memory budget in MiB, 0 = fixed limits per stream <0>\n");
     if (long_help) {
       printf("  lf[+-][xpiatsd] Set LZMA filters (up to %d of them can be combined) <none>\n",
                                 LZMA_FILTERS_MAX - 1);
@@ -1214,7 +1316,12 @@ int init(int argc, char* argv[]) {
     //printf("  zl[1..9][1..9] zLib levels to try for compression (comma separated) <all>\n");
     if (long_help) {
       printf("  pfmeta[amount] Split deflate streams into meta blocks of this size in KiB <2048>\n");
+      printf("                 0 = adaptive, from stream size, thread count and memory limit\n");
       printf("  pfverify       Force preflate to verify its generated reconstruction data\n");
+      printf("  pfmin[size]    Skip deflate streams smaller than [size] bytes <0>\n");
+      printf("  pfrecon[pct]   Skip deflate streams when the reconstruction data grows above\n");
+      printf("                 [pct] percent of the compressed size <0 = off>\n");
+      printf("  pfstored[pct]  Skip deflate streams with more than [pct] percent stored blocks <0 = off>\n");
     }
     printf("  intense      Detect raw zLib headers, too. Slower and more sensitive <off>\n");
     if (long_help) {
@@ -1231,6 +1338,8 @@ int init(int argc, char* argv[]) {
       printf("  f            Fast mode, use first found compression lvl for all streams <off>\n");
       printf("  i[pos]       Ignore stream at input file position [pos] <none>\n");
       printf("  s[size]      Set minimal identical byte size to [size] <4 (64 intense mode)>\n");
+      printf("  streamtime[ms] Skip streams that take longer than [ms] to precompress <0 = off>\n");
+      printf("  selftest     Check the vector kernels against the bytewise ones and exit\n");
       printf("  pdfbmp[+-]   Wrap a BMP header around PDF images <off>\n");
       printf("  progonly[+-] Recompress progressive JPGs only (useful for PAQ) <off>\n");
       printf("  mjpeg[+-]    Insert huffman table for MJPEG recompression <on>\n");
@@ -1309,6 +1418,8 @@ int init(int argc, char* argv[]) {
 
   }
 
+  init_memory_budget();
+
   packjpg_mp3_dll_msg();
 
   return operation;
@@ -1323,6 +1434,7 @@ int init_comfort(int argc, char* argv[]) {
   bool level_switch = false;
   bool lzma_max_memory_set = false;
   bool lzma_thread_count_set = false;
+  bool memory_budget_set = false;
   bool lzma_filters_set = false;
   bool preserve_extension = false;
 
@@ -1351,7 +1463,8 @@ int init_comfort(int argc, char* argv[]) {
   suppress_mp3_non_zero_padbits_sum = -1;
   suppress_mp3_inconsistent_emphasis_sum = -1;
   suppress_mp3_inconsistent_original_bit = -1;
-  mp3_parsing_cache_second_frame = -1;
+  mp3_index->start = -1;
+  mp3_index->offsets.clear();
 
   // init LZMA filters
   memset(&otf_xz_extra_params, 0, sizeof(otf_xz_extra_params));
@@ -1417,6 +1530,9 @@ int init_comfort(int argc, char* argv[]) {
       fprintf(fnewini,";; Thread count for LZMA compression method\n");
       fprintf(fnewini,";; 0 = auto-detect\n");
       fprintf(fnewini,"LZMA_Thread_Count=0\n");
+      fprintf(fnewini,";; Global memory budget (in MiB)\n");
+      fprintf(fnewini,";; 0 = use fixed limits per stream type\n");
+      fprintf(fnewini,"Memory_Budget=0\n");
       fprintf(fnewini,";; LZMA filters to use (up to 3 of the them can be combined)\n");
       fprintf(fnewini,";; X = x86, P = PowerPC, I = IA-64, A = ARM, T = ARM-Thumb\n");
       fprintf(fnewini,";; S = SPARC, D = delta (must be followed by distance 1..256))\n");
@@ -1632,6 +1748,29 @@ int init_comfort(int argc, char* argv[]) {
           valid_param = true;
         }
 
+        if (strcmp(param, "memory_budget") == 0) {
+          if (memory_budget_set) {
+            printf("ERROR: Memory budget can only be set once\n");
+            wait_for_key();
+            exit(1);
+          }
+          unsigned int multiplicator = 1;
+          for (j = (strlen(value)-1); j >= 0; j--) {
+            memory_budget += ((unsigned int)(value[j])-'0') * multiplicator;
+            if ((multiplicator * 10) < multiplicator) {
+              exit(1);
+            }
+            multiplicator *= 10;
+          }
+          memory_budget_set = true;
+
+          if (memory_budget > 0) {
+            printf("INI: Set global memory budget to %i MiB\n", (int)memory_budget);
+          }
+
+          valid_param = true;
+        }
+
         if (strcmp(param, "lzma_thread_count") == 0) {
           if (lzma_thread_count_set) {
             error(ERR_ONLY_SET_LZMA_THREAD_ONCE);
@@ -2353,6 +2492,8 @@ int init_comfort(int argc, char* argv[]) {
 
   }
 
+  init_memory_budget();
+
   packjpg_mp3_dll_msg();
 
   return operation;
@@ -2427,19 +2568,19 @@ void denit_compress() {
    }
   #endif
 
-  remove(metatempfile);
-  remove(tempfile0);
-  remove(tempfile1);
-  remove(tempfile2);
-  remove(tempfile3);
+  close_temp_file(metatempfile);
+  close_temp_file(tempfile0);
+  close_temp_file(tempfile1);
+  close_temp_file(tempfile2);
+  close_temp_file(tempfile3);
 
   tempfilelist_count -= 8;
-  tempfilelist = (char*)realloc(tempfilelist, 20 * tempfilelist_count * sizeof(char));
+  tempfilelist = (char*)realloc(tempfilelist, TEMPFILE_NAME_SIZE * tempfilelist_count * sizeof(char));
 
   if (recursion_depth == 0) {
     free(ignore_list);
   }
-  if (decomp_io_buf != NULL) delete[] decomp_io_buf;
+  scratch_buf_release(decomp_io_buf);
   decomp_io_buf = NULL;
 
   denit();
@@ -2469,14 +2610,14 @@ void denit_decompress() {
     denit_decompress_otf();
   }
 
-  remove(metatempfile);
-  remove(tempfile0);
-  remove(tempfile1);
-  remove(tempfile2);
-  remove(tempfile3);
+  close_temp_file(metatempfile);
+  close_temp_file(tempfile0);
+  close_temp_file(tempfile1);
+  close_temp_file(tempfile2);
+  close_temp_file(tempfile3);
 
   tempfilelist_count -= 8;
-  tempfilelist = (char*)realloc(tempfilelist, 20 * tempfilelist_count * sizeof(char));
+  tempfilelist = (char*)realloc(tempfilelist, TEMPFILE_NAME_SIZE * tempfilelist_count * sizeof(char));
 
   denit();
 }
@@ -2513,6 +2654,8 @@ void denit_convert() {
 void denit() {
   safe_fclose(&fin);
   safe_fclose(&fout);
+
+  if (recursion_depth == 0) scratch_pool_clear();
 }
 
 // Brute mode detects a bit less than intense mode to avoid false positives
@@ -3073,6 +3216,20 @@ struct recompress_deflate_result {
   char zlib_window_bits;
 };
 
+// -pfverify check of one stream, running on its own thread while
+// the main thread already does the recursion pass for that stream
+struct preflate_verification {
+  std::vector<uint8_t> orgdata;
+  std::vector<unsigned char> recon_data;
+  const unsigned char* uncompressed;
+  uint64_t uncompressed_size;
+  bool matches;
+  bool running;
+  std::thread worker;
+
+  preflate_verification() : uncompressed(NULL), uncompressed_size(0), matches(false), running(false) {}
+};
+
 void debug_deflate_detected(const recompress_deflate_result& rdres, const char* type) {
   if (DEBUG_MODE) {
     print_debug_percent();
@@ -3137,7 +3294,7 @@ public:
   virtual size_t write(const unsigned char* buffer, const size_t size) {
     print_work_sign(true);
     if (_in_memory) {
-      if (_written + size >= MAX_IO_BUFFER_SIZE) {
+      if (_written + size >= (uint64_t)decomp_io_buf_size) {
         _in_memory = false;
         write_ftempout_if_not_present(_written, true, true);
       } else {
@@ -3159,7 +3316,58 @@ private:
   bool& _in_memory;
 };
 
-recompress_deflate_result try_recompression_deflate(FILE* file) {
+bool preflate_reencode_matches(const std::vector<uint8_t>& orgdata, const std::vector<unsigned char>& recon_data,
+                               InputStream& uncompressed, const uint64_t uncompressed_size) {
+  MemStream reencoded_deflate;
+  return preflate_reencode(reencoded_deflate, recon_data, uncompressed, uncompressed_size, [] {})
+         && orgdata == reencoded_deflate.data();
+}
+
+void write_preflate_error_file(const std::vector<uint8_t>& orgdata) {
+  static size_t counter = 0;
+  char namebuf[50];
+  while (true) {
+    snprintf(namebuf, 49, "preflate_error_%04d.raw", counter++);
+    FILE* f = fopen(namebuf, "rb");
+    if (f) {
+      fclose(f);
+      continue;
+    }
+    f = fopen(namebuf, "wb");
+    fwrite(orgdata.data(), 1, orgdata.size(), f);
+    fclose(f);
+    break;
+  }
+}
+
+void preflate_verification_start(preflate_verification& v, std::vector<uint8_t>&& orgdata,
+                                 const recompress_deflate_result& rdres) {
+  v.orgdata = std::move(orgdata);
+  v.recon_data = rdres.recon_data;
+  // the recursion pass gets its own decomp_io_buf, so this one
+  // stays untouched until the verification is finished
+  v.uncompressed = decomp_io_buf;
+  v.uncompressed_size = rdres.uncompressed_stream_size;
+  v.matches = false;
+  v.running = true;
+  v.worker = std::thread([&v]() {
+    MemStream uncompressed_mem(std::vector<uint8_t>(v.uncompressed, v.uncompressed + v.uncompressed_size));
+    v.matches = preflate_reencode_matches(v.orgdata, v.recon_data, uncompressed_mem, v.uncompressed_size);
+  });
+}
+
+bool preflate_verification_finish(preflate_verification& v) {
+  v.worker.join();
+  v.running = false;
+  if (!v.matches) {
+    write_preflate_error_file(v.orgdata);
+  }
+  return v.matches;
+}
+
+// if verification is given, an accepted in-memory stream is verified on a separate thread
+// that has to be finished by the caller, otherwise the verification is done right here
+recompress_deflate_result try_recompression_deflate(FILE* file, preflate_verification* verification = NULL) {
   if (file == fin) {
     seek_64(file, input_file_pos);
   } else {
@@ -3170,15 +3378,22 @@ recompress_deflate_result try_recompression_deflate(FILE* file) {
   memset(&result, 0, sizeof(result));
   
   OwnFileInputStream is(file);
+  stream_time_start();
 
   {
     result.uncompressed_in_memory = true;
     UncompressedOutStream uos(result.uncompressed_in_memory);
     uint64_t compressed_stream_size = 0;
+    // the size hint only applies to this stream, not to the ones found inside it
+    uint64_t expected_size = preflate_expected_size;
+    preflate_expected_size = 0;
     result.accepted = preflate_decode(uos, result.recon_data,
                                       compressed_stream_size, is, []() { print_work_sign(true); },
-                                      0,
-                                      preflate_meta_block_size); // you can set a minimum deflate stream size here
+                                      preflate_min_deflate_size,
+                                      preflate_meta_block_size,
+                                      []() { return stream_time_exceeded(); },
+                                      preflate_limits,
+                                      expected_size);
     result.compressed_stream_size = compressed_stream_size;
     result.uncompressed_stream_size = uos.written();
 
@@ -3192,29 +3407,18 @@ recompress_deflate_result try_recompression_deflate(FILE* file) {
       std::vector<uint8_t> orgdata(result.compressed_stream_size);
       is2.read(orgdata.data(), orgdata.size());
 
-      MemStream reencoded_deflate;
+      if (verification && result.uncompressed_in_memory) {
+        preflate_verification_start(*verification, std::move(orgdata), result);
+        return result;
+      }
+
       MemStream uncompressed_mem(result.uncompressed_in_memory ? std::vector<uint8_t>(decomp_io_buf, decomp_io_buf + result.uncompressed_stream_size) : std::vector<uint8_t>());
       OwnFileInputStream uncompressed_file(result.uncompressed_in_memory ? NULL : ftempout);
-      if (!preflate_reencode(reencoded_deflate, result.recon_data, 
-                             result.uncompressed_in_memory ? (InputStream&)uncompressed_mem : (InputStream&)uncompressed_file, 
-                             result.uncompressed_stream_size,
-                             [] {})
-          || orgdata != reencoded_deflate.data()) {
+      if (!preflate_reencode_matches(orgdata, result.recon_data,
+                                     result.uncompressed_in_memory ? (InputStream&)uncompressed_mem : (InputStream&)uncompressed_file,
+                                     result.uncompressed_stream_size)) {
         result.accepted = false;
-        static size_t counter = 0;
-        char namebuf[50];
-        while (true) {
-          snprintf(namebuf, 49, "preflate_error_%04d.raw", counter++);
-          FILE* f = fopen(namebuf, "rb");
-          if (f) {
-            fclose(f);
-            continue;
-          }
-          f = fopen(namebuf, "wb");
-          fwrite(orgdata.data(), 1, orgdata.size(), f);
-          fclose(f);
-          break;
-        }
+        write_preflate_error_file(orgdata);
       }
     }
   }
@@ -3523,7 +3727,8 @@ void try_decompression_deflate_type(unsigned& dcounter, unsigned& rcounter,
   init_decompression_variables();
 
   // try to decompress at current position
-  recompress_deflate_result rdres = try_recompression_deflate(fin);
+  preflate_verification verification;
+  recompress_deflate_result rdres = try_recompression_deflate(fin, &verification);
 
   if (rdres.uncompressed_stream_size > 0) { // seems to be a zLib-Stream
     decompressed_streams_count++;
@@ -3531,6 +3736,15 @@ void try_decompression_deflate_type(unsigned& dcounter, unsigned& rcounter,
 
     debug_deflate_detected(rdres, debugname);
 
+    // recurse while the stream is being verified, the recursion result is dropped
+    // again if the verification fails
+    recursion_result r;
+    bool recursion_done = false;
+    if (verification.running) {
+      r = recursion_write_file_and_compress_verified(rdres, verification);
+      recursion_done = true;
+    }
+
     if (rdres.accepted) {
       recompressed_streams_count++;
       rcounter++;
@@ -3547,7 +3761,9 @@ void try_decompression_deflate_type(unsigned& dcounter, unsigned& rcounter,
       end_uncompressed_data();
 
       // check recursion
-      recursion_result r = recursion_write_file_and_compress(rdres);
+      if (!recursion_done) {
+        r = recursion_write_file_and_compress(rdres);
+      }
 
 #if 0
       // Do we really want to allow uncompressed streams that are smaller than the compressed
@@ -3673,17 +3889,110 @@ void show_used_levels() {
   printf("\n");
 }
 
+bool jpg_header_found(const unsigned char* buf) {
+  return (buf[0] == 0xFF) && (buf[1] == 0xD8) && (buf[2] == 0xFF) && (
+           (buf[3] == 0xC0) || (buf[3] == 0xC2) || (buf[3] == 0xC4) || ((buf[3] >= 0xDB) && (buf[3] <= 0xFE))
+         );
+}
+
+// Looks for the end of a JPG whose SOI (FF D8) is at start and is followed by first_marker.
+// Returns the length of the JPG or 0 if it isn't a valid one.
+long long jpg_stream_length(long long start, unsigned char first_marker, bool& progressive_flag) {
+  bool done = false, found = false;
+  bool hasQuantTable = (first_marker == 0xDB);
+  progressive_flag = (first_marker == 0xC2);
+  long long pos = start + 2;
+
+  // marker segments are read from in_buf as long as they are inside of it
+  const unsigned char* hdr = in;
+  do{
+    if (((pos + 5) <= (in_buf_pos + IN_BUF_SIZE)) && ((pos + 5) <= fin_length)) {
+      hdr = in_buf + (pos - in_buf_pos);
+    } else {
+      seek_64(fin, pos);
+      if (fread(in, 1, 5, fin) != 5) break;
+      hdr = in;
+    }
+    if (hdr[0] != 0xFF) break;
+    int length = (int)hdr[2]*256+(int)hdr[3];
+    switch (hdr[1]){
+      case 0xDB : {
+        // FF DB XX XX QtId ...
+        // Marker length (XX XX) must be = 2 + (multiple of 65 <= 260)
+        // QtId:
+        // bit 0..3: number of QT (0..3, otherwise error)
+        // bit 4..7: precision of QT, 0 = 8 bit, otherwise 16 bit               
+        if (length<=262 && ((length-2)%65)==0 && hdr[4]<=3) {
+          hasQuantTable = true;
+          pos += length+2;
+        }
+        else
+          done = true;
+        break;
+      }
+      case 0xC4 : {
+        done = ((hdr[4]&0xF)>3 || (hdr[4]>>4)>1);
+        pos += length+2;
+        break;
+      }
+      case 0xDA : found = hasQuantTable;
+      case 0xD9 : done = true; break; //EOI with no SOS?
+      case 0xC2 : progressive_flag = true;
+      case 0xC0 : done = (hdr[4] != 0x08);
+      default: pos += length+2;
+    }
+  }
+  while (!done);
+
+  if (found){
+    found = done = false;
+    pos += 5;
+
+    bool is_marker = ( hdr[4] == 0xFF );
+    size_t consumed = 0;
+    // scan the rest of in_buf first, then continue reading from the file
+    long long in_buf_end = min(in_buf_pos + IN_BUF_SIZE, fin_length);
+    if (pos < in_buf_end) {
+      done = jpg_scan_entropy_data(in_buf + (pos - in_buf_pos), in_buf_end - pos, progressive_flag, is_marker, found, consumed);
+      pos += consumed;
+    }
+    if (!done) {
+      seek_64(fin, pos);
+      size_t bytesRead = 0;
+      while (!done && (bytesRead = fread(in, sizeof(in[0]), CHUNK, fin))){
+        done = jpg_scan_entropy_data(in, bytesRead, progressive_flag, is_marker, found, consumed);
+        pos += consumed;
+      }
+    }
+  }
+
+  return found ? (pos - start) : 0;
+}
+
 bool compress_file(float min_percent, float max_percent) {
 
   comp_decomp_state = P_COMPRESS;
 
+  // queued JPGs, GIFs and MP3s belong to the file of the outer recursion level
+  std::deque<std::shared_ptr<jpg_batch_frame>> outer_jpg_batch;
+  outer_jpg_batch.swap(jpg_batch);
+  std::deque<std::shared_ptr<gif_batch_stream>> outer_gif_batch;
+  outer_gif_batch.swap(gif_batch);
+  std::deque<std::shared_ptr<mp3_batch_stream>> outer_mp3_batch;
+  outer_mp3_batch.swap(mp3_batch);
+
   init_temp_files();
-  decomp_io_buf = new unsigned char[MAX_IO_BUFFER_SIZE];
+  decomp_io_buf_size = io_buffer_size_for_budget();
+  decomp_io_buf = scratch_buf_get(decomp_io_buf_size);
 
   global_min_percent = min_percent;
   global_max_percent = max_percent;
 
-  if (recursion_depth == 0) write_header();
+  if (recursion_depth == 0) {
+    write_header();
+    pjglib_abort_check = stream_time_exceeded;
+    pmplib_abort_check = stream_time_exceeded;
+  }
   uncompressed_length = -1;
   uncompressed_bytes_total = 0;
   uncompressed_bytes_written = 0;
@@ -3757,7 +4066,10 @@ bool compress_file(float min_percent, float max_percent) {
 
           input_file_pos += header_length;
 
+          // 0xFFFFFFFF means the size is in the ZIP64 extra field
+          preflate_expected_size = uncompressed_size != 0xFFFFFFFF ? uncompressed_size : 0;
           try_decompression_zip(header_length);
+          preflate_expected_size = 0;
 
           cb += header_length;
 
@@ -4075,7 +4387,7 @@ bool compress_file(float min_percent, float max_percent) {
           cb += 6;
         } else if (idat_count > 1) {
           // copy to temp0.dat before trying to recompress
-          remove(tempfile0);
+          remove_temp_file(tempfile0);
           fpng = tryOpen(tempfile0,"w+b");
 
           seek_64(fin, input_file_pos + 6); // start after zLib header
@@ -4133,78 +4445,17 @@ bool compress_file(float min_percent, float max_percent) {
     }
 
     if ((!compressed_data_found) && (use_jpg)) { // no GIF header -> JPG header?
-      if ((in_buf[cb] == 0xFF) && (in_buf[cb + 1] == 0xD8) && (in_buf[cb + 2] == 0xFF) && (
-           (in_buf[cb + 3] == 0xC0) || (in_buf[cb + 3] == 0xC2) || (in_buf[cb + 3] == 0xC4) || ((in_buf[cb + 3] >= 0xDB) && (in_buf[cb + 3] <= 0xFE))
-         )) { // SOI (FF D8) followed by a valid marker for Baseline/Progressive JPEGs
+      if (jpg_header_found(in_buf + cb)) { // SOI (FF D8) followed by a valid marker for Baseline/Progressive JPEGs
         saved_input_file_pos = input_file_pos;
         saved_cb = cb;
 
-        bool done = false, found = false;
-        bool hasQuantTable = (in_buf[cb + 3] == 0xDB);
-        bool progressive_flag = (in_buf[cb + 3] == 0xC2);
-        input_file_pos+=2;
-
-        do{
-          seek_64(fin, input_file_pos );
-          if ((fread(in, 1, 5, fin) != 5) || (in[0] != 0xFF))
-              break;
-          int length = (int)in[2]*256+(int)in[3];
-          switch (in[1]){
-            case 0xDB : {
-              // FF DB XX XX QtId ...
-              // Marker length (XX XX) must be = 2 + (multiple of 65 <= 260)
-              // QtId:
-              // bit 0..3: number of QT (0..3, otherwise error)
-              // bit 4..7: precision of QT, 0 = 8 bit, otherwise 16 bit               
-              if (length<=262 && ((length-2)%65)==0 && in[4]<=3) {
-                hasQuantTable = true;
-                input_file_pos += length+2;
-              }
-              else
-                done = true;
-              break;
-            }
-            case 0xC4 : {
-              done = ((in[4]&0xF)>3 || (in[4]>>4)>1);
-              input_file_pos += length+2;
-              break;
-            }
-            case 0xDA : found = hasQuantTable;
-            case 0xD9 : done = true; break; //EOI with no SOS?
-            case 0xC2 : progressive_flag = true;
-            case 0xC0 : done = (in[4] != 0x08);
-            default: input_file_pos += length+2;
-          }
-        }
-        while (!done);
-
-        if (found){
-          found = done = false;
-          input_file_pos += 5;
-
-          bool isMarker = ( in[4] == 0xFF );
-          size_t bytesRead = 0;
-          while (!done && (bytesRead = fread(in, sizeof(in[0]), CHUNK, fin))){
-            for (size_t i = 0; !done && (i < bytesRead); i++){
-              input_file_pos++;
-              if (!isMarker){
-                isMarker = ( in[i] == 0xFF );
-              }
-              else{
-                done = (in[i] && ((in[i]&0xF8) != 0xD0) && ((progressive_flag)?(in[i] != 0xC4) && (in[i] != 0xDA):true));
-                found = (in[i] == 0xD9);
-                isMarker = false;
-              }
-            }
-          }
-        }
+        bool progressive_flag;
+        long long jpg_length = jpg_stream_length(input_file_pos, in_buf[cb + 3], progressive_flag);
 
-        if (found){
-          long long jpg_length = input_file_pos - saved_input_file_pos;
-          input_file_pos = saved_input_file_pos;
+        if (jpg_length > 0) {
           try_decompression_jpg(jpg_length, progressive_flag);
         }
-        if (!found || !compressed_data_found) {
+        if ((jpg_length == 0) || !compressed_data_found) {
           input_file_pos = saved_input_file_pos;
           cb = saved_cb;
         }
@@ -4213,117 +4464,17 @@ bool compress_file(float min_percent, float max_percent) {
 
     if ((!compressed_data_found) && (use_mp3)) { // no JPG header -> MP3 header?
       if ((in_buf[cb] == 0xFF) && ((in_buf[cb + 1] & 0xE0) == 0xE0)) { // frame start
-        int mpeg = -1;
-        int layer = -1;
-        int samples = -1;
-        int channels = -1;
-        int protection = -1;
         int type = -1;
-
-        int bits;
-        int padding;
-        int frame_size;
         int n = 0;
-        long long mp3_parsing_cache_second_frame_candidate = -1;
-        long long mp3_parsing_cache_second_frame_candidate_size = -1;
-
         long long mp3_length = 0;
 
         saved_input_file_pos = input_file_pos;
         saved_cb = cb;
 
-        long long act_pos = input_file_pos;
-
-        // parse frames until first invalid frame is found or end-of-file
-        seek_64(fin, act_pos);
-        while (fread(in, 1, 4, fin) == 4) {
-          // check syncword
-          if ((in[0] != 0xFF) || ((in[1] & 0xE0) != 0xE0)) break;
-          // compare data from header
-          if (n == 0) {
-            mpeg        = (in[1] >> 3) & 0x3;
-            layer       = (in[1] >> 1) & 0x3;
-            protection  = (in[1] >> 0) & 0x1;
-            samples     = (in[2] >> 2) & 0x3;
-            channels    = (in[3] >> 6) & 0x3;
-            type = MBITS( in[1], 5, 1 );
-            // avoid slowdown and multiple verbose messages on unsupported types that have already been detected
-            if ((type != MPEG1_LAYER_III) && (saved_input_file_pos <= suppress_mp3_type_until[type])) {
-                break;
-            }
-          } else {
-            if (n == 1) {
-              mp3_parsing_cache_second_frame_candidate = act_pos;
-              mp3_parsing_cache_second_frame_candidate_size = act_pos - saved_input_file_pos;
-            }
-            if (type == MPEG1_LAYER_III) { // supported MP3 type, all header information must be identical to the first frame
-              if (
-                (mpeg       != ((in[1] >> 3) & 0x3)) ||
-                (layer      != ((in[1] >> 1) & 0x3)) ||
-                (protection != ((in[1] >> 0) & 0x1)) ||
-                (samples    != ((in[2] >> 2) & 0x3)) ||
-                (channels   != ((in[3] >> 6) & 0x3)) ||
-                (type       != MBITS( in[1], 5, 1))) break;
-            } else { // unsupported type, compare only type, ignore the other header information to get a longer stream
-              if (type != MBITS( in[1], 5, 1)) break;
-            }
-          }
-
-          bits     = (in[2] >> 4) & 0xF;
-          padding  = (in[2] >> 1) & 0x1;
-          // check for problems
-          if ((mpeg == 0x1) || (layer == 0x0) ||
-              (bits == 0x0) || (bits == 0xF) || (samples == 0x3)) break;
-          // find out frame size
-          frame_size = frame_size_table[mpeg][layer][samples][bits];
-          if (padding) frame_size += (layer == LAYER_I) ? 4 : 1;
-
-          // if this frame was part of a stream that already has been parsed, skip parsing
-          if (n == 0) {
-            if (act_pos == mp3_parsing_cache_second_frame) {
-              n = mp3_parsing_cache_n;
-              mp3_length = mp3_parsing_cache_mp3_length;
-
-              // update values
-              mp3_parsing_cache_second_frame = act_pos + frame_size;
-              mp3_parsing_cache_n -= 1;
-              mp3_parsing_cache_mp3_length -= frame_size;
-
-              break;
-            }
-          }
-
-          n++;
-          mp3_length += frame_size;
-          act_pos += frame_size;
-
-          // if supported MP3 type, validate frames
-          if ((type == MPEG1_LAYER_III) && (frame_size > 4)) {
-            unsigned char header2 = in[2];
-            unsigned char header3 = in[3];
-            if (fread(in, 1, frame_size - 4, fin) != (unsigned int)(frame_size - 4)) {
-              // discard incomplete frame
-              n--;
-              mp3_length -= frame_size;
-              break;
-            }
-            if (!is_valid_mp3_frame(in, header2, header3, protection)) {
-                n = 0;
-                break;
-            }
-          } else {
-            seek_64(fin, act_pos);
-          }
-        }
+        mp3_parse_frames(input_file_pos, type, n, mp3_length);
 
         // conditions for proper first frame: 5 consecutive frames
         if (n >= 5) {
-          if (mp3_parsing_cache_second_frame_candidate > -1) {
-            mp3_parsing_cache_second_frame = mp3_parsing_cache_second_frame_candidate;
-            mp3_parsing_cache_n = n - 1;
-            mp3_parsing_cache_mp3_length = mp3_length - mp3_parsing_cache_second_frame_candidate_size;
-          }
-
           long long position_length_sum = saved_input_file_pos + mp3_length;
 
           // type must be MPEG-1, Layer III, packMP3 won't process any other files
@@ -4544,13 +4695,54 @@ bool compress_file(float min_percent, float max_percent) {
 
   denit_compress();
 
+  jpg_batch.swap(outer_jpg_batch);
+  gif_batch.swap(outer_gif_batch);
+  mp3_batch.swap(outer_mp3_batch);
+
   return (anything_was_used || non_zlib_was_used);
 }
 
-int BrunsliStringWriter(void* data, const uint8_t* buf, size_t count) {
-	std::string* output = reinterpret_cast<std::string*>(data);
-	output->append(reinterpret_cast<const char*>(buf), count);
-	return count;
+// Restored brunsli JPGs are written to fout while brunsli produces them. If the Motion JPEG DHT
+// was inserted on compression, everything up to the first FF DA (SOS) is held back in head,
+// so the DHT in front of it can be left out.
+struct jpg_restore_sink {
+  bool strip_mjpeg_dht;
+  bool found_ff;
+  bool corrupted;
+  long long written;
+  std::vector<unsigned char> head;
+};
+
+int jpg_restore_sink_write(void* data, const uint8_t* buf, size_t count) {
+  jpg_restore_sink* sink = (jpg_restore_sink*)data;
+  size_t i = 0;
+  while (sink->strip_mjpeg_dht && (i < count)) {
+    unsigned char c = buf[i++];
+    sink->head.push_back(c);
+    if (!sink->found_ff) {
+      sink->found_ff = (c == 0xFF);
+      continue;
+    }
+    sink->found_ff = false;
+    if (c != 0xDA) continue;
+
+    // remove motion JPG huffman table
+    long long dht_pos = (long long)sink->head.size() - 2 - MJPGDHT_LEN;
+    if (dht_pos < 0) {
+      sink->corrupted = true;
+      return -1;
+    }
+    own_fwrite(sink->head.data(), 1, dht_pos, fout);
+    own_fwrite(sink->head.data() + dht_pos + MJPGDHT_LEN, 1, 2, fout);
+    sink->written += dht_pos + 2;
+    sink->head.clear();
+    sink->strip_mjpeg_dht = false;
+  }
+  if (i < count) {
+    own_fwrite(buf + i, 1, count - i, fout);
+    sink->written += count - i;
+  }
+  return count;
 }
 
 void decompress_file() {
@@ -4775,25 +4967,19 @@ while (fin_pos < fin_length) {
       cout << "Recompressed length: " << recompressed_data_length << " - decompressed length: " << decompressed_data_length << endl;
       }
 
-      remove(tempfile1);
-      ftempout = tryOpen(tempfile1,"wb");
+      // decompressed and recompressed data are kept in memory unless they get too large
+      std::vector<unsigned char> decomp_mem, recomp_mem;
+      gif_io src = gif_io_file(fin);
+      gif_io decomp = gif_io_mem(&decomp_mem, tempfile1);
+      gif_io recomp = gif_io_mem(&recomp_mem, tempfile2);
 
-      fast_copy(fin, ftempout, decompressed_data_length);
-
-      safe_fclose(&ftempout);
-
-      remove(tempfile2);
+      gif_io_copy(&src, &decomp, decompressed_data_length);
+      gif_io_seek(&decomp, 0);
 
       bool recompress_success = false;
 
-      ftempout = tryOpen(tempfile1,"rb");
-      frecomp = tryOpen(tempfile2,"wb");
-
       // recompress data
-      recompress_success = recompress_gif(ftempout, frecomp, block_size, NULL, &gDiff);
-
-      safe_fclose(&frecomp);
-      safe_fclose(&ftempout);
+      recompress_success = recompress_gif(&decomp, &recomp, block_size, NULL, &gDiff, NULL, gif_frames_ahead_enabled(&decomp));
 
       if (recompress_success_needed) {
         if (!recompress_success) {
@@ -4805,14 +4991,12 @@ while (fin_pos < fin_length) {
 
       long long old_fout_pos = tell_64(fout);
 
-      frecomp = tryOpen(tempfile2,"rb");
-
-      fast_copy(frecomp, fout, recompressed_data_length);
-
-      safe_fclose(&frecomp);
+      gif_io fout_io = gif_io_file(fout);
+      gif_io_seek(&recomp, 0);
+      gif_io_copy(&recomp, &fout_io, recompressed_data_length);
 
-      remove(tempfile2);
-      remove(tempfile1);
+      gif_io_close(&recomp);
+      gif_io_close(&decomp);
 
       if (penalty_bytes_stored) {
         fflush(fout);
@@ -4857,44 +5041,44 @@ while (fin_pos < fin_length) {
       unsigned char* jpg_mem_in = NULL;
       unsigned char* jpg_mem_out = NULL;
       unsigned int jpg_mem_out_size = -1;
-      bool in_memory = (recompressed_data_length <= JPG_MAX_MEMORY_SIZE);
+      // brunsli data can only be restored in memory, no matter what -mem allows now
+      bool in_memory = brunsli_used || memory_budget_allows(recompressed_data_length, JPG_MAX_MEMORY_SIZE, 4);
       bool recompress_success = false;
 
       if (in_memory) {
-        jpg_mem_in = new unsigned char[decompressed_data_length];
+        jpg_mem_in = scratch_buf_get(decompressed_data_length);
 
         fast_copy(fin, jpg_mem_in, decompressed_data_length);
 
 		if (brunsli_used) {
 			brunsli::JPEGData jpegData;
 			if (brunsli::BrunsliDecodeJpeg(jpg_mem_in, decompressed_data_length, &jpegData, brotli_used) == brunsli::BRUNSLI_OK) {
-				if (mjpg_dht_used) {
-					jpg_mem_out = new unsigned char[recompressed_data_length + MJPGDHT_LEN];
-				}
-				else {
-					jpg_mem_out = new unsigned char[recompressed_data_length];
-				}
-				std::string output;
-				brunsli::JPEGOutput writer(BrunsliStringWriter, &output);
-				if (brunsli::WriteJpeg(jpegData, writer)) {
-					jpg_mem_out_size = output.length();
-					memcpy(jpg_mem_out, output.data(), jpg_mem_out_size);
-					recompress_success = true;
+				// the JPG goes straight to fout, see jpg_restore_sink
+				jpg_restore_sink sink;
+				sink.strip_mjpeg_dht = mjpg_dht_used;
+				sink.found_ff = false;
+				sink.corrupted = false;
+				sink.written = 0;
+				recompress_success = brunsli::WriteJpeg(jpegData, brunsli::JPEGOutput(jpg_restore_sink_write, &sink));
+				if (sink.corrupted || (recompress_success && sink.strip_mjpeg_dht)) {
+					printf("ERROR: Motion JPG stream corrupted\n");
+					exit(1);
 				}
+				recompress_success = recompress_success && (sink.written == recompressed_data_length);
 			}
 		} else {
 			pjglib_init_streams(jpg_mem_in, 1, decompressed_data_length, jpg_mem_out, 1);
 			recompress_success = pjglib_convert_stream2mem(&jpg_mem_out, &jpg_mem_out_size, recompress_msg);
 		}
       } else {
-        remove(tempfile1);
+        remove_temp_file(tempfile1);
         ftempout = tryOpen(tempfile1,"wb");
 
         fast_copy(fin, ftempout, decompressed_data_length);
 
         safe_fclose(&ftempout);
 
-        remove(tempfile2);
+        remove_temp_file(tempfile2);
 
         recompress_success = pjglib_convert_file2file(tempfile1, tempfile2, recompress_msg);
       }
@@ -4909,7 +5093,9 @@ while (fin_pos < fin_length) {
         frecomp = tryOpen(tempfile2,"rb");
       }
 
-      if (mjpg_dht_used) {
+      if (in_memory && brunsli_used) {
+        // already written by jpg_restore_sink
+      } else if (mjpg_dht_used) {
         long long frecomp_pos = 0;
         bool found_ffda = false;
         bool found_ff = false;
@@ -4967,13 +5153,13 @@ while (fin_pos < fin_length) {
       }
 
       if (in_memory) {
-        if (jpg_mem_in != NULL) delete[] jpg_mem_in;
-        if (jpg_mem_out != NULL) delete[] jpg_mem_out;
+        scratch_buf_release(jpg_mem_in);
+        delete[] jpg_mem_out;
       } else {
         safe_fclose(&frecomp);
 
-        remove(tempfile2);
-        remove(tempfile1);
+        remove_temp_file(tempfile2);
+        remove_temp_file(tempfile1);
       }
       break;
     }
@@ -5014,20 +5200,33 @@ while (fin_pos < fin_length) {
       own_fwrite(in + 1, 1, base64_header_length - 1, fout);
 
       // read line length list
-      int line_count = fin_fget_vlint();
+      long long line_count = fin_fget_vlint();
 
-      unsigned int* base64_line_len = new unsigned int[line_count];
+      std::vector<base64_line_run> line_lengths;
 
       if (line_case == 2) {
-        for (int i = 0; i < line_count; i++) {
-          base64_line_len[i] = fin_fgetc();
+        for (long long i = 0; i < line_count; i++) {
+          base64_line_add(line_lengths, fin_fgetc());
+        }
+      } else if (line_case == 3) {
+        long long run_count = fin_fget_vlint();
+        for (long long i = 0; i < run_count; i++) {
+          base64_line_run run;
+          run.length = fin_fgetc();
+          run.count = fin_fget_vlint();
+          line_lengths.push_back(run);
         }
       } else {
-        base64_line_len[0] = fin_fgetc();
-        for (int i = 1; i < line_count; i++) {
-          base64_line_len[i] = base64_line_len[0];
+        unsigned int first_len = fin_fgetc();
+        if (line_case == 1) {
+          base64_line_run first = { first_len, line_count - 1 };
+          base64_line_run last = { (unsigned int)fin_fgetc(), 1 };
+          line_lengths.push_back(first);
+          line_lengths.push_back(last);
+        } else if (line_count > 0) {
+          base64_line_run all = { first_len, line_count };
+          line_lengths.push_back(all);
         }
-        if (line_case == 1) base64_line_len[line_count - 1] = fin_fgetc();
       }
 
       long long recompressed_data_length = fin_fget_vlint();
@@ -5050,15 +5249,13 @@ while (fin_pos < fin_length) {
 
       if (recursion_used) {
         recursion_result r = recursion_decompress(recursion_data_length);
-        base64_reencode(r.frecurse, fout, line_count, base64_line_len, r.file_length, decompressed_data_length);
+        base64_reencode(r.frecurse, fout, line_lengths, r.file_length, decompressed_data_length);
         safe_fclose(&r.frecurse);
-        remove(r.file_name);
+        close_temp_file(r.file_name);
         delete[] r.file_name;
       } else {
-        base64_reencode(fin, fout, line_count, base64_line_len, recompressed_data_length, decompressed_data_length);
+        base64_reencode(fin, fout, line_lengths, recompressed_data_length, decompressed_data_length);
       }
-
-      delete[] base64_line_len;
       break;
     }
     case D_BZIP2: { // bZip2 recompression
@@ -5105,7 +5302,7 @@ while (fin_pos < fin_length) {
         recursion_result r = recursion_decompress(recursion_data_length);
         retval = def_part_bzip2(r.frecurse, fout, level, decompressed_data_length, recompressed_data_length);
         safe_fclose(&r.frecurse);
-        remove(r.file_name);
+        close_temp_file(r.file_name);
         delete[] r.file_name;
       } else {
         retval = def_part_bzip2(fin, fout, level, decompressed_data_length, recompressed_data_length);
@@ -5153,26 +5350,27 @@ while (fin_pos < fin_length) {
       unsigned char* mp3_mem_in = NULL;
       unsigned char* mp3_mem_out = NULL;
       unsigned int mp3_mem_out_size = -1;
-      bool in_memory = (recompressed_data_length <= MP3_MAX_MEMORY_SIZE);
+      // both ways restore the same packMP3 data, so -mem only decides where the work is done
+      bool in_memory = memory_budget_allows(recompressed_data_length, MP3_MAX_MEMORY_SIZE, 4);
 
       bool recompress_success = false;
 
       if (in_memory) {
-        mp3_mem_in = new unsigned char[decompressed_data_length];
+        mp3_mem_in = scratch_buf_get(decompressed_data_length);
 
         fast_copy(fin, mp3_mem_in, decompressed_data_length);
 
         pmplib_init_streams(mp3_mem_in, 1, decompressed_data_length, mp3_mem_out, 1);
         recompress_success = pmplib_convert_stream2mem(&mp3_mem_out, &mp3_mem_out_size, recompress_msg);
       } else {
-        remove(tempfile1);
+        remove_temp_file(tempfile1);
         ftempout = tryOpen(tempfile1,"wb");
 
         fast_copy(fin, ftempout, decompressed_data_length);
 
         safe_fclose(&ftempout);
 
-        remove(tempfile2);
+        remove_temp_file(tempfile2);
 
         recompress_success = pmplib_convert_file2file(tempfile1, tempfile2, recompress_msg);
       }
@@ -5186,7 +5384,7 @@ while (fin_pos < fin_length) {
       if (in_memory) {
         fast_copy(mp3_mem_out, fout, recompressed_data_length);
 
-        if (mp3_mem_in != NULL) delete[] mp3_mem_in;
+        scratch_buf_release(mp3_mem_in);
         if (mp3_mem_out != NULL) delete[] mp3_mem_out;
       } else {
         frecomp = tryOpen(tempfile2,"rb");
@@ -5195,8 +5393,8 @@ while (fin_pos < fin_length) {
 
         safe_fclose(&frecomp);
 
-        remove(tempfile2);
-        remove(tempfile1);
+        remove_temp_file(tempfile2);
+        remove_temp_file(tempfile1);
       }
       break;
     }
@@ -5296,7 +5494,7 @@ long long try_to_decompress_bzip2(FILE* file, int compression_level, long long&
 
   print_work_sign(true);
 
-  remove(tempfile1);
+  remove_temp_file(tempfile1);
   ftempout = tryOpen(tempfile1,"wb");
 
   if (file == fin) {
@@ -5911,6 +6109,97 @@ long long compare_files_penalty(FILE* file1, FILE* file2, long long pos1, long l
   return rek_same_byte_count;
 }
 
+// Same as compare_files_penalty, with the data of file2 in memory. Identical runs are skipped
+// with byteCompareLength, only mismatches are looked at byte by byte.
+long long compare_mem_penalty(FILE* file1, const unsigned char* mem, long long mem_size, long long pos1) {
+  long long same_byte_count = 0;
+  long long same_byte_count_penalty = 0;
+  long long rek_same_byte_count = 0;
+  long long rek_same_byte_count_penalty = -1;
+  bool endNow = false;
+
+  unsigned int local_penalty_bytes_len = 0;
+
+  unsigned int rek_penalty_bytes_len = 0;
+  bool use_penalty_bytes = false;
+
+  unsigned char* input_bytes = scratch_buf_get(CHUNK);
+
+  seek_64(file1, pos1);
+
+  while ((same_byte_count < mem_size) && (!endNow)) {
+    print_work_sign(true);
+
+    long long size1 = own_fread(input_bytes, 1, min((long long)CHUNK, mem_size - same_byte_count), file1);
+    if (size1 == 0) break;
+    const unsigned char* mem_bytes = mem + same_byte_count;
+
+    long long i = 0;
+    while (i < size1) {
+      unsigned same = byteCompareLength(input_bytes + i, mem_bytes + i, size1 - i);
+      if (same > 0) {
+        i += same;
+        same_byte_count += same;
+        same_byte_count_penalty += same;
+
+        if (same_byte_count_penalty > rek_same_byte_count_penalty) {
+          use_penalty_bytes = true;
+          rek_penalty_bytes_len = local_penalty_bytes_len;
+
+          rek_same_byte_count = same_byte_count;
+          rek_same_byte_count_penalty = same_byte_count_penalty;
+        }
+        if (i == size1) break;
+      }
+
+      same_byte_count_penalty -= 5; // 4 bytes = position, 1 byte = new byte
+
+      // if same_byte_count_penalty is too low, stop
+      if ((long long)(same_byte_count_penalty + (mem_size - same_byte_count)) < 0) {
+        endNow = true;
+        break;
+      }
+      // stop, if local_penalty_bytes_len gets too big
+      if ((local_penalty_bytes_len + 5) >= MAX_PENALTY_BYTES) {
+        endNow = true;
+        break;
+      }
+
+      local_penalty_bytes_len += 5;
+      // position
+      local_penalty_bytes[local_penalty_bytes_len-5] = (same_byte_count >> 24) % 256;
+      local_penalty_bytes[local_penalty_bytes_len-4] = (same_byte_count >> 16) % 256;
+      local_penalty_bytes[local_penalty_bytes_len-3] = (same_byte_count >> 8) % 256;
+      local_penalty_bytes[local_penalty_bytes_len-2] = same_byte_count % 256;
+      // new byte
+      local_penalty_bytes[local_penalty_bytes_len-1] = input_bytes[i];
+
+      same_byte_count++;
+      i++;
+
+      if (same_byte_count_penalty > rek_same_byte_count_penalty) {
+
+        use_penalty_bytes = true;
+        rek_penalty_bytes_len = local_penalty_bytes_len;
+
+        rek_same_byte_count = same_byte_count;
+        rek_same_byte_count_penalty = same_byte_count_penalty;
+      }
+    }
+  }
+
+  scratch_buf_release(input_bytes);
+
+  if ((rek_penalty_bytes_len > 0) && (use_penalty_bytes)) {
+    memcpy(penalty_bytes, local_penalty_bytes, rek_penalty_bytes_len);
+    penalty_bytes_len = rek_penalty_bytes_len;
+  } else {
+    penalty_bytes_len = 0;
+  }
+
+  return rek_same_byte_count;
+}
+
 void try_decompression_gzip(int gzip_header_length) {
   try_decompression_deflate_type(decompressed_gzip_count, recompressed_gzip_count, 
                                  D_GZIP, in_buf + cb + 2, gzip_header_length - 2, false,
@@ -6059,19 +6348,137 @@ void try_decompression_png_multi(FILE* fpng, int windowbits) {
 
 // GIF functions
 
-bool newgif_may_write;
-FILE* frecompress_gif = NULL;
-FILE* freadfunc = NULL;
+gif_io gif_io_file(FILE* file) {
+  gif_io io = { file, NULL, 0, NULL, 0, true };
+  return io;
+}
+
+gif_io gif_io_mem(std::vector<unsigned char>* mem, char* spill_name) {
+  gif_io io = { NULL, mem, 0, spill_name, 0, true };
+  return io;
+}
+
+long long gif_io_tell(gif_io* io) {
+  return (io->file != NULL) ? tell_64(io->file) : io->mem_pos;
+}
+
+void gif_io_seek(gif_io* io, long long pos) {
+  if (io->file != NULL) {
+    seek_64(io->file, pos);
+  } else {
+    io->mem_pos = pos;
+  }
+}
+
+size_t gif_io_read(gif_io* io, unsigned char* buf, size_t count) {
+  if (io->file != NULL) return own_fread(buf, 1, count, io->file);
+
+  long long available = (long long)io->mem->size() - io->mem_pos;
+  if ((long long)count > available) count = (available > 0) ? available : 0;
+  if (count > 0) {
+    memcpy(buf, io->mem->data() + io->mem_pos, count);
+    io->mem_pos += count;
+  }
+  return count;
+}
+
+// Makes room for end bytes in the memory buffer. Buffers that can be moved to a file are
+// charged to the memory budget, so all of them together stay below -mem. Returns false if
+// the budget (or GIF_MAX_MEMORY_SIZE without -mem) doesn't allow it.
+bool gif_io_reserve(gif_io* io, long long end) {
+  if (io->spill_name == NULL) return true; // only used without -mem, see gif_batch_enabled
+  if (end <= io->charged) return true;
+  // grow in steps to avoid reallocating on every write
+  long long capacity = max(end, 2 * io->charged);
+  if (!memory_budget_allows(capacity - io->charged, GIF_MAX_MEMORY_SIZE - io->charged, 1)) {
+    capacity = end;
+    if (!memory_budget_allows(capacity - io->charged, GIF_MAX_MEMORY_SIZE - io->charged, 1)) return false;
+  }
+  io->mem->reserve(capacity);
+  memory_budget_charge(capacity - io->charged);
+  io->charged = capacity;
+  return true;
+}
+
+// move the memory buffer to its file
+void gif_io_spill(gif_io* io) {
+  remove_temp_file(io->spill_name);
+  io->file = tryOpen(io->spill_name, "w+b");
+  fast_copy(io->mem->data(), io->file, io->mem->size());
+  seek_64(io->file, io->mem_pos);
+  std::vector<unsigned char>().swap(*io->mem);
+  memory_budget_charge(-io->charged);
+  io->charged = 0;
+}
+
+size_t gif_io_write(gif_io* io, const unsigned char* buf, size_t count) {
+  if (io->file == NULL) {
+    long long end = io->mem_pos + count;
+    if (gif_io_reserve(io, end)) {
+      if (end > (long long)io->mem->size()) io->mem->resize(end);
+      if (count > 0) memcpy(io->mem->data() + io->mem_pos, buf, count);
+      io->mem_pos = end;
+      return count;
+    }
+    gif_io_spill(io);
+  }
+  return own_fwrite(buf, 1, count, io->file);
+}
+
+void gif_io_copy(gif_io* src, gif_io* dst, long long bytecount) {
+  if ((src->file != NULL) && (dst->file != NULL)) {
+    fast_copy(src->file, dst->file, bytecount);
+  } else if (src->file == NULL) {
+    long long available = (long long)src->mem->size() - src->mem_pos;
+    if (bytecount > available) bytecount = available;
+    if (bytecount <= 0) return;
+    gif_io_write(dst, src->mem->data() + src->mem_pos, bytecount);
+    src->mem_pos += bytecount;
+  } else {
+    unsigned char buf[CHECKBUF_SIZE];
+    while (bytecount > 0) {
+      size_t n = gif_io_read(src, buf, (size_t)min(bytecount, (long long)CHECKBUF_SIZE));
+      if (n == 0) break;
+      gif_io_write(dst, buf, n);
+      bytecount -= n;
+    }
+  }
+}
+
+// change the first two bytes (GIF8xa <-> PGF8xa), keeping the position
+void gif_io_put_signature(gif_io* io, unsigned char c1, unsigned char c2) {
+  long long pos = gif_io_tell(io);
+  unsigned char signature[2] = { c1, c2 };
+  gif_io_seek(io, 0);
+  gif_io_write(io, signature, 2);
+  gif_io_seek(io, pos);
+}
+
+void gif_io_close(gif_io* io) {
+  if ((io->file != NULL) && (io->spill_name != NULL)) {
+    safe_fclose(&io->file);
+    remove_temp_file(io->spill_name);
+  }
+  memory_budget_charge(-io->charged);
+  io->charged = 0;
+}
+
+// compares the recompressed GIF with the original data at pos of fin, see compare_files_penalty
+long long gif_io_compare_penalty(gif_io* io, long long pos) {
+  if (io->file != NULL) return compare_files_penalty(fin, io->file, pos, 0);
+  return compare_mem_penalty(fin, io->mem->data(), io->mem->size(), pos);
+}
 
 int readFunc(GifFileType* GifFile, GifByteType* buf, int count)
 {
-  return own_fread(buf, 1, count, freadfunc);
+  return gif_io_read((gif_io*)GifFile->UserData, buf, count);
 }
 
 int writeFunc(GifFileType* GifFile, const GifByteType* buf, int count)
 {
-  if (newgif_may_write) {
-    return own_fwrite(buf, 1, count, frecompress_gif);
+  gif_io* io = (gif_io*)GifFile->UserData;
+  if (io->may_write) {
+    return gif_io_write(io, buf, count);
   } else {
     return count;
   }
@@ -6113,42 +6520,210 @@ void free_gif_screenbuf(unsigned char** ScreenBuff, GifFileType* myGifFile) {
   }
 }
 
-bool r_gif_result(unsigned char** ScreenBuff, GifFileType* myGifFile, GifFileType* newGifFile, bool result) {
-  free_gif_screenbuf(ScreenBuff, myGifFile);
-  DGifCloseFile(myGifFile);
-  EGifCloseFile(newGifFile);
-  return result;
-}
-bool r_gif_error(unsigned char** ScreenBuff, GifFileType* myGifFile, GifFileType* newGifFile) {
-  return r_gif_result(ScreenBuff, myGifFile, newGifFile, false);
-}
-bool r_gif_ok(unsigned char** ScreenBuff, GifFileType* myGifFile, GifFileType* newGifFile) {
-  return r_gif_result(ScreenBuff, myGifFile, newGifFile, true);
-}
-
-bool recompress_gif(FILE* srcfile, FILE* dstfile, unsigned char block_size, GifCodeStruct* g, GifDiffStruct* gd) {
-  int i, j;
-  long long last_pos = -1;
-  int Row, Col, Width, Height, ExtCode;
-  long long src_pos, init_src_pos;
+// An image of the GIF that recompress_gif works on. The encoder starts over at every image, so
+// images can be encoded ahead on worker threads, see gif_frame_encode_ahead.
+struct gif_frame {
+  long long gap_pos; // end of the previous image, -1 for the first one
+  long long pixel_pos;
+  int Row, Col, Width, Height, Interlace;
+  ColorMapObject* ColorMap;
+  int code_start; // index of the first LZW code of the image in g, see decompress_gif
+  std::shared_ptr<gif_frame_encoding> ahead;
+};
 
-  GifFileType* myGifFile;
-  GifFileType* newGifFile;
-  GifRecordType RecordType;
-  GifByteType *Extension;
+// result of encoding a gif_frame on a worker thread
+struct gif_frame_encoding {
+  gif_frame_encoding() : ok(false), codes(0) {
+    gd.GIFDiffIndex = 0;
+    gd.GIFDiffSize = 0;
+    gd.GIFCodeCount = 0;
+    gd.GIFDiff = NULL;
+  }
+  ~gif_frame_encoding() {
+    GifDiffFree(&gd);
+  }
 
-  freadfunc = srcfile;
-  frecompress_gif = dstfile;
-  newgif_may_write = false;
+  bool ok;
+  int codes; // LZW codes read from g when compressing, written when restoring
+  GifDiffStruct gd; // diffs with positions relative to code_start when compressing, empty when restoring
+  std::vector<unsigned char> out;
+  std::future<void> done;
+};
 
-  init_src_pos = tell_64(srcfile);
+bool gif_frames_ahead_enabled(gif_io* src) {
+  // results have to be the same as in the main thread, so nothing may depend on memory or time
+  return (globalTaskPool.extraThreadCount() > 0) && (memory_budget == 0) && (stream_time_budget == 0) && (src->file == NULL);
+}
 
-  myGifFile = DGifOpenPCF(NULL, readFunc);
-  if (myGifFile == NULL) {
+// Encodes the lines of frame (masked in place by giflib) and writes the LZW data to dst.
+bool gif_put_frame(GifFileType* newGifFile, gif_io* dst, const gif_frame& frame, unsigned char** lines, GifCodeStruct* g, GifDiffStruct* gd) {
+  // this does send a clear code, so we pass g and gd
+  if (EGifPutImageDesc(newGifFile, g, gd, frame.Row, frame.Col, frame.Width, frame.Height, frame.Interlace, frame.ColorMap) == GIF_ERROR) {
     return false;
   }
 
-  newGifFile = EGifOpen(NULL, writeFunc);
+  dst->may_write = true;
+
+  if (frame.Interlace) {
+    for (int i = 0; i < 4; i++) {
+      for (int j = InterlacedOffset[i]; j < frame.Height; j += InterlacedJumps[i]) {
+        EGifPutLine(newGifFile, lines[j], g, gd, frame.Width);
+      }
+    }
+  } else {
+    for (int i = 0; i < frame.Height; i++) {
+      EGifPutLine(newGifFile, lines[i], g, gd, frame.Width);
+    }
+  }
+
+  dst->may_write = false;
+
+  return true;
+}
+
+// Encodes frame with an encoder of its own. When compressing, frame_g holds the codes starting at
+// the frame's first one, when restoring, the frame is encoded as if there were no diffs.
+// gif_frame_take_ahead checks if that's the same as encoding all frames in order.
+void gif_frame_encode_ahead(GifFileType* myGifFile, const gif_frame* frame, const unsigned char* pixels, unsigned char block_size, GifCodeStruct frame_g, bool compressing, gif_frame_encoding* r) {
+  std::vector<unsigned char> buf(pixels, pixels + (size_t)frame->Width * frame->Height);
+  std::vector<unsigned char*> lines(frame->Height);
+  for (int i = 0; i < frame->Height; i++) {
+    lines[i] = buf.data() + (size_t)i * frame->Width;
+  }
+
+  gif_io out = gif_io_mem(&r->out, NULL);
+  out.may_write = false;
+  GifFileType* newGifFile = EGifOpen(&out, writeFunc);
+  if (newGifFile == NULL) return;
+  newGifFile->BlockSize = block_size;
+  EGifPutScreenDesc(newGifFile, myGifFile->SWidth, myGifFile->SHeight, myGifFile->SColorResolution, myGifFile->SBackGroundColor, myGifFile->SPixelAspectRatio, myGifFile->SColorMap);
+
+  if (compressing) {
+    GifDiffInit(&r->gd);
+    r->ok = gif_put_frame(newGifFile, &out, *frame, lines.data(), &frame_g, &r->gd);
+    r->codes = frame_g.GIFCodeIndexGet;
+  } else {
+    r->ok = gif_put_frame(newGifFile, &out, *frame, lines.data(), NULL, &r->gd);
+    r->codes = r->gd.GIFCodeCount;
+  }
+
+  EGifCloseFile(newGifFile);
+}
+
+void gif_frame_start_ahead(GifFileType* myGifFile, gif_frame& frame, gif_io* src, unsigned char block_size, GifCodeStruct* g) {
+  long long pixel_count = (long long)frame.Width * frame.Height;
+  if ((g != NULL) && (frame.code_start < 0)) return;
+  if (frame.pixel_pos + pixel_count > (long long)src->mem->size()) return;
+  // the LZW data has to stay in memory
+  if (2 * pixel_count > GIF_MAX_MEMORY_SIZE) return;
+
+  GifCodeStruct frame_g;
+  if (g != NULL) {
+    frame_g = *g;
+    frame_g.GIFCode += frame.code_start;
+    frame_g.GIFCodeSize -= frame.code_start;
+    frame_g.GIFCodeIndexGet = 0;
+  }
+
+  std::shared_ptr<gif_frame_encoding> r = std::make_shared<gif_frame_encoding>();
+  frame.ahead = r;
+  gif_frame* f = &frame;
+  const unsigned char* pixels = src->mem->data() + frame.pixel_pos;
+  bool compressing = (g != NULL);
+  r->done = globalTaskPool.addTask([myGifFile, f, pixels, block_size, frame_g, compressing, r]() {
+    gif_frame_encode_ahead(myGifFile, f, pixels, block_size, frame_g, compressing, r.get());
+  });
+}
+
+// appends diffs stored with positions relative to pos_offset
+void gif_diff_append(GifDiffStruct* gd, GifDiffStruct* frame_gd, int pos_offset) {
+  int i = 0;
+  while (i < frame_gd->GIFDiffIndex) {
+    unsigned char* entry = frame_gd->GIFDiff + i;
+    int pos = (entry[1] << 24) + (entry[2] << 16) + (entry[3] << 8) + entry[4];
+    int data = -1;
+    if (entry[0] > 1) {
+      data = (entry[5] << 24) + (entry[6] << 16) + (entry[7] << 8) + entry[8];
+    }
+    GifDiffStore(gd, entry[0], pos + pos_offset, data);
+    i += (entry[0] > 1) ? 9 : 5;
+  }
+}
+
+// position of the next diff to apply when restoring, -1 if there is none, see GifDiffIsPos
+int gif_diff_next_pos(GifDiffStruct* gd) {
+  if (gd->GIFDiffIndex >= gd->GIFDiffSize) return -1;
+  unsigned char* entry = gd->GIFDiff + gd->GIFDiffIndex;
+  return (entry[1] << 24) + (entry[2] << 16) + (entry[3] << 8) + entry[4];
+}
+
+// Writes the frame if it was encoded ahead and encoding the frames in order gives the same result.
+bool gif_frame_take_ahead(gif_frame& frame, gif_io* dst, GifCodeStruct* g, GifDiffStruct* gd) {
+  if (!frame.ahead) return false;
+  std::shared_ptr<gif_frame_encoding> r = frame.ahead;
+  frame.ahead.reset();
+  r->done.wait();
+  if (!r->ok) return false;
+
+  if (g != NULL) {
+    // the previous frames have to end where this one starts
+    if (frame.code_start != g->GIFCodeIndexGet) return false;
+    g->GIFCodeIndexGet += r->codes;
+    gif_diff_append(gd, &r->gd, frame.code_start);
+  } else {
+    // no diff may be applied to this frame
+    int next_pos = gif_diff_next_pos(gd);
+    if ((next_pos >= gd->GIFCodeCount) && (next_pos <= gd->GIFCodeCount + r->codes)) return false;
+    gd->GIFCodeCount += r->codes;
+  }
+
+  gif_io_write(dst, r->out.data(), r->out.size());
+  return true;
+}
+
+bool r_gif_result(unsigned char** ScreenBuff, GifFileType* myGifFile, GifFileType* newGifFile, std::vector<gif_frame>& frames, bool result) {
+  // frames encoded ahead use myGifFile and their own data
+  for (size_t i = 0; i < frames.size(); i++) {
+    if (frames[i].ahead) frames[i].ahead->done.wait();
+    if (frames[i].ColorMap != NULL) FreeMapObject(frames[i].ColorMap);
+  }
+  free_gif_screenbuf(ScreenBuff, myGifFile);
+  DGifCloseFile(myGifFile);
+  EGifCloseFile(newGifFile);
+  return result;
+}
+bool r_gif_error(unsigned char** ScreenBuff, GifFileType* myGifFile, GifFileType* newGifFile, std::vector<gif_frame>& frames) {
+  return r_gif_result(ScreenBuff, myGifFile, newGifFile, frames, false);
+}
+bool r_gif_ok(unsigned char** ScreenBuff, GifFileType* myGifFile, GifFileType* newGifFile, std::vector<gif_frame>& frames) {
+  return r_gif_result(ScreenBuff, myGifFile, newGifFile, frames, true);
+}
+
+// When compressing, g holds the LZW codes of the original GIF and frame_code_starts the index of
+// the first one of each image, differences are stored in gd. When restoring, g is NULL and gd
+// holds the differences. With frames_ahead, the images are encoded on worker threads and
+// stitched in order, see gif_frame_take_ahead.
+bool recompress_gif(gif_io* src, gif_io* dst, unsigned char block_size, GifCodeStruct* g, GifDiffStruct* gd, const std::vector<int>* frame_code_starts, bool frames_ahead) {
+  long long last_pos = -1;
+  int ExtCode;
+  long long src_pos, init_src_pos;
+
+  GifFileType* myGifFile;
+  GifFileType* newGifFile;
+  GifRecordType RecordType;
+  GifByteType *Extension;
+  std::vector<gif_frame> frames;
+
+  dst->may_write = false;
+
+  init_src_pos = gif_io_tell(src);
+
+  myGifFile = DGifOpenPCF(src, readFunc);
+  if (myGifFile == NULL) {
+    return false;
+  }
+
+  newGifFile = EGifOpen(dst, writeFunc);
 
   newGifFile->BlockSize = block_size;
 
@@ -6164,79 +6739,61 @@ bool recompress_gif(FILE* srcfile, FILE* dstfile, unsigned char block_size, GifC
 
   EGifPutScreenDesc(newGifFile, myGifFile->SWidth, myGifFile->SHeight, myGifFile->SColorResolution, myGifFile->SBackGroundColor, myGifFile->SPixelAspectRatio, myGifFile->SColorMap);
 
+  // find the images first, so they can be encoded ahead
   do {
     if (DGifGetRecordType(myGifFile, &RecordType) == GIF_ERROR) {
-      return r_gif_error(ScreenBuff, myGifFile, newGifFile);
+      return r_gif_error(ScreenBuff, myGifFile, newGifFile, frames);
     }
 
     switch (RecordType) {
-      case IMAGE_DESC_RECORD_TYPE:
+      case IMAGE_DESC_RECORD_TYPE: {
         if (DGifGetImageDesc(myGifFile) == GIF_ERROR) {
-          return r_gif_error(ScreenBuff, myGifFile, newGifFile);
+          return r_gif_error(ScreenBuff, myGifFile, newGifFile, frames);
         }
 
-        src_pos = tell_64(srcfile);
-        if (last_pos != src_pos) {
-          if (last_pos == -1) {
-            seek_64(srcfile, init_src_pos);
-            fast_copy(srcfile, dstfile, src_pos - init_src_pos);
-            seek_64(srcfile, src_pos);
-
-            long long dstfile_pos = tell_64(dstfile);
-            seek_64(dstfile, 0);
-            // change PGF8xa to GIF8xa
-            fputc('G', dstfile);
-            fputc('I', dstfile);
-            seek_64(dstfile, dstfile_pos);
-          } else {
-            seek_64(srcfile, last_pos);
-            fast_copy(srcfile, dstfile, src_pos - last_pos);
-            seek_64(srcfile, src_pos);
-          }
+        gif_frame frame;
+        frame.gap_pos = last_pos;
+        frame.pixel_pos = gif_io_tell(src);
+        frame.Row = myGifFile->Image.Top; /* Image Position relative to Screen. */
+        frame.Col = myGifFile->Image.Left;
+        frame.Width = myGifFile->Image.Width;
+        frame.Height = myGifFile->Image.Height;
+        frame.Interlace = myGifFile->Image.Interlace;
+        frame.ColorMap = NULL;
+        if (myGifFile->Image.ColorMap != NULL) {
+          frame.ColorMap = MakeMapObject(myGifFile->Image.ColorMap->ColorCount, myGifFile->Image.ColorMap->Colors);
         }
-
-        Row = myGifFile->Image.Top; /* Image Position relative to Screen. */
-        Col = myGifFile->Image.Left;
-        Width = myGifFile->Image.Width;
-        Height = myGifFile->Image.Height;
-
-        for (i = Row; i < (Row + Height); i++) {
-          own_fread(&ScreenBuff[i][Col], 1, Width, srcfile);
+        frame.code_start = -1;
+        if ((frame_code_starts != NULL) && (frames.size() < frame_code_starts->size())) {
+          frame.code_start = (*frame_code_starts)[frames.size()];
         }
+        frames.push_back(frame);
 
-        // this does send a clear code, so we pass g and gd
-        if (EGifPutImageDesc(newGifFile, g, gd, Row, Col, Width, Height, myGifFile->Image.Interlace, myGifFile->Image.ColorMap) == GIF_ERROR) {
-          return r_gif_error(ScreenBuff, myGifFile, newGifFile);
+        // skip the pixels, reading stops at the end of src
+        last_pos = frame.pixel_pos + (long long)frame.Width * frame.Height;
+        if (src->file == NULL) {
+          last_pos = min(last_pos, (long long)src->mem->size());
         }
+        gif_io_seek(src, last_pos);
 
-        newgif_may_write = true;
-
-        if (myGifFile->Image.Interlace) {
-          for (i = 0; i < 4; i++) {
-            for (j = Row + InterlacedOffset[i]; j < (Row + Height); j += InterlacedJumps[i]) {
-              EGifPutLine(newGifFile, &ScreenBuff[j][Col], g, gd, Width);
-            }
-          }
-        } else {
-          for (i = Row; i < (Row + Height); i++) {
-            EGifPutLine(newGifFile, &ScreenBuff[i][Col], g, gd, Width);
-          }
+        // frames that don't fit the screen use the previous content of the screen buffer
+        if ((frame.Width <= 0) || (frame.Height <= 0) ||
+            ((frame.Col + frame.Width) > myGifFile->SWidth) ||
+            ((frame.Row + frame.Height) > myGifFile->SHeight)) {
+          frames_ahead = false;
         }
 
-        newgif_may_write = false;
-
-        last_pos = tell_64(srcfile);
-
         break;
+      }
       case EXTENSION_RECORD_TYPE:
         /* Skip any extension blocks in file: */
 
         if (DGifGetExtension(myGifFile, &ExtCode, &Extension) == GIF_ERROR) {
-          return r_gif_error(ScreenBuff, myGifFile, newGifFile);
+          return r_gif_error(ScreenBuff, myGifFile, newGifFile, frames);
         }
         while (Extension != NULL) {
           if (DGifGetExtensionNext(myGifFile, &Extension) == GIF_ERROR) {
-            return r_gif_error(ScreenBuff, myGifFile, newGifFile);
+            return r_gif_error(ScreenBuff, myGifFile, newGifFile, frames);
           }
         }
         break;
@@ -6247,13 +6804,61 @@ bool recompress_gif(FILE* srcfile, FILE* dstfile, unsigned char block_size, GifC
     }
   } while (RecordType != TERMINATE_RECORD_TYPE);
 
-  src_pos = tell_64(srcfile);
+  src_pos = gif_io_tell(src);
+
+  // the main thread encodes the current frame (unless it's done already), worker threads the ones after it
+  size_t max_ahead = 0;
+  if (frames_ahead) {
+    max_ahead = 2 * globalTaskPool.extraThreadCount();
+  }
+  size_t next_ahead = 0;
+
+  std::vector<unsigned char*> lines;
+  for (size_t k = 0; k < frames.size(); k++) {
+    gif_frame& frame = frames[k];
+
+    next_ahead = max(next_ahead, k + 1);
+    for (; (next_ahead < frames.size()) && (next_ahead <= k + max_ahead); next_ahead++) {
+      gif_frame_start_ahead(myGifFile, frames[next_ahead], src, block_size, g);
+    }
+
+    if (stream_time_exceeded()) {
+      return r_gif_error(ScreenBuff, myGifFile, newGifFile, frames);
+    }
+
+    if (frame.gap_pos != frame.pixel_pos) {
+      if (frame.gap_pos == -1) {
+        gif_io_seek(src, init_src_pos);
+        gif_io_copy(src, dst, frame.pixel_pos - init_src_pos);
+
+        // change PGF8xa to GIF8xa
+        gif_io_put_signature(dst, 'G', 'I');
+      } else {
+        gif_io_seek(src, frame.gap_pos);
+        gif_io_copy(src, dst, frame.pixel_pos - frame.gap_pos);
+      }
+    }
+
+    if (gif_frame_take_ahead(frame, dst, g, gd)) continue;
+
+    gif_io_seek(src, frame.pixel_pos);
+    lines.resize(max(frame.Height, 0));
+    for (int i = 0; i < frame.Height; i++) {
+      lines[i] = &ScreenBuff[frame.Row + i][frame.Col];
+      gif_io_read(src, lines[i], frame.Width);
+    }
+
+    if (!gif_put_frame(newGifFile, dst, frame, lines.data(), g, gd)) {
+      return r_gif_error(ScreenBuff, myGifFile, newGifFile, frames);
+    }
+  }
+
   if (last_pos != src_pos) {
-    seek_64(srcfile, last_pos);
-    fast_copy(srcfile, dstfile, src_pos - last_pos);
-    seek_64(srcfile, src_pos);
+    gif_io_seek(src, last_pos);
+    gif_io_copy(src, dst, src_pos - last_pos);
   }
-  return r_gif_ok(ScreenBuff, myGifFile, newGifFile);
+  gif_io_seek(src, src_pos);
+  return r_gif_ok(ScreenBuff, myGifFile, newGifFile, frames);
 }
 
 bool d_gif_result(unsigned char** ScreenBuff, GifFileType* myGifFile, bool result) {
@@ -6268,7 +6873,9 @@ bool d_gif_ok(unsigned char** ScreenBuff, GifFileType* myGifFile) {
   return d_gif_result(ScreenBuff, myGifFile, true);
 }
 
-bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_length, long long& decomp_length, unsigned char& block_size, GifCodeStruct* g) {
+// Decompresses the GIF at src_pos of src to dst, storing its LZW codes in g and the index of the
+// first code of each image in frame_code_starts (if not NULL), see recompress_gif.
+bool decompress_gif(gif_io* src, gif_io* dst, long long src_pos, int& gif_length, long long& decomp_length, unsigned char& block_size, GifCodeStruct* g, std::vector<int>* frame_code_starts) {
   int i, j;
   GifFileType* myGifFile;
   int Row, Col, Width, Height, ExtCode;
@@ -6278,8 +6885,7 @@ bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_le
   long long srcfile_pos;
   long long last_pos = -1;
 
-  freadfunc = srcfile;
-  myGifFile = DGifOpen(NULL, readFunc);
+  myGifFile = DGifOpen(src, readFunc);
   if (myGifFile == NULL) {
     return false;
   }
@@ -6295,6 +6901,9 @@ bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_le
 
     switch (RecordType) {
       case IMAGE_DESC_RECORD_TYPE:
+        if (stream_time_exceeded()) {
+          return d_gif_error(ScreenBuff, myGifFile);
+        }
         if (DGifGetImageDesc(myGifFile) == GIF_ERROR) {
           return d_gif_error(ScreenBuff, myGifFile);
         }
@@ -6307,32 +6916,29 @@ bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_le
           }
         }
 
-        srcfile_pos = tell_64(srcfile);
+        srcfile_pos = gif_io_tell(src);
         if (last_pos != srcfile_pos) {
           if (last_pos == -1) {
-            seek_64(srcfile, src_pos);
-            fast_copy(srcfile, dstfile, srcfile_pos - src_pos);
-            seek_64(srcfile, srcfile_pos);
+            gif_io_seek(src, src_pos);
+            gif_io_copy(src, dst, srcfile_pos - src_pos);
+            gif_io_seek(src, srcfile_pos);
 
-            long long dstfile_pos = tell_64(dstfile);
-            seek_64(dstfile, 0);
             // change GIF8xa to PGF8xa
-            fputc('P', dstfile);
-            fputc('G', dstfile);
-            seek_64(dstfile, dstfile_pos);
+            gif_io_put_signature(dst, 'P', 'G');
           } else {
-            seek_64(srcfile, last_pos);
-            fast_copy(srcfile, dstfile, srcfile_pos - last_pos);
-            seek_64(srcfile, srcfile_pos);
+            gif_io_seek(src, last_pos);
+            gif_io_copy(src, dst, srcfile_pos - last_pos);
+            gif_io_seek(src, srcfile_pos);
           }
         }
 
         unsigned char c;
-        c = fgetc(srcfile);
+        c = 0;
+        gif_io_read(src, &c, 1);
         if (c == 254) {
           block_size = 254;
         }
-        seek_64(srcfile, srcfile_pos);
+        gif_io_seek(src, srcfile_pos);
 
         Row = myGifFile->Image.Top; /* Image Position relative to Screen. */
         Col = myGifFile->Image.Left;
@@ -6344,6 +6950,10 @@ bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_le
           return d_gif_error(ScreenBuff, myGifFile);
         }
 
+        if (frame_code_starts != NULL) {
+          frame_code_starts->push_back(g->GIFCodeIndex);
+        }
+
         if (myGifFile->Image.Interlace) {
           /* Need to perform 4 passes on the images: */
           for (i = 0; i < 4; i++) {
@@ -6357,7 +6967,7 @@ bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_le
           }
           // write to dstfile
           for (i = Row; i < (Row + Height); i++) {
-            own_fwrite(&ScreenBuff[i][Col], 1, Width, dstfile);
+            gif_io_write(dst, &ScreenBuff[i][Col], Width);
           }
         } else {
           for (i = Row; i < (Row + Height); i++) {
@@ -6365,11 +6975,11 @@ bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_le
               return d_gif_error(ScreenBuff, myGifFile);
             }
             // write to dstfile
-            own_fwrite(&ScreenBuff[i][Col], 1, Width, dstfile);
+            gif_io_write(dst, &ScreenBuff[i][Col], Width);
           }
         }
 
-        last_pos = tell_64(srcfile);
+        last_pos = gif_io_tell(src);
 
         break;
       case EXTENSION_RECORD_TYPE:
@@ -6391,19 +7001,187 @@ bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_le
     }
   } while (RecordType != TERMINATE_RECORD_TYPE);
 
-  srcfile_pos = tell_64(srcfile);
+  srcfile_pos = gif_io_tell(src);
   if (last_pos != srcfile_pos) {
-    seek_64(srcfile, last_pos);
-    fast_copy(srcfile, dstfile, srcfile_pos - last_pos);
-    seek_64(srcfile, srcfile_pos);
+    gif_io_seek(src, last_pos);
+    gif_io_copy(src, dst, srcfile_pos - last_pos);
+    gif_io_seek(src, srcfile_pos);
   }
 
   gif_length = srcfile_pos - src_pos;
-  decomp_length = tell_64(dstfile);
+  decomp_length = gif_io_tell(dst);
 
   return d_gif_ok(ScreenBuff, myGifFile);
 }
 
+// Following GIFs (e.g. the images of a web page archive) are decompressed and recompressed on worker
+// threads ahead of the main loop. It picks up the results when it reaches them, so the output is
+// the same as without batching.
+#define GIF_BATCH_MAX_GAP 4096 // max. distance from the end of a GIF to the next one
+
+struct gif_recompression {
+  gif_recompression() : decompressed(false), recompressed(false), gif_length(-1), decomp_length(-1), block_size(255) {
+    GifDiffInit(&gDiff);
+  }
+  ~gif_recompression() {
+    GifDiffFree(&gDiff);
+  }
+
+  bool decompressed;
+  bool recompressed;
+  int gif_length;
+  long long decomp_length;
+  unsigned char block_size;
+  std::vector<unsigned char> decomp_mem;
+  std::vector<unsigned char> recomp_mem;
+  GifDiffStruct gDiff;
+};
+
+struct gif_batch_stream {
+  long long pos;
+  long long length; // of the data read by gif_batch_read
+  long long queued_size;
+  std::shared_ptr<gif_recompression> result;
+  std::future<void> done;
+};
+
+// Decompresses and recompresses the GIF in data like try_decompression_gif. Doesn't touch any
+// global state as long as nothing is moved to temporary files, so it can run on a worker thread.
+void gif_recompress_in_memory(std::vector<unsigned char>* data, gif_recompression& r) {
+  GifCodeStruct gCode;
+  GifCodeInit(&gCode);
+  std::vector<int> frame_code_starts;
+
+  gif_io src = gif_io_mem(data, NULL);
+  gif_io decomp = gif_io_mem(&r.decomp_mem, NULL);
+  gif_io recomp = gif_io_mem(&r.recomp_mem, NULL);
+
+  r.decompressed = decompress_gif(&src, &decomp, 0, r.gif_length, r.decomp_length, r.block_size, &gCode, &frame_code_starts);
+  if (r.decompressed) {
+    gif_io_seek(&decomp, 0);
+    r.recompressed = recompress_gif(&decomp, &recomp, r.block_size, &gCode, &r.gDiff, &frame_code_starts, false);
+  }
+
+  GifCodeFree(&gCode);
+}
+
+bool gif_batch_enabled() {
+  // see jpg_batch_enabled
+  return (globalTaskPool.extraThreadCount() > 0) && (memory_budget == 0) && (stream_time_budget == 0) && (!DEBUG_MODE);
+}
+
+bool gif_header_found(const unsigned char* buf) {
+  return (buf[0] == 'G') && (buf[1] == 'I') && (buf[2] == 'F') && (buf[3] == '8') &&
+         ((buf[4] == '7') || (buf[4] == '9')) && (buf[5] == 'a');
+}
+
+// Reads the GIF at pos into data, following its block structure without decoding the images.
+// Returns false if it isn't a valid GIF or if its data and twice its pixels exceed max_size.
+bool gif_batch_read(long long pos, long long max_size, std::vector<unsigned char>& data, long long& pixel_count) {
+  pixel_count = 0;
+  data.clear();
+  seek_64(fin, pos);
+
+  auto read_bytes = [&](size_t count) {
+    size_t old_size = data.size();
+    if ((long long)(old_size + count) + 2 * pixel_count > max_size) return false;
+    data.resize(old_size + count);
+    return (fread(data.data() + old_size, 1, count, fin) == count);
+  };
+  auto read_sub_blocks = [&]() {
+    for (;;) {
+      if (!read_bytes(1)) return false;
+      unsigned char block_length = data.back();
+      if (block_length == 0) return true;
+      if (!read_bytes(block_length)) return false;
+    }
+  };
+
+  if (!read_bytes(13)) return false;
+  if ((data[10] & 0x80) && !read_bytes(3 * (2 << (data[10] & 7)))) return false;
+
+  for (;;) {
+    if (!read_bytes(1)) return false;
+    switch (data.back()) {
+      case ';':
+        return true;
+      case '!':
+        if (!read_bytes(1) || !read_sub_blocks()) return false;
+        break;
+      case ',': {
+        if (!read_bytes(9)) return false;
+        const unsigned char* desc = data.data() + data.size() - 9;
+        pixel_count += (long long)(desc[4] + desc[5] * 256) * (desc[6] + desc[7] * 256);
+        unsigned char flags = desc[8];
+        if ((flags & 0x80) && !read_bytes(3 * (2 << (flags & 7)))) return false;
+        if (!read_bytes(1) || !read_sub_blocks()) return false;
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+}
+
+// Returns the queued GIF at pos (or NULL) and drops all GIFs up to pos.
+std::shared_ptr<gif_batch_stream> gif_batch_take(long long pos) {
+  std::shared_ptr<gif_batch_stream> stream;
+  while ((!gif_batch.empty()) && (gif_batch.front()->pos <= pos)) {
+    if (gif_batch.front()->pos == pos) {
+      stream = gif_batch.front();
+    }
+    gif_batch.pop_front();
+  }
+  return stream;
+}
+
+// Queues the GIFs following the one that ends at pos, see jpg_batch_start
+void gif_batch_start(long long pos) {
+  if (!gif_batch_enabled()) return;
+
+  size_t max_streams = 2 * globalTaskPool.extraThreadCount();
+  long long queued_size = 0;
+  for (size_t i = 0; i < gif_batch.size(); i++) {
+    queued_size += gif_batch[i]->queued_size;
+  }
+  if (!gif_batch.empty()) {
+    pos = gif_batch.back()->pos + gif_batch.back()->length;
+  }
+
+  unsigned char gap[GIF_BATCH_MAX_GAP + 6];
+  for (size_t streams = gif_batch.size(); streams < max_streams; streams++) {
+    seek_64(fin, pos);
+    size_t gap_size = fread(gap, 1, GIF_BATCH_MAX_GAP + 6, fin);
+    long long start = -1;
+    for (size_t i = 0; i + 6 <= gap_size; i++) {
+      if (gif_header_found(gap + i)) {
+        start = pos + i;
+        break;
+      }
+    }
+    if (start < 0) break;
+
+    // the worker thread may not use temporary files, see gif_io_write
+    std::shared_ptr<std::vector<unsigned char>> data = std::make_shared<std::vector<unsigned char>>();
+    long long pixel_count;
+    if (!gif_batch_read(start, GIF_MAX_MEMORY_SIZE, *data, pixel_count)) break;
+    queued_size += data->size() + pixel_count;
+    if (queued_size > (long long)globalTaskPool.queueMemoryLimit()) break;
+    pos = start + data->size();
+
+    std::shared_ptr<gif_batch_stream> stream = std::make_shared<gif_batch_stream>();
+    stream->pos = start;
+    stream->length = data->size();
+    stream->queued_size = data->size() + pixel_count;
+    stream->result = std::make_shared<gif_recompression>();
+    std::shared_ptr<gif_recompression> result = stream->result;
+    stream->done = globalTaskPool.addTask([data, result]() {
+      gif_recompress_in_memory(data.get(), *result);
+    });
+    gif_batch.push_back(stream);
+  }
+}
+
 void try_decompression_gif(unsigned char version[5]) {
 
   unsigned char block_size = 255;
@@ -6422,38 +7200,62 @@ void try_decompression_gif(unsigned char version[5]) {
   cout << "Possible GIF found at position " << input_file_pos << endl;;
   }
 
-  seek_64(fin, input_file_pos);
+  stream_time_start();
 
-  // read GIF file
-  ftempout = tryOpen(tempfile1, "wb");
+  seek_64(fin, input_file_pos);
 
-  if (!decompress_gif(fin, ftempout, input_file_pos, gif_length, decomp_length, block_size, &gCode)) {
-    safe_fclose(&ftempout);
-    remove(tempfile1);
-    GifDiffFree(&gDiff);
-    GifCodeFree(&gCode);
-    return;
+  // decompressed and recompressed data are kept in memory unless they get too large
+  std::vector<unsigned char> decomp_mem, recomp_mem;
+  gif_io src = gif_io_file(fin);
+  gif_io decomp = gif_io_mem(&decomp_mem, tempfile1);
+  gif_io recomp = gif_io_mem(&recomp_mem, tempfile2);
+  std::vector<int> frame_code_starts;
+
+  // the GIF might already be recompressed by a worker thread, if not, it's done here
+  std::shared_ptr<gif_batch_stream> batched = gif_batch_take(input_file_pos);
+  if (batched) {
+    batched->done.wait();
+    if (!batched->result->decompressed) batched.reset();
+  }
+
+  if (batched) {
+    gif_recompression& r = *batched->result;
+    decomp_mem.swap(r.decomp_mem);
+    recomp_mem.swap(r.recomp_mem);
+    std::swap(gDiff, r.gDiff);
+    gif_length = r.gif_length;
+    decomp_length = r.decomp_length;
+    block_size = r.block_size;
+  } else {
+    // read GIF file
+    if (!decompress_gif(&src, &decomp, input_file_pos, gif_length, decomp_length, block_size, &gCode, &frame_code_starts)) {
+      gif_io_close(&decomp);
+      GifDiffFree(&gDiff);
+      GifCodeFree(&gCode);
+      return;
+    }
   }
 
+  // queue the GIFs following this one
+  gif_batch_start(input_file_pos + gif_length);
+
   if (DEBUG_MODE) {
   cout << "Can be decompressed to " << decomp_length << " bytes" << endl;
   }
 
-  safe_fclose(&ftempout);
-
   decompressed_streams_count++;
   decompressed_gif_count++;
 
-  ftempout = tryOpen(tempfile1, "rb");
-  frecomp = tryOpen(tempfile2,"wb");
-  if (recompress_gif(ftempout, frecomp, block_size, &gCode, &gDiff)) {
-
-    safe_fclose(&frecomp);
-    safe_fclose(&ftempout);
+  bool recompressed;
+  if (batched) {
+    recompressed = batched->result->recompressed;
+  } else {
+    gif_io_seek(&decomp, 0);
+    recompressed = recompress_gif(&decomp, &recomp, block_size, &gCode, &gDiff, &frame_code_starts, gif_frames_ahead_enabled(&decomp));
+  }
+  if (recompressed) {
 
-    frecomp = tryOpen(tempfile2,"rb");
-    best_identical_bytes = compare_files_penalty(fin, frecomp, input_file_pos, 0);
-    safe_fclose(&frecomp);
+    best_identical_bytes = gif_io_compare_penalty(&recomp, input_file_pos);
 
     if (best_identical_bytes < gif_length) {
       if (DEBUG_MODE) {
@@ -6518,7 +7320,9 @@ void try_decompression_gif(unsigned char version[5]) {
         fout_fput_vlint(decomp_length);
 
         // write decompressed data
-        write_decompressed_data(decomp_length);
+        gif_io fout_io = gif_io_file(fout);
+        gif_io_seek(&decomp, 0);
+        gif_io_copy(&decomp, &fout_io, decomp_length);
 
         // start new uncompressed data
 
@@ -6535,16 +7339,13 @@ void try_decompression_gif(unsigned char version[5]) {
     printf ("No matches\n");
     }
 
-    safe_fclose(&frecomp);
-    safe_fclose(&ftempout);
-
   }
 
   GifDiffFree(&gDiff);
   GifCodeFree(&gCode);
 
-  remove(tempfile2);
-  remove(tempfile1);
+  gif_io_close(&recomp);
+  gif_io_close(&decomp);
 
 }
 
@@ -6559,6 +7360,222 @@ void packjpg_mp3_dll_msg() {
 
 }
 
+// position in front of the first FF DA (SOS) where the Motion JPEG DHT is inserted, -1 if there is none
+long long jpg_mjpeg_dht_pos(const unsigned char* data, long long length) {
+  bool found_ff = false;
+  for (long long pos = 0; pos < length; pos++) {
+    if (found_ff) {
+      if (data[pos] == 0xDA) return pos - 1;
+      found_ff = false;
+    } else {
+      found_ff = (data[pos] == 0xFF);
+    }
+  }
+  return -1;
+}
+
+// The JPG is stored MJPGDHT_LEN bytes behind buf, so the DHT can be inserted and removed again
+// by moving the headers in front of the SOS marker instead of the whole image.
+// Both return the new start of the JPG.
+unsigned char* jpg_insert_mjpeg_dht(unsigned char* buf, long long dht_pos) {
+  memmove(buf, buf + MJPGDHT_LEN, dht_pos);
+  memcpy(buf + dht_pos, MJPGDHT, MJPGDHT_LEN);
+  return buf;
+}
+
+unsigned char* jpg_remove_mjpeg_dht(unsigned char* buf, long long dht_pos) {
+  memmove(buf + MJPGDHT_LEN, buf, dht_pos);
+  return buf + MJPGDHT_LEN;
+}
+
+int brunsli_output_hook(void* data, const uint8_t* buf, size_t len) {
+  std::vector<unsigned char>* out = (std::vector<unsigned char>*)data;
+  out->insert(out->end(), buf, buf + len);
+  return len;
+}
+
+// brunsli output is collected as it is written, so it only takes as much memory as it needs
+bool brunsli_compress_jpg(const brunsli::JPEGData& jpegData, long long jpg_length, std::vector<unsigned char>& out) {
+  out.clear();
+  out.reserve(jpg_length);
+  return brunsli::BrunsliEncodeJpeg(jpegData, brunsli::JPEGOutput(brunsli_output_hook, &out), use_brotli);
+}
+
+// result of jpg_recompress_in_memory, out is either brunsli_out or allocated by packJPG
+struct jpg_recompression {
+  jpg_recompression() : success(false), mjpg_dht_used(false), brunsli_used(false), brotli_used(use_brotli), out(NULL), out_size(-1) {
+    msg[0] = 0;
+  }
+  ~jpg_recompression() {
+    if (!brunsli_used) delete[] out;
+  }
+
+  bool success;
+  bool mjpg_dht_used;
+  bool brunsli_used;
+  bool brotli_used;
+  std::vector<unsigned char> brunsli_out;
+  unsigned char* out;
+  unsigned int out_size;
+  char msg[256];
+};
+
+// Recompresses a JPG that is stored MJPGDHT_LEN bytes behind jpg_mem_in, using brunsli and/or packJPG
+// and the Motion JPEG DHT if needed. Doesn't touch any global state, so it can run on a worker thread.
+void jpg_recompress_in_memory(unsigned char* jpg_mem_in, long long jpg_length, jpg_recompression& r) {
+  unsigned char* jpg_data = jpg_mem_in + MJPGDHT_LEN;
+  bool brunsli_success = false;
+
+  if (use_brunsli) {
+    if (DEBUG_MODE) {
+      printf("Trying to compress using brunsli...\n");
+    }
+    brunsli::JPEGData jpegData;
+    if (brunsli::ReadJpeg(jpg_data, jpg_length, brunsli::JPEG_READ_ALL, &jpegData)) {
+      brunsli_success = brunsli_compress_jpg(jpegData, jpg_length, r.brunsli_out);
+    }
+    else {
+      if (jpegData.error == brunsli::JPEGReadError::HUFFMAN_TABLE_NOT_FOUND) {
+        if (DEBUG_MODE) printf("huffman table missing, trying to use Motion JPEG DHT\n");
+        long long dht_pos = jpg_mjpeg_dht_pos(jpg_data, jpg_length);
+        if (dht_pos >= 0) {
+          // reinitialise jpegData
+          brunsli::JPEGData newJpegData;
+          jpegData = newJpegData;
+
+          jpg_data = jpg_insert_mjpeg_dht(jpg_mem_in, dht_pos);
+
+          if (brunsli::ReadJpeg(jpg_data, jpg_length + MJPGDHT_LEN, brunsli::JPEG_READ_ALL, &jpegData)) {
+            brunsli_success = brunsli_compress_jpg(jpegData, jpg_length, r.brunsli_out);
+            r.mjpg_dht_used = brunsli_success;
+          }
+
+          if (!brunsli_success) {
+            // revert DHT insertion
+            jpg_data = jpg_remove_mjpeg_dht(jpg_mem_in, dht_pos);
+          }
+        }
+      }
+    }
+    if (brunsli_success) {
+      r.success = true;
+      r.brunsli_used = true;
+      r.out = r.brunsli_out.data();
+      r.out_size = r.brunsli_out.size();
+    }
+    if (DEBUG_MODE && !brunsli_success) {
+      if (use_packjpg_fallback) {
+        printf("Brunsli compression failed, using packJPG fallback...\n");
+      } else {
+        printf("Brunsli compression failed\n");
+      }
+    }
+  }
+
+  if ((!use_brunsli || !brunsli_success) && use_packjpg_fallback) {
+    pjglib_init_streams(jpg_data, 1, jpg_length, r.out, 1);
+    r.success = pjglib_convert_stream2mem(&r.out, &r.out_size, r.msg);
+    r.brunsli_used = false;
+    r.brotli_used = false;
+  }
+
+  if ((!r.success) && (strncmp(r.msg, "huffman table missing", 21) == 0) && (use_mjpeg) && (use_packjpg_fallback)) {
+    if (DEBUG_MODE) printf ("huffman table missing, trying to use Motion JPEG DHT\n");
+    long long dht_pos = jpg_mjpeg_dht_pos(jpg_data, jpg_length);
+    if (dht_pos >= 0) {
+      jpg_data = jpg_insert_mjpeg_dht(jpg_mem_in, dht_pos);
+
+      pjglib_init_streams(jpg_data, 1, jpg_length + MJPGDHT_LEN, r.out, 1);
+      r.success = pjglib_convert_stream2mem(&r.out, &r.out_size, r.msg);
+    }
+    r.mjpg_dht_used = r.success;
+  }
+}
+
+// JPGs that follow each other closely, like the frames of Motion JPEG videos, are recompressed
+// on worker threads ahead of the main loop. It picks up the results when it reaches them, so the
+// output is the same as without batching.
+#define JPG_BATCH_MAX_GAP 4096 // max. distance from the end of a JPG to the next one
+
+struct jpg_batch_frame {
+  long long pos;
+  long long length;
+  bool progressive;
+  std::shared_ptr<jpg_recompression> result;
+  std::future<void> done;
+};
+
+bool jpg_batch_enabled() {
+  // results have to be the same as in the main thread, so nothing may depend on memory or time
+  return (globalTaskPool.extraThreadCount() > 0) && (memory_budget == 0) && (stream_time_budget == 0) && (!DEBUG_MODE);
+}
+
+// Returns the queued frame for the JPG at pos (or NULL) and drops all frames up to pos.
+std::shared_ptr<jpg_batch_frame> jpg_batch_take(long long pos, long long length, bool progressive) {
+  std::shared_ptr<jpg_batch_frame> frame;
+  while ((!jpg_batch.empty()) && (jpg_batch.front()->pos <= pos)) {
+    std::shared_ptr<jpg_batch_frame>& front = jpg_batch.front();
+    if ((front->pos == pos) && (front->length == length) && (front->progressive == progressive)) {
+      frame = front;
+    }
+    jpg_batch.pop_front();
+  }
+  return frame;
+}
+
+// Queues the JPGs following the one that ends at pos, up to twice as many as there are worker
+// threads and as much data as the task pool allows.
+void jpg_batch_start(long long pos) {
+  if (!jpg_batch_enabled()) return;
+
+  size_t max_frames = 2 * globalTaskPool.extraThreadCount();
+  long long queued_size = 0;
+  for (size_t i = 0; i < jpg_batch.size(); i++) {
+    queued_size += jpg_batch[i]->length;
+  }
+  if (!jpg_batch.empty()) {
+    pos = jpg_batch.back()->pos + jpg_batch.back()->length;
+  }
+
+  unsigned char gap[JPG_BATCH_MAX_GAP + 4];
+  for (size_t frames = jpg_batch.size(); frames < max_frames; frames++) {
+    seek_64(fin, pos);
+    size_t gap_size = fread(gap, 1, JPG_BATCH_MAX_GAP + 4, fin);
+    long long start = -1;
+    for (size_t i = 0; i + 4 <= gap_size; i++) {
+      if (jpg_header_found(gap + i)) {
+        start = pos + i;
+        break;
+      }
+    }
+    if (start < 0) break;
+
+    bool progressive;
+    long long length = jpg_stream_length(start, gap[start - pos + 3], progressive);
+    if ((length == 0) || (length + MJPGDHT_LEN > JPG_MAX_MEMORY_SIZE)) break;
+    queued_size += length;
+    if (queued_size > (long long)globalTaskPool.queueMemoryLimit()) break;
+    pos = start + length;
+    // see try_decompression_jpg
+    if ((!progressive) && (prog_only)) continue;
+
+    std::shared_ptr<std::vector<unsigned char>> mem_in = std::make_shared<std::vector<unsigned char>>(length + MJPGDHT_LEN);
+    seek_64(fin, start);
+    fast_copy(fin, mem_in->data() + MJPGDHT_LEN, length);
+
+    std::shared_ptr<jpg_batch_frame> frame = std::make_shared<jpg_batch_frame>();
+    frame->pos = start;
+    frame->length = length;
+    frame->progressive = progressive;
+    frame->result = std::make_shared<jpg_recompression>();
+    std::shared_ptr<jpg_recompression> result = frame->result;
+    frame->done = globalTaskPool.addTask([mem_in, length, result]() {
+      jpg_recompress_in_memory(mem_in->data(), length, *result);
+    });
+    jpg_batch.push_back(frame);
+  }
+}
+
 void try_decompression_jpg (long long jpg_length, bool progressive_jpg) {
 
         if (DEBUG_MODE) {
@@ -6575,6 +7592,8 @@ void try_decompression_jpg (long long jpg_length, bool progressive_jpg) {
           }
         }
 
+        stream_time_start();
+
         // do not recompress non-progressive JPGs when prog_only is set
         if ((!progressive_jpg) && (prog_only)) return;
 
@@ -6587,99 +7606,33 @@ void try_decompression_jpg (long long jpg_length, bool progressive_jpg) {
         unsigned char* jpg_mem_in = NULL;
         unsigned char* jpg_mem_out = NULL;
         unsigned int jpg_mem_out_size = -1;
-        bool in_memory = ((jpg_length + MJPGDHT_LEN) <= JPG_MAX_MEMORY_SIZE);
+        std::shared_ptr<jpg_recompression> mem_result; // owns jpg_mem_out for in-memory streams
+        bool in_memory = memory_budget_allows(jpg_length + MJPGDHT_LEN, JPG_MAX_MEMORY_SIZE, 4);
 
         if (in_memory) { // small stream => do everything in memory
-          jpg_mem_in = new unsigned char[jpg_length + MJPGDHT_LEN];
-          seek_64(fin, input_file_pos);
-          fast_copy(fin, jpg_mem_in, jpg_length);
-
-		  bool brunsli_success = false;
-
-		  if (use_brunsli) {
-			  if (DEBUG_MODE) {
-				  printf("Trying to compress using brunsli...\n");
-			  }
-			  brunsli::JPEGData jpegData;
-			  if (brunsli::ReadJpeg(jpg_mem_in, jpg_length, brunsli::JPEG_READ_ALL, &jpegData)) {
-				  size_t output_size = brunsli::GetMaximumBrunsliEncodedSize(jpegData);
-				  jpg_mem_out = new unsigned char[output_size];
-				  if (brunsli::BrunsliEncodeJpeg(jpegData, jpg_mem_out, &output_size, use_brotli)) {
-					  recompress_success = true;
-					  brunsli_success = true;
-					  brunsli_used = true;
-					  jpg_mem_out_size = output_size;
-				  } else {
-					  if (jpg_mem_out != NULL) delete[] jpg_mem_out;
-					  jpg_mem_out = NULL;
-				  }
-			  }
-			  else {
-				  if (jpegData.error == brunsli::JPEGReadError::HUFFMAN_TABLE_NOT_FOUND) {
-					  if (DEBUG_MODE) printf("huffman table missing, trying to use Motion JPEG DHT\n");
-					  // search 0xFF 0xDA, insert MJPGDHT (MJPGDHT_LEN bytes)
-					  bool found_ffda = false;
-					  bool found_ff = false;
-					  int ffda_pos = -1;
-
-					  do {
-						  ffda_pos++;
-						  if (ffda_pos >= jpg_length) break;
-						  if (found_ff) {
-							  found_ffda = (jpg_mem_in[ffda_pos] == 0xDA);
-							  if (found_ffda) break;
-							  found_ff = false;
-						  }
-						  else {
-							  found_ff = (jpg_mem_in[ffda_pos] == 0xFF);
-						  }
-					  } while (!found_ffda);
-					  if (found_ffda) {
-						  // reinitialise jpegData
-						  brunsli::JPEGData newJpegData;
-						  jpegData = newJpegData;
-
-						  memmove(jpg_mem_in + (ffda_pos - 1) + MJPGDHT_LEN, jpg_mem_in + (ffda_pos - 1), jpg_length - (ffda_pos - 1));
-						  memcpy(jpg_mem_in + (ffda_pos - 1), MJPGDHT, MJPGDHT_LEN);
-
-						  if (brunsli::ReadJpeg(jpg_mem_in, jpg_length + MJPGDHT_LEN, brunsli::JPEG_READ_ALL, &jpegData)) {
-							  size_t output_size = brunsli::GetMaximumBrunsliEncodedSize(jpegData);
-							  jpg_mem_out = new unsigned char[output_size];
-							  if (brunsli::BrunsliEncodeJpeg(jpegData, jpg_mem_out, &output_size, use_brotli)) {
-								  recompress_success = true;
-								  brunsli_success = true;
-								  brunsli_used = true;
-								  mjpg_dht_used = true;
-								  jpg_mem_out_size = output_size;
-							  }
-							  else {
-								  if (jpg_mem_out != NULL) delete[] jpg_mem_out;
-								  jpg_mem_out = NULL;
-							  }
-						  }
-
-						  if (!brunsli_success) {
-							  // revert DHT insertion
-							  memmove(jpg_mem_in + (ffda_pos - 1), jpg_mem_in + (ffda_pos - 1) + MJPGDHT_LEN, jpg_length - (ffda_pos - 1));
-						  }
-					  }
-				  }
-			  }
-			  if (DEBUG_MODE && !brunsli_success) {
-				  if (use_packjpg_fallback) {
-					  printf("Brunsli compression failed, using packJPG fallback...\n");
-				  } else {
-					  printf("Brunsli compression failed\n");
-				  }
-			  }
-		  }
-
-		  if ((!use_brunsli || !brunsli_success) && use_packjpg_fallback) {
-			  pjglib_init_streams(jpg_mem_in, 1, jpg_length, jpg_mem_out, 1);
-			  recompress_success = pjglib_convert_stream2mem(&jpg_mem_out, &jpg_mem_out_size, recompress_msg);
-			  brunsli_used = false;
-			  brotli_used = false;
+		  // the JPG might already be recompressed by a worker thread, if not, queue the ones following it
+		  std::shared_ptr<jpg_batch_frame> frame = jpg_batch_take(input_file_pos, jpg_length, progressive_jpg);
+		  jpg_batch_start(input_file_pos + jpg_length);
+
+		  if (frame) {
+			  frame->done.wait();
+			  mem_result = frame->result;
+		  } else {
+			  // leave room for the Motion JPEG DHT in front of the JPG
+			  jpg_mem_in = scratch_buf_get(jpg_length + MJPGDHT_LEN);
+			  seek_64(fin, input_file_pos);
+			  fast_copy(fin, jpg_mem_in + MJPGDHT_LEN, jpg_length);
+
+			  mem_result = std::make_shared<jpg_recompression>();
+			  jpg_recompress_in_memory(jpg_mem_in, jpg_length, *mem_result);
 		  }
+		  recompress_success = mem_result->success;
+		  mjpg_dht_used = mem_result->mjpg_dht_used;
+		  brunsli_used = mem_result->brunsli_used;
+		  brotli_used = mem_result->brotli_used;
+		  jpg_mem_out = mem_result->out;
+		  jpg_mem_out_size = mem_result->out_size;
+		  strcpy(recompress_msg, mem_result->msg);
         } else if (use_packjpg_fallback) { // large stream => use temporary files
 		  if (DEBUG_MODE) {
 			printf("JPG too large for brunsli, using packJPG fallback...\n");
@@ -6689,7 +7642,7 @@ void try_decompression_jpg (long long jpg_length, bool progressive_jpg) {
           seek_64(fin, input_file_pos);
           fast_copy(fin, fjpg, jpg_length);
           safe_fclose(&fjpg);
-          remove(tempfile1);
+          remove_temp_file(tempfile1);
 
           // Workaround for JPG bugs. Sometimes tempfile1 is removed, but still
           // not accessible by packJPG, so we prevent that by opening it here
@@ -6702,58 +7655,37 @@ void try_decompression_jpg (long long jpg_length, bool progressive_jpg) {
 		  brotli_used = false;
         }
 
-        if ((!recompress_success) && (strncmp(recompress_msg, "huffman table missing", 21) == 0) && (use_mjpeg) && (use_packjpg_fallback)) {
+        if ((!in_memory) && (!recompress_success) && (strncmp(recompress_msg, "huffman table missing", 21) == 0) && (use_mjpeg) && (use_packjpg_fallback)) {
           if (DEBUG_MODE) printf ("huffman table missing, trying to use Motion JPEG DHT\n");
           // search 0xFF 0xDA, insert MJPGDHT (MJPGDHT_LEN bytes)
           bool found_ffda = false;
           bool found_ff = false;
           int ffda_pos = -1;
 
-          if (in_memory) {
-            do {
-              ffda_pos++;
-              if (ffda_pos >= jpg_length) break;
-              if (found_ff) {
-                found_ffda = (jpg_mem_in[ffda_pos] == 0xDA);
-                if (found_ffda) break;
-                found_ff = false;
-              } else {
-                found_ff = (jpg_mem_in[ffda_pos] == 0xFF);
-              }
-            } while (!found_ffda);
-            if (found_ffda) {
-                memmove(jpg_mem_in + (ffda_pos - 1) + MJPGDHT_LEN, jpg_mem_in + (ffda_pos - 1), jpg_length - (ffda_pos - 1));
-                memcpy(jpg_mem_in + (ffda_pos - 1), MJPGDHT, MJPGDHT_LEN);
-
-                pjglib_init_streams(jpg_mem_in, 1, jpg_length + MJPGDHT_LEN, jpg_mem_out, 1);
-                recompress_success = pjglib_convert_stream2mem(&jpg_mem_out, &jpg_mem_out_size, recompress_msg);
-            }
-          } else {
-            fjpg = tryOpen(tempfile0,"rb");
-            do {
-              ffda_pos++;
-              if (fread(in, 1, 1, fjpg) != 1) break;
-              if (found_ff) {
-                found_ffda = (in[0] == 0xDA);
-                if (found_ffda) break;
-                found_ff = false;
-              } else {
-                found_ff = (in[0] == 0xFF);
-              }
-            } while (!found_ffda);
-            if (found_ffda) {
-              fdecomp = tryOpen(tempfile3,"wb");
-              seek_64(fjpg, 0);
-              fast_copy(fjpg, fdecomp, ffda_pos - 1);
-              // insert MJPGDHT
-              own_fwrite(MJPGDHT, 1, MJPGDHT_LEN, fdecomp);
-              seek_64(fjpg, ffda_pos - 1);
-              fast_copy(fjpg, fdecomp, jpg_length - (ffda_pos - 1));
-              safe_fclose(&fdecomp);
+          fjpg = tryOpen(tempfile0,"rb");
+          do {
+            ffda_pos++;
+            if (fread(in, 1, 1, fjpg) != 1) break;
+            if (found_ff) {
+              found_ffda = (in[0] == 0xDA);
+              if (found_ffda) break;
+              found_ff = false;
+            } else {
+              found_ff = (in[0] == 0xFF);
             }
-            safe_fclose(&fjpg);
-            recompress_success = pjglib_convert_file2file(tempfile3, tempfile1, recompress_msg);
+          } while (!found_ffda);
+          if (found_ffda) {
+            fdecomp = tryOpen(tempfile3,"wb");
+            seek_64(fjpg, 0);
+            fast_copy(fjpg, fdecomp, ffda_pos - 1);
+            // insert MJPGDHT
+            own_fwrite(MJPGDHT, 1, MJPGDHT_LEN, fdecomp);
+            seek_64(fjpg, ffda_pos - 1);
+            fast_copy(fjpg, fdecomp, jpg_length - (ffda_pos - 1));
+            safe_fclose(&fdecomp);
           }
+          safe_fclose(&fjpg);
+          recompress_success = pjglib_convert_file2file(tempfile3, tempfile1, recompress_msg);
 
           mjpg_dht_used = recompress_success;
         }
@@ -6770,7 +7702,7 @@ void try_decompression_jpg (long long jpg_length, bool progressive_jpg) {
         }
 
         if (!in_memory) {
-          remove(tempfile0);
+          remove_temp_file(tempfile0);
         }
 
         if (recompress_success) {
@@ -6842,8 +7774,255 @@ void try_decompression_jpg (long long jpg_length, bool progressive_jpg) {
           }
         }
 
-        if (jpg_mem_in != NULL) delete[] jpg_mem_in;
-        if (jpg_mem_out != NULL) delete[] jpg_mem_out;
+        scratch_buf_release(jpg_mem_in);
+}
+
+// Parses the MP3 frames starting at pos until the first invalid frame or the end of the file.
+// Frames of supported MP3 streams are recorded in mp3_index, so when the main loop reaches one
+// of the following frames, the rest of the stream is looked up instead of being parsed again.
+void mp3_parse_frames(long long pos, int& type, int& n, long long& mp3_length) {
+  type = -1;
+  n = 0;
+  mp3_length = 0;
+
+  bool inside_index = (mp3_index->start >= 0) && (pos > mp3_index->start) && (pos - mp3_index->start < mp3_index->offsets.back());
+  if (inside_index) {
+    unsigned int offset = (unsigned int)(pos - mp3_index->start);
+    std::vector<unsigned int>::const_iterator frame = std::lower_bound(mp3_index->offsets.begin(), mp3_index->offsets.end(), offset);
+    if (*frame == offset) {
+      type = MPEG1_LAYER_III;
+      if (mp3_index->valid) {
+        n = (int)(mp3_index->offsets.end() - frame) - 1;
+        mp3_length = mp3_index->offsets.back() - offset;
+      }
+      return;
+    }
+  }
+
+  int mpeg = -1;
+  int layer = -1;
+  int samples = -1;
+  int channels = -1;
+  int protection = -1;
+  bool valid = true;
+  std::vector<unsigned int> offsets;
+
+  // frames are read from in_buf as long as they are inside of it, then in growing blocks from the file
+  long long in_buf_end = min(in_buf_pos + IN_BUF_SIZE, fin_length);
+  long long block_start = 0, block_end = 0;
+  size_t block_size = 4096;
+  auto frame_data = [&](long long frame_pos, long long size) -> unsigned char* {
+    if ((frame_pos >= in_buf_pos) && (frame_pos + size <= in_buf_end)) {
+      return in_buf + (frame_pos - in_buf_pos);
+    }
+    if ((frame_pos < block_start) || (frame_pos + size > block_end)) {
+      seek_64(fin, frame_pos);
+      block_start = frame_pos;
+      block_end = frame_pos + fread(in, 1, block_size, fin);
+      block_size = min(block_size * 2, (size_t)CHUNK);
+      if (frame_pos + size > block_end) return NULL;
+    }
+    return in + (frame_pos - block_start);
+  };
+
+  long long act_pos = pos;
+  unsigned char* header;
+  while ((header = frame_data(act_pos, 4)) != NULL) {
+    // check syncword
+    if ((header[0] != 0xFF) || ((header[1] & 0xE0) != 0xE0)) break;
+    // compare data from header
+    if (n == 0) {
+      mpeg        = (header[1] >> 3) & 0x3;
+      layer       = (header[1] >> 1) & 0x3;
+      protection  = (header[1] >> 0) & 0x1;
+      samples     = (header[2] >> 2) & 0x3;
+      channels    = (header[3] >> 6) & 0x3;
+      type = MBITS( header[1], 5, 1 );
+      // avoid slowdown and multiple verbose messages on unsupported types that have already been detected
+      if ((type != MPEG1_LAYER_III) && (pos <= suppress_mp3_type_until[type])) {
+          break;
+      }
+    } else {
+      if (type == MPEG1_LAYER_III) { // supported MP3 type, all header information must be identical to the first frame
+        if (
+          (mpeg       != ((header[1] >> 3) & 0x3)) ||
+          (layer      != ((header[1] >> 1) & 0x3)) ||
+          (protection != ((header[1] >> 0) & 0x1)) ||
+          (samples    != ((header[2] >> 2) & 0x3)) ||
+          (channels   != ((header[3] >> 6) & 0x3)) ||
+          (type       != MBITS( header[1], 5, 1))) break;
+      } else { // unsupported type, compare only type, ignore the other header information to get a longer stream
+        if (type != MBITS( header[1], 5, 1)) break;
+      }
+    }
+
+    int bits     = (header[2] >> 4) & 0xF;
+    int padding  = (header[2] >> 1) & 0x1;
+    // check for problems
+    if ((mpeg == 0x1) || (layer == 0x0) ||
+        (bits == 0x0) || (bits == 0xF) || (samples == 0x3)) break;
+    // find out frame size
+    int frame_size = frame_size_table[mpeg][layer][samples][bits];
+    if (padding) frame_size += (layer == LAYER_I) ? 4 : 1;
+
+    // if supported MP3 type, validate frames
+    if ((type == MPEG1_LAYER_III) && (frame_size > 4)) {
+      unsigned char* frame = frame_data(act_pos, frame_size);
+      // discard incomplete frame
+      if (frame == NULL) break;
+      if (!is_valid_mp3_frame(frame + 4, frame[2], frame[3], protection)) {
+        valid = false;
+      }
+    }
+
+    n++;
+    if (type == MPEG1_LAYER_III) {
+      offsets.push_back((unsigned int)mp3_length);
+    }
+    mp3_length += frame_size;
+    act_pos += frame_size;
+
+    if (!valid) break;
+  }
+
+  // positions inside of the indexed stream that aren't frames of it are false syncs,
+  // they don't replace the index
+  if ((!offsets.empty()) && (!inside_index) && (mp3_length <= 0xFFFFFFFFLL)) {
+    offsets.push_back((unsigned int)mp3_length);
+    mp3_index->start = pos;
+    mp3_index->offsets.swap(offsets);
+    mp3_index->valid = valid;
+  }
+
+  if (!valid) n = 0;
+}
+
+// result of mp3_recompress_in_memory, out is allocated by packMP3
+struct mp3_recompression {
+  mp3_recompression() : success(false), synching_failure(false), length(0), out(NULL), out_size(-1) {
+    msg[0] = 0;
+  }
+  ~mp3_recompression() {
+    delete[] out;
+  }
+
+  bool success;
+  bool synching_failure; // of the first try, the retry (if any) is in success and msg
+  long long length; // shorter than the parsed stream if garbage at its end was cut off
+  unsigned char* out;
+  unsigned int out_size;
+  char msg[256];
+};
+
+// Recompresses the MP3 in mp3_mem_in using packMP3, retrying without the garbage at its end
+// if needed. Doesn't touch any global state, so it can run on a worker thread.
+void mp3_recompress_in_memory(unsigned char* mp3_mem_in, long long mp3_length, mp3_recompression& r) {
+  r.length = mp3_length;
+  pmplib_init_streams(mp3_mem_in, 1, r.length, r.out, 1);
+  r.success = pmplib_convert_stream2mem(&r.out, &r.out_size, r.msg);
+
+  r.synching_failure = (!r.success) && (strncmp(r.msg, "synching failure", 16) == 0);
+  if (r.synching_failure) {
+    int frame_n;
+    int pos;
+    if (sscanf(r.msg, "synching failure (frame #%i at 0x%X)", &frame_n, &pos) == 2) {
+      if ((pos > 0) && (pos < r.length)) {
+        r.length = pos;
+
+        if (DEBUG_MODE) printf ("Too much garbage data at the end, retry with new length %i\n", pos);
+
+        pmplib_init_streams(mp3_mem_in, 1, r.length, r.out, 1);
+        r.success = pmplib_convert_stream2mem(&r.out, &r.out_size, r.msg);
+      }
+    }
+  }
+}
+
+// MP3s that follow each other closely, like the tracks of an album in an archive, are recompressed
+// on worker threads ahead of the main loop, see jpg_batch_start
+#define MP3_BATCH_MAX_GAP 4096 // max. distance from the end of an MP3 to the next one
+
+struct mp3_batch_stream {
+  long long pos;
+  long long length;
+  std::shared_ptr<mp3_recompression> result;
+  std::future<void> done;
+};
+
+bool mp3_batch_enabled() {
+  // see jpg_batch_enabled
+  return (globalTaskPool.extraThreadCount() > 0) && (memory_budget == 0) && (stream_time_budget == 0) && (!DEBUG_MODE);
+}
+
+// Returns the queued MP3 for the stream at pos (or NULL) and drops all MP3s up to pos.
+std::shared_ptr<mp3_batch_stream> mp3_batch_take(long long pos, long long length) {
+  std::shared_ptr<mp3_batch_stream> stream;
+  while ((!mp3_batch.empty()) && (mp3_batch.front()->pos <= pos)) {
+    if ((mp3_batch.front()->pos == pos) && (mp3_batch.front()->length == length)) {
+      stream = mp3_batch.front();
+    }
+    mp3_batch.pop_front();
+  }
+  return stream;
+}
+
+// Queues the MP3s following the one that ends at pos, see jpg_batch_start
+void mp3_batch_start(long long pos) {
+  if (!mp3_batch_enabled()) return;
+
+  size_t max_streams = 2 * globalTaskPool.extraThreadCount();
+  long long queued_size = 0;
+  for (size_t i = 0; i < mp3_batch.size(); i++) {
+    queued_size += mp3_batch[i]->length;
+  }
+  if (!mp3_batch.empty()) {
+    pos = mp3_batch.back()->pos + mp3_batch.back()->length;
+  }
+
+  // parse into an index of our own, the main loop keeps the one of the current stream
+  mp3_frame_index* main_index = mp3_index;
+  mp3_frame_index batch_index;
+  mp3_index = &batch_index;
+
+  unsigned char gap[MP3_BATCH_MAX_GAP + 2];
+  for (size_t streams = mp3_batch.size(); streams < max_streams; streams++) {
+    seek_64(fin, pos);
+    size_t gap_size = fread(gap, 1, MP3_BATCH_MAX_GAP + 2, fin);
+    long long start = -1;
+    long long length = 0;
+    for (size_t i = 0; i + 2 <= gap_size; i++) {
+      if ((gap[i] == 0xFF) && ((gap[i + 1] & 0xE0) == 0xE0)) { // frame start
+        int type;
+        int n;
+        mp3_parse_frames(pos + i, type, n, length);
+        // same conditions as in compress_file
+        if ((n >= 5) && (type == MPEG1_LAYER_III)) {
+          start = pos + i;
+          break;
+        }
+      }
+    }
+    if ((start < 0) || (length > MP3_MAX_MEMORY_SIZE)) break;
+    queued_size += length;
+    if (queued_size > (long long)globalTaskPool.queueMemoryLimit()) break;
+    pos = start + length;
+
+    std::shared_ptr<std::vector<unsigned char>> mem_in = std::make_shared<std::vector<unsigned char>>(length);
+    seek_64(fin, start);
+    fast_copy(fin, mem_in->data(), length);
+
+    std::shared_ptr<mp3_batch_stream> stream = std::make_shared<mp3_batch_stream>();
+    stream->pos = start;
+    stream->length = length;
+    stream->result = std::make_shared<mp3_recompression>();
+    std::shared_ptr<mp3_recompression> result = stream->result;
+    stream->done = globalTaskPool.addTask([mem_in, length, result]() {
+      mp3_recompress_in_memory(mem_in->data(), length, *result);
+    });
+    mp3_batch.push_back(stream);
+  }
+
+  mp3_index = main_index;
 }
 
 void try_decompression_mp3 (long long mp3_length) {
@@ -6853,28 +8032,45 @@ void try_decompression_mp3 (long long mp3_length) {
           cout << "Possible MP3 found at position " << saved_input_file_pos << ", length " << mp3_length << endl;
         }
 
+        stream_time_start();
+
         bool mp3_success = false;
         bool recompress_success = false;
         char recompress_msg[256];
         unsigned char* mp3_mem_in = NULL;
         unsigned char* mp3_mem_out = NULL;
         unsigned int mp3_mem_out_size = -1;
-        bool in_memory = (mp3_length <= MP3_MAX_MEMORY_SIZE);
+        std::shared_ptr<mp3_recompression> mem_result; // owns mp3_mem_out for in-memory streams
+        bool in_memory = memory_budget_allows(mp3_length, MP3_MAX_MEMORY_SIZE, 4);
 
         if (in_memory) { // small stream => do everything in memory
-          mp3_mem_in = new unsigned char[mp3_length];
-          seek_64(fin, input_file_pos);
-          fast_copy(fin, mp3_mem_in, mp3_length);
+          // the MP3 might already be recompressed by a worker thread, if not, queue the ones following it
+          std::shared_ptr<mp3_batch_stream> stream = mp3_batch_take(input_file_pos, mp3_length);
+          mp3_batch_start(input_file_pos + mp3_length);
 
-          pmplib_init_streams(mp3_mem_in, 1, mp3_length, mp3_mem_out, 1);
-          recompress_success = pmplib_convert_stream2mem(&mp3_mem_out, &mp3_mem_out_size, recompress_msg);
+          if (stream) {
+            stream->done.wait();
+            mem_result = stream->result;
+          } else {
+            mp3_mem_in = scratch_buf_get(mp3_length);
+            seek_64(fin, input_file_pos);
+            fast_copy(fin, mp3_mem_in, mp3_length);
+
+            mem_result = std::make_shared<mp3_recompression>();
+            mp3_recompress_in_memory(mp3_mem_in, mp3_length, *mem_result);
+          }
+          recompress_success = mem_result->success;
+          mp3_length = mem_result->length;
+          mp3_mem_out = mem_result->out;
+          mp3_mem_out_size = mem_result->out_size;
+          strcpy(recompress_msg, mem_result->msg);
         } else { // large stream => use temporary files
           // try to decompress at current position
           fmp3 = tryOpen(tempfile0,"wb");
           seek_64(fin, input_file_pos);
           fast_copy(fin, fmp3, mp3_length);
           safe_fclose(&fmp3);
-          remove(tempfile1);
+          remove_temp_file(tempfile1);
 
           // workaround for bugs, similar to packJPG
           FILE* fworkaround = tryOpen(tempfile1,"wb");
@@ -6883,30 +8079,27 @@ void try_decompression_mp3 (long long mp3_length) {
           recompress_success = pmplib_convert_file2file(tempfile0, tempfile1, recompress_msg);
         }
 
-        if ((!recompress_success) && (strncmp(recompress_msg, "synching failure", 16) == 0)) {
+        bool synching_failure = in_memory ? mem_result->synching_failure : ((!recompress_success) && (strncmp(recompress_msg, "synching failure", 16) == 0));
+        if (synching_failure) {
           int frame_n;
           int pos;
-          if (sscanf(recompress_msg, "synching failure (frame #%i at 0x%X)", &frame_n, &pos) == 2) {
+          // in memory, mp3_recompress_in_memory already did the retry
+          if ((!in_memory) && (sscanf(recompress_msg, "synching failure (frame #%i at 0x%X)", &frame_n, &pos) == 2)) {
             if ((pos > 0) && (pos < mp3_length)) {
               mp3_length = pos;
 
               if (DEBUG_MODE) printf ("Too much garbage data at the end, retry with new length %i\n", pos);
 
-              if (in_memory) {
-                pmplib_init_streams(mp3_mem_in, 1, mp3_length, mp3_mem_out, 1);
-                recompress_success = pmplib_convert_stream2mem(&mp3_mem_out, &mp3_mem_out_size, recompress_msg);
-              } else {
-                fmp3 = tryOpen(tempfile0, "r+b");
-                ftruncate(fileno(fmp3), pos);
-                safe_fclose(&fmp3);
-                remove(tempfile1);
+              fmp3 = tryOpen(tempfile0, "r+b");
+              ftruncate(fileno(fmp3), pos);
+              safe_fclose(&fmp3);
+              remove_temp_file(tempfile1);
 
-                // workaround for bugs, similar to packJPG
-                FILE* fworkaround = tryOpen(tempfile1,"wb");
-                safe_fclose(&fworkaround);
+              // workaround for bugs, similar to packJPG
+              FILE* fworkaround = tryOpen(tempfile1,"wb");
+              safe_fclose(&fworkaround);
 
-                recompress_success = pmplib_convert_file2file(tempfile0, tempfile1, recompress_msg);
-              }
+              recompress_success = pmplib_convert_file2file(tempfile0, tempfile1, recompress_msg);
             }
           }
         } else if ((!recompress_success) && (strncmp(recompress_msg, "big value pairs out of bounds", 29) == 0)) {
@@ -6939,7 +8132,7 @@ void try_decompression_mp3 (long long mp3_length) {
         }
 
         if (!in_memory) {
-          remove(tempfile0);
+          remove_temp_file(tempfile0);
         }
 
         if (recompress_success) {
@@ -7003,8 +8196,7 @@ void try_decompression_mp3 (long long mp3_length) {
           }
         }
 
-        if (mp3_mem_in != NULL) delete[] mp3_mem_in;
-        if (mp3_mem_out != NULL) delete[] mp3_mem_out;
+        scratch_buf_release(mp3_mem_in);
 }
 
 bool is_valid_mp3_frame(unsigned char* frame_data, unsigned char header2, unsigned char header3, int protection) {
@@ -7172,7 +8364,7 @@ void try_decompression_bzip2(int compression_level) {
             // write decompressed data
             if (r.success) {
               write_decompressed_data(r.file_length, r.file_name);
-              remove(r.file_name);
+              close_temp_file(r.file_name);
               delete[] r.file_name;
             } else {
               write_decompressed_data(best_identical_bytes_decomp);
@@ -7190,8 +8382,112 @@ void try_decompression_bzip2(int compression_level) {
             }
           }
 
-        }
+        }
+
+}
+
+// JPG entropy coded data ends at the first 0xFF that is neither a stuffed byte (FF 00) nor a
+// RST marker (FF D0..D7). In progressive JPGs, DHT (FF C4) and SOS (FF DA) only start the next
+// scan, so they don't end the image either.
+bool jpg_marker_continues_scan(unsigned char c, bool progressive) {
+  return (c == 0) || ((c & 0xF8) == 0xD0) || (progressive && ((c == 0xC4) || (c == 0xDA)));
+}
+
+// JPG scan kernels return the position of the first 0xFF in buf[0..len-2] that ends the
+// entropy coded data, or len - 1 if there is none. len must be at least 1.
+size_t jpg_scan_bytewise(const unsigned char* buf, size_t len, bool progressive) {
+  for (size_t pos = 0; pos + 1 < len; pos++) {
+    if ((buf[pos] == 0xFF) && (!jpg_marker_continues_scan(buf[pos + 1], progressive))) return pos;
+  }
+  return len - 1;
+}
+
+#ifdef CPU_FEATURES_X86
+// A block and the same block shifted by one byte are compared, so each 0xFF and the byte
+// following it are classified together
+CPU_FEATURES_TARGET("sse2")
+size_t jpg_scan_sse2(const unsigned char* buf, size_t len, bool progressive) {
+  const __m128i ff = _mm_set1_epi8((char)0xFF);
+  const __m128i prog = _mm_set1_epi8(progressive ? (char)0xFF : 0);
+  size_t pos = 0;
+  while (pos + 17 <= len) {
+    __m128i cur = _mm_loadu_si128((const __m128i*)(buf + pos));
+    unsigned int ff_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, ff));
+    if (ff_mask) {
+      __m128i next = _mm_loadu_si128((const __m128i*)(buf + pos + 1));
+      __m128i cont = _mm_or_si128(_mm_cmpeq_epi8(next, _mm_setzero_si128()),
+                                  _mm_cmpeq_epi8(_mm_and_si128(next, _mm_set1_epi8((char)0xF8)), _mm_set1_epi8((char)0xD0)));
+      cont = _mm_or_si128(cont, _mm_and_si128(prog, _mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8((char)0xC4)),
+                                                                 _mm_cmpeq_epi8(next, _mm_set1_epi8((char)0xDA)))));
+      unsigned int end_mask = ff_mask & ~(unsigned int)_mm_movemask_epi8(cont);
+      if (end_mask) return pos + bitTrailingZeroes(end_mask);
+    }
+    pos += 16;
+  }
+  return pos + jpg_scan_bytewise(buf + pos, len - pos, progressive);
+}
+
+CPU_FEATURES_TARGET("avx2")
+size_t jpg_scan_avx2(const unsigned char* buf, size_t len, bool progressive) {
+  const __m256i ff = _mm256_set1_epi8((char)0xFF);
+  const __m256i prog = _mm256_set1_epi8(progressive ? (char)0xFF : 0);
+  size_t pos = 0;
+  while (pos + 33 <= len) {
+    __m256i cur = _mm256_loadu_si256((const __m256i*)(buf + pos));
+    unsigned int ff_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, ff));
+    if (ff_mask) {
+      __m256i next = _mm256_loadu_si256((const __m256i*)(buf + pos + 1));
+      __m256i cont = _mm256_or_si256(_mm256_cmpeq_epi8(next, _mm256_setzero_si256()),
+                                     _mm256_cmpeq_epi8(_mm256_and_si256(next, _mm256_set1_epi8((char)0xF8)), _mm256_set1_epi8((char)0xD0)));
+      cont = _mm256_or_si256(cont, _mm256_and_si256(prog, _mm256_or_si256(_mm256_cmpeq_epi8(next, _mm256_set1_epi8((char)0xC4)),
+                                                                          _mm256_cmpeq_epi8(next, _mm256_set1_epi8((char)0xDA)))));
+      unsigned int end_mask = ff_mask & ~(unsigned int)_mm256_movemask_epi8(cont);
+      if (end_mask) return pos + bitTrailingZeroes(end_mask);
+    }
+    pos += 32;
+  }
+  return pos + jpg_scan_sse2(buf + pos, len - pos, progressive);
+}
+#endif
+
+typedef size_t (*jpg_scan_func)(const unsigned char* buf, size_t len, bool progressive);
 
+jpg_scan_func jpg_scan_select() {
+#ifdef CPU_FEATURES_X86
+  if (cpuHasSSE2() && cpuHasAVX2()) return jpg_scan_avx2;
+  if (cpuHasSSE2()) return jpg_scan_sse2;
+#endif
+  return jpg_scan_bytewise;
+}
+
+const jpg_scan_func jpg_scan_end = jpg_scan_select();
+
+// Looks for the end of the entropy coded data in buf, which continues the data of earlier calls.
+// is_marker carries a 0xFF at the end of the previous buffer over to this one. Returns true when
+// the end was found; consumed is the number of bytes up to and including the byte following the
+// terminating 0xFF, and eoi tells if that marker was EOI (FF D9).
+bool jpg_scan_entropy_data(const unsigned char* buf, size_t len, bool progressive, bool& is_marker, bool& eoi, size_t& consumed) {
+  size_t pos = 0;
+  if (is_marker && (len > 0)) {
+    is_marker = false;
+    if (!jpg_marker_continues_scan(buf[0], progressive)) {
+      eoi = (buf[0] == 0xD9);
+      consumed = 1;
+      return true;
+    }
+    pos = 1;
+  }
+  if (pos < len) {
+    size_t end = pos + jpg_scan_end(buf + pos, len - pos, progressive);
+    if (end + 1 < len) {
+      eoi = (buf[end + 1] == 0xD9);
+      consumed = end + 2;
+      return true;
+    }
+    is_marker = (buf[len - 1] == 0xFF);
+  }
+  consumed = len;
+  return false;
 }
 
 // Base64 alphabet
@@ -7214,12 +8510,523 @@ unsigned char base64_char_decode(unsigned char c) {
   return 65; // invalid
 }
 
-void base64_reencode(FILE* file_in, FILE* file_out, int line_count, unsigned int* base64_line_len, long long max_in_count, long long max_byte_count) {
-          int line_nr = 0;
+// Scan kernels return the number of Base64 characters at the start of buf. Decode kernels
+// turn groups of 4 Base64 characters into 3 bytes, encode kernels turn groups of 3 bytes
+// into 4 Base64 characters.
+size_t base64_scan_bytewise(const unsigned char* buf, size_t len) {
+  size_t pos = 0;
+  while ((pos < len) && (base64_char_decode(buf[pos]) < 64)) pos++;
+  return pos;
+}
+
+void base64_decode_bytewise(const unsigned char* chars, size_t groups, unsigned char* out) {
+  for (size_t i = 0; i < groups; i++, chars += 4, out += 3) {
+    unsigned char a = base64_char_decode(chars[0]);
+    unsigned char b = base64_char_decode(chars[1]);
+    unsigned char c = base64_char_decode(chars[2]);
+    unsigned char d = base64_char_decode(chars[3]);
+    out[0] = (a << 2) | (b >> 4);
+    out[1] = ((b << 4) & 0xFF) | (c >> 2);
+    out[2] = ((c << 6) & 0xFF) | d;
+  }
+}
+
+void base64_encode_bytewise(const unsigned char* bytes, size_t groups, unsigned char* chars) {
+  for (size_t i = 0; i < groups; i++, bytes += 3, chars += 4) {
+    unsigned char a = bytes[0];
+    unsigned char b = bytes[1];
+    unsigned char c = bytes[2];
+    chars[0] = b64[a >> 2];
+    chars[1] = b64[((a & 0x03) << 4) | (b >> 4)];
+    chars[2] = b64[((b & 0x0F) << 2) | (c >> 6)];
+    chars[3] = b64[c & 63];
+  }
+}
+
+#ifdef CPU_FEATURES_X86
+// Bytes are moved so that the range lo..hi starts at -128, then one signed compare checks it
+CPU_FEATURES_TARGET("sse2")
+inline __m128i base64_in_range_sse2(__m128i v, int lo, int hi) {
+  __m128i moved = _mm_add_epi8(v, _mm_set1_epi8((char)(-128 - lo)));
+  return _mm_cmplt_epi8(moved, _mm_set1_epi8((char)(-128 + hi - lo + 1)));
+}
+
+CPU_FEATURES_TARGET("sse2")
+inline __m128i base64_valid_sse2(__m128i v) {
+  __m128i valid = _mm_or_si128(base64_in_range_sse2(v, 'A', 'Z'), base64_in_range_sse2(v, 'a', 'z'));
+  valid = _mm_or_si128(valid, base64_in_range_sse2(v, '0', '9'));
+  valid = _mm_or_si128(valid, _mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+  return _mm_or_si128(valid, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+}
+
+// 6 bit values of valid Base64 characters: the offset is -65 for A-Z, -71 for a-z,
+// +4 for 0-9, +19 for '+' and +16 for '/'
+CPU_FEATURES_TARGET("sse2")
+inline __m128i base64_values_sse2(__m128i v) {
+  __m128i offset = _mm_set1_epi8(-65);
+  offset = _mm_add_epi8(offset, _mm_and_si128(base64_in_range_sse2(v, 'a', 'z'), _mm_set1_epi8(-6)));
+  offset = _mm_add_epi8(offset, _mm_and_si128(base64_in_range_sse2(v, '0', '9'), _mm_set1_epi8(69)));
+  offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')), _mm_set1_epi8(84)));
+  offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), _mm_set1_epi8(81)));
+  return _mm_add_epi8(v, offset);
+}
+
+// Merges the four 6 bit values of each 32 bit lane to 24 bits and moves the three bytes
+// to the start of the lane in big endian order, then packs the lanes
+CPU_FEATURES_TARGET("ssse3")
+inline __m128i base64_pack_ssse3(__m128i values) {
+  __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+// Spreads 12 bytes to 16 6 bit values, one per byte
+CPU_FEATURES_TARGET("ssse3")
+inline __m128i base64_unpack_ssse3(__m128i bytes) {
+  bytes = _mm_shuffle_epi8(bytes, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+  __m128i high = _mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+  __m128i low = _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(high, low);
+}
+
+// Maps 6 bit values to Base64 characters. Values 0..25 use table entry 13, 26..51 entry 0,
+// 52..61 entries 1..10, '+' entry 11 and '/' entry 12.
+CPU_FEATURES_TARGET("ssse3")
+inline __m128i base64_chars_ssse3(__m128i values) {
+  const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m128i index = _mm_subs_epu8(values, _mm_set1_epi8(51));
+  index = _mm_or_si128(index, _mm_and_si128(_mm_cmplt_epi8(values, _mm_set1_epi8(26)), _mm_set1_epi8(13)));
+  return _mm_add_epi8(values, _mm_shuffle_epi8(shift, index));
+}
+
+CPU_FEATURES_TARGET("sse2")
+size_t base64_scan_sse2(const unsigned char* buf, size_t len) {
+  size_t pos = 0;
+  while (pos + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(buf + pos));
+    unsigned int invalid_mask = ~(unsigned int)_mm_movemask_epi8(base64_valid_sse2(v)) & 0xFFFF;
+    if (invalid_mask) return pos + bitTrailingZeroes(invalid_mask);
+    pos += 16;
+  }
+  return pos + base64_scan_bytewise(buf + pos, len - pos);
+}
+
+CPU_FEATURES_TARGET("ssse3")
+void base64_decode_ssse3(const unsigned char* chars, size_t groups, unsigned char* out) {
+  size_t i = 0;
+  for (; i + 4 <= groups; i += 4, chars += 16, out += 12) {
+    __m128i bytes = base64_pack_ssse3(base64_values_sse2(_mm_loadu_si128((const __m128i*)chars)));
+    _mm_storel_epi64((__m128i*)out, bytes);
+    int last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+    memcpy(out + 8, &last, 4);
+  }
+  base64_decode_bytewise(chars, groups - i, out);
+}
+
+// 16 byte loads, so 4 bytes past each group of 12 have to belong to the input
+CPU_FEATURES_TARGET("ssse3")
+void base64_encode_ssse3(const unsigned char* bytes, size_t groups, unsigned char* chars) {
+  size_t i = 0;
+  for (; (i * 3 + 16) <= (groups * 3); i += 4, bytes += 12, chars += 16) {
+    __m128i values = base64_unpack_ssse3(_mm_loadu_si128((const __m128i*)bytes));
+    _mm_storeu_si128((__m128i*)chars, base64_chars_ssse3(values));
+  }
+  base64_encode_bytewise(bytes, groups - i, chars);
+}
+
+CPU_FEATURES_TARGET("avx2")
+inline __m256i base64_in_range_avx2(__m256i v, int lo, int hi) {
+  __m256i moved = _mm256_add_epi8(v, _mm256_set1_epi8((char)(-128 - lo)));
+  return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + hi - lo + 1)), moved);
+}
+
+CPU_FEATURES_TARGET("avx2")
+inline __m256i base64_valid_avx2(__m256i v) {
+  __m256i valid = _mm256_or_si256(base64_in_range_avx2(v, 'A', 'Z'), base64_in_range_avx2(v, 'a', 'z'));
+  valid = _mm256_or_si256(valid, base64_in_range_avx2(v, '0', '9'));
+  valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')));
+  return _mm256_or_si256(valid, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+}
+
+CPU_FEATURES_TARGET("avx2")
+size_t base64_scan_avx2(const unsigned char* buf, size_t len) {
+  size_t pos = 0;
+  while (pos + 32 <= len) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(buf + pos));
+    unsigned int invalid_mask = ~(unsigned int)_mm256_movemask_epi8(base64_valid_avx2(v));
+    if (invalid_mask) return pos + bitTrailingZeroes(invalid_mask);
+    pos += 32;
+  }
+  return pos + base64_scan_sse2(buf + pos, len - pos);
+}
+
+CPU_FEATURES_TARGET("avx2")
+void base64_decode_avx2(const unsigned char* chars, size_t groups, unsigned char* out) {
+  size_t i = 0;
+  for (; i + 8 <= groups; i += 8, chars += 32, out += 24) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)chars);
+    __m256i offset = _mm256_set1_epi8(-65);
+    offset = _mm256_add_epi8(offset, _mm256_and_si256(base64_in_range_avx2(v, 'a', 'z'), _mm256_set1_epi8(-6)));
+    offset = _mm256_add_epi8(offset, _mm256_and_si256(base64_in_range_avx2(v, '0', '9'), _mm256_set1_epi8(69)));
+    offset = _mm256_add_epi8(offset, _mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')), _mm256_set1_epi8(84)));
+    offset = _mm256_add_epi8(offset, _mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), _mm256_set1_epi8(81)));
+    __m256i merged = _mm256_maddubs_epi16(_mm256_add_epi8(v, offset), _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    // 12 bytes at the start of each 128 bit lane, move them together
+    merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(merged));
+    _mm_storel_epi64((__m128i*)(out + 16), _mm256_extracti128_si256(merged, 1));
+  }
+  base64_decode_ssse3(chars, groups - i, out);
+}
+
+// Each 128 bit lane gets its own 16 byte load, the second one starts 12 bytes later
+CPU_FEATURES_TARGET("avx2")
+void base64_encode_avx2(const unsigned char* bytes, size_t groups, unsigned char* chars) {
+  const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                         'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+  for (; (i * 3 + 28) <= (groups * 3); i += 8, bytes += 24, chars += 32) {
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)bytes)),
+                                        _mm_loadu_si128((const __m128i*)(bytes + 12)), 1);
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m256i high = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+    __m256i low = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+    __m256i values = _mm256_or_si256(high, low);
+    __m256i index = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+    index = _mm256_or_si256(index, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), values), _mm256_set1_epi8(13)));
+    _mm256_storeu_si256((__m256i*)chars, _mm256_add_epi8(values, _mm256_shuffle_epi8(shift, index)));
+  }
+  base64_encode_ssse3(bytes, groups - i, chars);
+}
+#endif
+
+typedef size_t (*base64_scan_func)(const unsigned char* buf, size_t len);
+typedef void (*base64_decode_func)(const unsigned char* chars, size_t groups, unsigned char* out);
+typedef void (*base64_encode_func)(const unsigned char* bytes, size_t groups, unsigned char* chars);
+
+base64_scan_func base64_scan_select() {
+#ifdef CPU_FEATURES_X86
+  if (cpuHasSSE2() && cpuHasAVX2()) return base64_scan_avx2;
+  if (cpuHasSSE2()) return base64_scan_sse2;
+#endif
+  return base64_scan_bytewise;
+}
+
+base64_decode_func base64_decode_select() {
+#ifdef CPU_FEATURES_X86
+  if (cpuHasSSSE3() && cpuHasAVX2()) return base64_decode_avx2;
+  if (cpuHasSSSE3()) return base64_decode_ssse3;
+#endif
+  return base64_decode_bytewise;
+}
+
+base64_encode_func base64_encode_select() {
+#ifdef CPU_FEATURES_X86
+  if (cpuHasSSSE3() && cpuHasAVX2()) return base64_encode_avx2;
+  if (cpuHasSSSE3()) return base64_encode_ssse3;
+#endif
+  return base64_encode_bytewise;
+}
+
+const base64_scan_func base64_scan = base64_scan_select();
+const base64_decode_func base64_decode = base64_decode_select();
+const base64_encode_func base64_encode = base64_encode_select();
+
+// Kernel self tests, see the -selftest switch. Every vector kernel the CPU supports has to give
+// the same results as the bytewise one.
+
+// The byte at a time loop the JPG scan kernels replaced. Returns the number of bytes up to and
+// including the one after the terminating 0xFF, or 0 if the entropy coded data doesn't end in buf.
+size_t jpg_scan_reference(const unsigned char* buf, size_t len, bool progressive, bool& eoi) {
+  bool is_marker = false;
+  for (size_t i = 0; i < len; i++) {
+    if (!is_marker) {
+      is_marker = (buf[i] == 0xFF);
+    } else if (!jpg_marker_continues_scan(buf[i], progressive)) {
+      eoi = (buf[i] == 0xD9);
+      return i + 1;
+    } else {
+      is_marker = false;
+    }
+  }
+  return 0;
+}
+
+// Entropy coded data with stuffed bytes and RST markers (and DHT/SOS in progressive mode), ended
+// by a marker at every position that crosses a vector block or a buffer boundary
+bool jpg_scan_self_test() {
+  std::vector<std::pair<const char*, jpg_scan_func>> kernels;
+  kernels.push_back(std::make_pair("bytewise", jpg_scan_bytewise));
+#ifdef CPU_FEATURES_X86
+  if (cpuHasSSE2()) kernels.push_back(std::make_pair("sse2", jpg_scan_sse2));
+  if (cpuHasSSE2() && cpuHasAVX2()) kernels.push_back(std::make_pair("avx2", jpg_scan_avx2));
+#endif
+
+  const size_t len = 200;
+  unsigned char body[len], buf[len];
+  unsigned int seed = 12345;
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    body[i] = ((seed >> 8) % 5 == 0) ? 0xFF : (unsigned char)(seed >> 16);
+    if ((body[i] == 0xFF) && (i + 1 < len)) {
+      unsigned int kind = (seed >> 24) % 8;
+      body[++i] = (kind == 0) ? 0xD0 + (seed >> 4) % 8 : (kind == 1) ? 0xC4 : (kind == 2) ? 0xDA : 0x00;
+    }
+  }
+
+  const unsigned char terms[] = { 0xD9, 0xC4, 0xDA, 0xE1, 0xFF };
+  for (int progressive = 0; progressive < 2; progressive++) {
+    for (size_t t = 0; t <= sizeof(terms); t++) {
+      for (size_t end_pos = 0; end_pos < ((t < sizeof(terms)) ? 140 : 1); end_pos++) {
+        memcpy(buf, body, len);
+        if (t < sizeof(terms)) {
+          buf[end_pos] = 0xFF;
+          buf[end_pos + 1] = terms[t];
+        } else { // no end at all, only markers that continue the scan
+          for (size_t i = 0; i + 1 < len; i++) {
+            if ((buf[i] == 0xFF) && (!jpg_marker_continues_scan(buf[i + 1], progressive != 0))) buf[i + 1] = 0;
+          }
+        }
+
+        for (size_t k = 0; k < kernels.size(); k++) {
+          for (size_t offset = 0; offset < 3; offset++) {
+            for (size_t n = 1; n + offset <= len; n += 7) {
+              bool eoi;
+              size_t ref = jpg_scan_reference(buf + offset, n, progressive != 0, eoi);
+              if (kernels[k].second(buf + offset, n, progressive != 0) != (ref ? ref - 2 : n - 1)) {
+                printf("JPG scan kernel %s failed\n", kernels[k].first);
+                return false;
+              }
+            }
+          }
+        }
+
+        bool ref_eoi = false;
+        size_t ref = jpg_scan_reference(buf, len, progressive != 0, ref_eoi);
+        const size_t chunks[] = { 1, 2, 3, 15, 16, 17, 31, 32, 33, 64, len };
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+          bool is_marker = false, eoi = false, done = false;
+          size_t total = 0;
+          for (size_t pos = 0; (pos < len) && (!done); pos += chunks[c]) {
+            size_t consumed;
+            done = jpg_scan_entropy_data(buf + pos, min(chunks[c], len - pos), progressive != 0, is_marker, eoi, consumed);
+            total += consumed;
+          }
+          if ((done != (ref != 0)) || (done && ((total != ref) || (eoi != ref_eoi)))) {
+            printf("JPG entropy data scan in chunks of %i bytes failed\n", (int)chunks[c]);
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Base64 kernels of one instruction set, NULL for the ones the CPU doesn't support
+struct base64_kernel_set {
+  const char* name;
+  base64_scan_func scan;
+  base64_decode_func decode;
+  base64_encode_func encode;
+};
+
+std::vector<base64_kernel_set> base64_kernel_sets() {
+  std::vector<base64_kernel_set> sets;
+  base64_kernel_set bytewise = { "bytewise", base64_scan_bytewise, base64_decode_bytewise, base64_encode_bytewise };
+  sets.push_back(bytewise);
+#ifdef CPU_FEATURES_X86
+  base64_kernel_set sse = { "sse2/ssse3", cpuHasSSE2() ? base64_scan_sse2 : NULL,
+                            cpuHasSSSE3() ? base64_decode_ssse3 : NULL, cpuHasSSSE3() ? base64_encode_ssse3 : NULL };
+  base64_kernel_set avx2 = { "avx2", (cpuHasSSE2() && cpuHasAVX2()) ? base64_scan_avx2 : NULL,
+                             (cpuHasSSSE3() && cpuHasAVX2()) ? base64_decode_avx2 : NULL,
+                             (cpuHasSSSE3() && cpuHasAVX2()) ? base64_encode_avx2 : NULL };
+  sets.push_back(sse);
+  sets.push_back(avx2);
+#endif
+  return sets;
+}
+
+// Every length up to a few vectors, so each kernel ends in a tail shorter than one vector,
+// at unaligned starts. Outputs may not be written past their end.
+bool base64_self_test() {
+  std::vector<base64_kernel_set> sets = base64_kernel_sets();
+
+  const size_t max_groups = 48;
+  unsigned char bytes[max_groups * 3 + 2], ref_chars[max_groups * 4];
+  unsigned char chars[max_groups * 4 + 1], out[max_groups * 3 + 1];
+  unsigned int seed = 12345;
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    seed = seed * 1103515245 + 12345;
+    bytes[i] = (unsigned char)(seed >> 16);
+  }
+
+  for (size_t offset = 0; offset < 3; offset++) {
+    for (size_t groups = 0; groups <= max_groups; groups++) {
+      base64_encode_bytewise(bytes + offset, groups, ref_chars);
+      for (size_t k = 0; k < sets.size(); k++) {
+        if (sets[k].encode != NULL) {
+          memset(chars, 0xAA, sizeof(chars));
+          sets[k].encode(bytes + offset, groups, chars);
+          if ((memcmp(chars, ref_chars, groups * 4) != 0) || (chars[groups * 4] != 0xAA)) {
+            printf("Base64 encode kernel %s failed for %i groups\n", sets[k].name, (int)groups);
+            return false;
+          }
+        }
+        if (sets[k].decode != NULL) {
+          memset(out, 0xAA, sizeof(out));
+          sets[k].decode(ref_chars, groups, out);
+          if ((memcmp(out, bytes + offset, groups * 3) != 0) || (out[groups * 3] != 0xAA)) {
+            printf("Base64 decode kernel %s failed for %i groups\n", sets[k].name, (int)groups);
+            return false;
+          }
+        }
+      }
+    }
+  }
+
+  // Base64 characters, ended by a line break, padding or an invalid character at every position
+  const unsigned char stops[] = { 13, 10, '=', '-', ' ', '.', 0x80, 0xFF };
+  const size_t max_len = 100;
+  unsigned char text[max_len + 1];
+  for (size_t offset = 0; offset < 2; offset++) {
+    for (size_t len = 0; len + offset <= max_len; len++) {
+      for (size_t stop = 0; stop <= len; stop++) {
+        for (size_t i = 0; i < len; i++) {
+          seed = seed * 1103515245 + 12345;
+          text[offset + i] = b64[(seed >> 16) & 63];
+        }
+        if (stop < len) text[offset + stop] = stops[(len + stop) % sizeof(stops)];
+        for (size_t k = 0; k < sets.size(); k++) {
+          if ((sets[k].scan != NULL) && (sets[k].scan(text + offset, len) != stop)) {
+            printf("Base64 scan kernel %s failed\n", sets[k].name);
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// A long attachment stored with line case 3 (line length runs), more than 65535 lines in one run. Every
+// kernel has to find the same line ends and give the same characters and bytes, and
+// base64_reencode has to restore the text with its CRLFs.
+bool base64_lines_self_test() {
+  std::vector<base64_kernel_set> sets = base64_kernel_sets();
+
+  const base64_line_run runs[] = { { 76, 70000 }, { 64, 2 }, { 76, 3000 }, { 12, 1 } };
+  std::vector<base64_line_run> line_lengths(runs, runs + sizeof(runs) / sizeof(runs[0]));
+  size_t char_count = 0;
+  for (size_t r = 0; r < line_lengths.size(); r++) {
+    char_count += line_lengths[r].length * line_lengths[r].count;
+  }
+
+  std::vector<unsigned char> bytes(char_count / 4 * 3);
+  unsigned int seed = 12345;
+  for (size_t i = 0; i < bytes.size(); i++) {
+    seed = seed * 1103515245 + 12345;
+    bytes[i] = (unsigned char)(seed >> 16);
+  }
+  std::vector<unsigned char> ref_chars(char_count);
+  base64_encode_bytewise(bytes.data(), char_count / 4, ref_chars.data());
+  std::vector<unsigned char> text;
+  size_t pos = 0;
+  for (size_t r = 0; r < line_lengths.size(); r++) {
+    for (long long l = 0; l < line_lengths[r].count; l++) {
+      text.insert(text.end(), ref_chars.begin() + pos, ref_chars.begin() + pos + line_lengths[r].length);
+      text.push_back(13);
+      text.push_back(10);
+      pos += line_lengths[r].length;
+    }
+  }
+
+  std::vector<unsigned char> chars(char_count);
+  std::vector<unsigned char> out(bytes.size());
+  for (size_t k = 0; k < sets.size(); k++) {
+    if (sets[k].scan != NULL) {
+      size_t text_pos = 0;
+      for (size_t r = 0; r < line_lengths.size(); r++) {
+        for (long long l = 0; l < line_lengths[r].count; l++) {
+          if (sets[k].scan(text.data() + text_pos, text.size() - text_pos) != line_lengths[r].length) {
+            printf("Base64 scan kernel %s failed for line runs\n", sets[k].name);
+            return false;
+          }
+          text_pos += line_lengths[r].length + 2;
+        }
+      }
+    }
+    if (sets[k].encode != NULL) {
+      sets[k].encode(bytes.data(), char_count / 4, chars.data());
+      if (chars != ref_chars) {
+        printf("Base64 encode kernel %s failed for line runs\n", sets[k].name);
+        return false;
+      }
+    }
+    if (sets[k].decode != NULL) {
+      sets[k].decode(ref_chars.data(), char_count / 4, out.data());
+      if (out != bytes) {
+        printf("Base64 decode kernel %s failed for line runs\n", sets[k].name);
+        return false;
+      }
+    }
+  }
+
+  FILE* file_in = tmpfile();
+  FILE* file_out = tmpfile();
+  if ((file_in == NULL) || (file_out == NULL)) {
+    printf("Base64 reencode test couldn't create temporary files\n");
+    return false;
+  }
+  fwrite(bytes.data(), 1, bytes.size(), file_in);
+  rewind(file_in);
+  base64_reencode(file_in, file_out, line_lengths);
+  std::vector<unsigned char> restored(text.size() + 1);
+  rewind(file_out);
+  size_t restored_size = fread(restored.data(), 1, restored.size(), file_out);
+  fclose(file_in);
+  fclose(file_out);
+  if ((restored_size != text.size()) || (memcmp(restored.data(), text.data(), text.size()) != 0)) {
+    printf("Base64 reencode failed for line runs\n");
+    return false;
+  }
+  return true;
+}
+
+bool kernel_self_tests() {
+  return jpg_scan_self_test() && base64_self_test() && base64_lines_self_test();
+}
+
+// Consecutive lines of the same length are stored as one run
+void base64_line_add(std::vector<base64_line_run>& line_lengths, unsigned int length) {
+  if ((!line_lengths.empty()) && (line_lengths.back().length == length)) {
+    line_lengths.back().count++;
+  } else {
+    base64_line_run run = { length, 1 };
+    line_lengths.push_back(run);
+  }
+}
+
+// Lines past the last run have length 0, they get no line break
+void base64_reencode(FILE* file_in, FILE* file_out, const std::vector<base64_line_run>& line_lengths, long long max_in_count, long long max_byte_count) {
+          // encoded characters of one chunk, then the same with line breaks; lines can be
+          // a single character long, so there's room for a CRLF after each character
+          unsigned char* chars = scratch_buf_get(DIV3CHUNK / 3 * 4);
+          unsigned char* lines = scratch_buf_get(DIV3CHUNK / 3 * 4 * 3);
+
+          size_t run = 0;
+          long long run_lines = 0;
+          unsigned int line_len = line_lengths.empty() ? 0 : line_lengths[0].length;
           unsigned int act_line_len = 0;
+          bool lines_finished = false;
           int avail_in;
-          unsigned char a,b,c;
-          int i;
           long long act_byte_count = 0;
 
           long long remaining_bytes = max_in_count;
@@ -7238,184 +9045,141 @@ void base64_reencode(FILE* file_in, FILE* file_out, int line_count, unsigned int
               avail_in++;
             }
 
-            for (i = 0; i < (avail_in/3); i++) {
-              a = in[i * 3];
-              b = in[i * 3 + 1];
-              c = in[i * 3 + 2];
-              if (act_byte_count < max_byte_count) own_fputc(b64[a >> 2], file_out);
-              act_byte_count++;
-              act_line_len++;
-              if (act_line_len == base64_line_len[line_nr]) { // end of line, write CRLF
-                if (act_byte_count < max_byte_count) own_fputc(13, file_out);
-                act_byte_count++;
-                if (act_byte_count < max_byte_count) own_fputc(10, file_out);
-                act_byte_count++;
-                act_line_len = 0;
-                line_nr++;
-                if (line_nr == line_count) break;
-              }
-              if (act_byte_count < max_byte_count) own_fputc(b64[((a & 0x03) << 4) | (b >> 4)], file_out);
-              act_byte_count++;
-              act_line_len++;
-              if (act_line_len == base64_line_len[line_nr]) { // end of line, write CRLF
-                if (act_byte_count < max_byte_count) own_fputc(13, file_out);
-                act_byte_count++;
-                if (act_byte_count < max_byte_count) own_fputc(10, file_out);
-                act_byte_count++;
-                act_line_len = 0;
-                line_nr++;
-                if (line_nr == line_count) break;
-              }
-              if (act_byte_count < max_byte_count) own_fputc(b64[((b & 0x0F) << 2) | (c >> 6)], file_out);
-              act_byte_count++;
-              act_line_len++;
-              if (act_line_len == base64_line_len[line_nr]) { // end of line, write CRLF
-                if (act_byte_count < max_byte_count) own_fputc(13, file_out);
-                act_byte_count++;
-                if (act_byte_count < max_byte_count) own_fputc(10, file_out);
-                act_byte_count++;
-                act_line_len = 0;
-                line_nr++;
-                if (line_nr == line_count) break;
-              }
-              if (act_byte_count < max_byte_count) own_fputc(b64[c & 63], file_out);
-              act_byte_count++;
-              act_line_len++;
-              if (act_line_len == base64_line_len[line_nr]) { // end of line, write CRLF
-                if (act_byte_count < max_byte_count) own_fputc(13, file_out);
-                act_byte_count++;
-                if (act_byte_count < max_byte_count) own_fputc(10, file_out);
-                act_byte_count++;
+            size_t char_count = (avail_in / 3) * 4;
+            base64_encode(in, avail_in / 3, chars);
+
+            // copy the characters line by line, write CRLF at the end of each line
+            size_t pos = 0;
+            size_t lines_len = 0;
+            while (pos < char_count) {
+              size_t n = char_count - pos;
+              if ((line_len > 0) && (n > line_len - act_line_len)) n = line_len - act_line_len;
+              memcpy(lines + lines_len, chars + pos, n);
+              pos += n;
+              lines_len += n;
+              act_line_len += n;
+              if ((line_len > 0) && (act_line_len == line_len)) { // end of line, write CRLF
+                lines[lines_len++] = 13;
+                lines[lines_len++] = 10;
                 act_line_len = 0;
-                line_nr++;
-                if (line_nr == line_count) break;
+                run_lines++;
+                if (run_lines == line_lengths[run].count) {
+                  run++;
+                  run_lines = 0;
+                  if (run == line_lengths.size()) {
+                    lines_finished = true;
+                    break;
+                  }
+                  line_len = line_lengths[run].length;
+                }
               }
             }
-            if (line_nr == line_count) break;
-          } while ((remaining_bytes > 0) && (avail_in > 0));
 
+            if (act_byte_count < max_byte_count) {
+              own_fwrite(lines, 1, min((long long)lines_len, max_byte_count - act_byte_count), file_out);
+            }
+            act_byte_count += lines_len;
+          } while ((!lines_finished) && (remaining_bytes > 0) && (avail_in > 0));
+
+          scratch_buf_release(lines);
+          scratch_buf_release(chars);
 }
 
 void try_decompression_base64(int base64_header_length) {
   init_decompression_variables();
 
         // try to decode at current position
-        remove(tempfile1);
+        remove_temp_file(tempfile1);
         ftempout = tryOpen(tempfile1,"wb");
         seek_64(fin, input_file_pos);
 
-        unsigned char base64_data[CHUNK >> 2];
-        unsigned int* base64_line_len = new unsigned int[65536];
+        // Base64 characters without line breaks, then the decoded bytes
+        unsigned char* base64_data = scratch_buf_get(CHUNK + 4);
+        unsigned char* base64_out = scratch_buf_get((CHUNK + 4) / 4 * 3);
+        std::vector<base64_line_run> line_lengths;
 
         int avail_in = 0;
-        int i, j, k;
-        unsigned char a, b, c, d;
+        size_t k = 0;
         int cr_count = 0;
         bool decoding_failed = false;
         bool stream_finished = false;
-        k = 0;
 
-        unsigned int line_nr = 0;
-        int line_count = 0;
+        long long line_count = 0;
         unsigned int act_line_len = 0;
 
         do {
           avail_in = fread(in, 1, CHUNK, fin);
-          for (i = 0; i < (avail_in >> 2); i++) {
-            // are these valid base64 chars?
-            for (j = (i << 2); j < ((i << 2) + 4); j++) {
-              c = base64_char_decode(in[j]);
-              if (c < 64) {
-                base64_data[k] = c;
-                k++;
-                cr_count = 0;
-                act_line_len++;
-                continue;
-              }
-              if ((in[j] == 13) || (in[j] == 10)) {
-                if (in[j] == 13) {
-                  cr_count++;
-                  if (cr_count == 2) { // double CRLF -> base64 end
-                    stream_finished = true;
-                    break;
-                  }
-                  base64_line_len[line_nr] = act_line_len;
-                  line_nr++;
-                  if (line_nr == 65534) stream_finished = true;
-                  act_line_len = 0;
-                }
-                continue;
-              } else {
-                cr_count = 0;
-              }
-              stream_finished = true;
-              base64_line_len[line_nr] = act_line_len;
-              line_nr++;
-              act_line_len = 0;
-              // "=" -> Padding
-              if (in[j] == '=') {
-                while ((k % 4) != 0) {
-                  base64_data[k] = 0;
-                  k++;
-                }
+          // only whole groups of 4 characters are used
+          size_t avail_end = avail_in & ~3;
+          size_t pos = 0;
+          while (pos < avail_end) {
+            // copy the Base64 characters up to the next line break at once
+            size_t n = base64_scan(in + pos, avail_end - pos);
+            if (n > 0) {
+              memcpy(base64_data + k, in + pos, n);
+              k += n;
+              pos += n;
+              act_line_len += n;
+              cr_count = 0;
+              if (pos == avail_end) break;
+            }
+            unsigned char c = in[pos++];
+            if (c == 10) continue;
+            if (c == 13) {
+              cr_count++;
+              if (cr_count == 2) { // double CRLF -> base64 end
+                stream_finished = true;
                 break;
               }
-              // "-" -> base64 end
-              if (in[j] == '-') break;
-              // invalid char found -> decoding failed
+            } else {
+              stream_finished = true;
+            }
+            // if one of the lines is longer than 255 characters -> decoding failed
+            if (act_line_len > 255) {
               decoding_failed = true;
               break;
             }
-            if (decoding_failed) break;
-
-            for (j = 0; j < (k >> 2); j++) {
-              a = base64_data[(j << 2)];
-              b = base64_data[(j << 2) + 1];
-              c = base64_data[(j << 2) + 2];
-              d = base64_data[(j << 2) + 3];
-              fputc((a << 2) | (b >> 4), ftempout);
-              fputc(((b << 4) & 0xFF) | (c >> 2), ftempout);
-              fputc(((c << 6) & 0xFF) | d, ftempout);
-            }
-            if (stream_finished) break;
-            for (j = 0; j < (k % 4); j++) {
-              base64_data[j] = base64_data[((k >> 2) << 2) + j];
+            base64_line_add(line_lengths, act_line_len);
+            line_count++;
+            act_line_len = 0;
+            if (c == 13) continue;
+            // "=" -> Padding
+            if (c == '=') {
+              while ((k % 4) != 0) {
+                base64_data[k] = 'A';
+                k++;
+              }
+              break;
             }
-            k = k % 4;
-          }
-        } while ((avail_in == CHUNK) && (!decoding_failed) && (!stream_finished));
-
-        line_count = line_nr;
-        // if one of the lines is longer than 255 characters -> decoding failed
-        for (i = 0; i < line_count; i++) {
-          if (base64_line_len[i] > 255) {
+            // "-" -> base64 end
+            if (c == '-') break;
+            // invalid char found -> decoding failed
             decoding_failed = true;
             break;
           }
-        }
+          if (decoding_failed) break;
+
+          // decode all complete groups, the rest is kept for the next chunk
+          size_t groups = k >> 2;
+          base64_decode(base64_data, groups, base64_out);
+          fwrite(base64_out, 1, groups * 3, ftempout);
+          memmove(base64_data, base64_data + (groups << 2), k & 3);
+          k &= 3;
+        } while ((avail_in == CHUNK) && (!decoding_failed) && (!stream_finished));
+
+        scratch_buf_release(base64_out);
+        scratch_buf_release(base64_data);
 
         safe_fclose(&ftempout);
 
         if (!decoding_failed) {
-          int line_case = -1;
-          // check line case
-          if (line_count == 1) {
+          int line_case = 2; // save complete line length list
+          if (line_lengths.size() <= 1) {
             line_case = 0; // one length for all lines
-          } else {
-            for (i = 1; i < (line_count - 1); i++) {
-              if (base64_line_len[i] != base64_line_len[0]) {
-                line_case = 2; // save complete line length list
-                break;
-              }
-            }
-            if (line_case == -1) {
-              // check last line
-              if (base64_line_len[line_count - 1] == base64_line_len[0]) {
-                line_case = 0; // one length for all lines
-              } else {
-                line_case = 1; // first length for all lines, second length for last line
-              }
-            }
+          } else if ((line_lengths.size() == 2) && (line_lengths[1].count == 1)) {
+            line_case = 1; // first length for all lines, second length for last line
+          } else if ((long long)line_lengths.size() * 4 < line_count) {
+            line_case = 3; // save line length runs
           }
 
           decompressed_streams_count++;
@@ -7440,10 +9204,10 @@ void try_decompression_base64(int base64_header_length) {
             error(ERR_TEMP_FILE_DISAPPEARED);
           }
 
-          remove(tempfile2);
+          remove_temp_file(tempfile2);
           frecomp = tryOpen(tempfile2,"w+b");
 
-          base64_reencode(ftempout, frecomp, line_count, base64_line_len);
+          base64_reencode(ftempout, frecomp, line_lengths);
 
           safe_fclose(&ftempout);
 
@@ -7482,16 +9246,22 @@ void try_decompression_base64(int base64_header_length) {
 
             fout_fput_vlint(line_count);
             if (line_case == 2) {
-              for (i = 0; i < line_count; i++) {
-                fout_fputc(base64_line_len[i]);
+              for (size_t i = 0; i < line_lengths.size(); i++) {
+                for (long long j = 0; j < line_lengths[i].count; j++) {
+                  fout_fputc(line_lengths[i].length);
+                }
+              }
+            } else if (line_case == 3) {
+              fout_fput_vlint(line_lengths.size());
+              for (size_t i = 0; i < line_lengths.size(); i++) {
+                fout_fputc(line_lengths[i].length);
+                fout_fput_vlint(line_lengths[i].count);
               }
             } else {
-              fout_fputc(base64_line_len[0]);
-              if (line_case == 1) fout_fputc(base64_line_len[line_count - 1]);
+              fout_fputc(line_lengths.empty() ? 0 : line_lengths[0].length);
+              if (line_case == 1) fout_fputc(line_lengths[1].length);
             }
 
-            delete[] base64_line_len;
-
             fout_fput_vlint(identical_bytes);
             fout_fput_vlint(identical_bytes_decomp);
 
@@ -7502,7 +9272,7 @@ void try_decompression_base64(int base64_header_length) {
             // write decompressed data
             if (r.success) {
               write_decompressed_data(r.file_length, r.file_name);
-              remove(r.file_name);
+              close_temp_file(r.file_name);
               delete[] r.file_name;
             } else {
               write_decompressed_data(identical_bytes);
@@ -7662,13 +9432,147 @@ long long fileSize64(char* filename) {
   #endif // __unix
 }
 
+#ifdef __linux__
+// open an anonymous temporary file in the temp directory; if the file system doesn't
+// support O_TMPFILE, -1 is returned and named files are used like on other systems
+int open_anonymous_temp_file() {
+  int fd = -1;
+  #ifdef O_TMPFILE
+  fd = open((temp_dir[0] != 0) ? temp_dir : ".", O_TMPFILE | O_RDWR, 0600);
+  #endif
+  if (fd < 0) return -1;
+
+  // the file is accessed by name, so make sure /proc is available
+  char fd_name[TEMPFILE_NAME_SIZE];
+  sprintf(fd_name, ANONYMOUS_TEMPFILE_PREFIX "%i", fd);
+  if (access(fd_name, R_OK | W_OK) != 0) {
+    close(fd);
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(anonymous_temp_mutex);
+  anonymous_temp_fds.insert(fd);
+  return fd;
+}
+
+void close_anonymous_temp_file(int fd) {
+  std::lock_guard<std::mutex> lock(anonymous_temp_mutex);
+  if (anonymous_temp_fds.erase(fd) > 0) close(fd);
+}
+
+// descriptor of the open anonymous temporary file with the given name, -1 if there is none
+int anonymous_temp_file_fd(const char* filename) {
+  if (!is_anonymous_temp_file(filename)) return -1;
+  int fd = atoi(filename + strlen(ANONYMOUS_TEMPFILE_PREFIX));
+  std::lock_guard<std::mutex> lock(anonymous_temp_mutex);
+  return (anonymous_temp_fds.count(fd) > 0) ? fd : -1;
+}
+
+bool init_anonymous_temp_files() {
+  char* names[5] = { metatempfile, tempfile0, tempfile1, tempfile2, tempfile3 };
+  int fds[5];
+  for (int i = 0; i < 5; i++) {
+    fds[i] = open_anonymous_temp_file();
+    if (fds[i] < 0) {
+      for (int j = 0; j < i; j++) close_anonymous_temp_file(fds[j]);
+      return false;
+    }
+  }
+  for (int i = 0; i < 5; i++) {
+    sprintf(names[i], ANONYMOUS_TEMPFILE_PREFIX "%i", fds[i]);
+  }
+  return true;
+}
+#endif
+
+void set_temp_dir(const char* dir) {
+  int len = strlen(dir);
+  if (len == 0) {
+    printf("ERROR: Directory needed for temporary files\n");
+    exit(1);
+  }
+  if (len >= TEMP_DIR_MAX_LEN) {
+    printf("ERROR: Path for temporary files too long (maximum %i characters)\n", TEMP_DIR_MAX_LEN - 1);
+    exit(1);
+  }
+  strcpy(temp_dir, dir);
+  if ((temp_dir[len - 1] != PATH_DELIM) && (temp_dir[len - 1] != '/')) {
+    temp_dir[len] = PATH_DELIM;
+    temp_dir[len + 1] = 0;
+  }
+}
+
+bool is_anonymous_temp_file(const char* filename) {
+  return (strncmp(filename, ANONYMOUS_TEMPFILE_PREFIX, strlen(ANONYMOUS_TEMPFILE_PREFIX)) == 0);
+}
+
+// discard the content of a temporary file that will be reused
+void remove_temp_file(char* filename) {
+  #ifdef __linux__
+  if (is_anonymous_temp_file(filename)) {
+    int fd = anonymous_temp_file_fd(filename);
+    if ((fd >= 0) && (ftruncate(fd, 0) != 0)) {
+      error(ERR_TEMP_FILE_DISAPPEARED);
+    }
+    return;
+  }
+  #endif
+  remove(filename);
+}
+
+// remove a temporary file that isn't needed anymore
+void close_temp_file(char* filename) {
+  #ifdef __linux__
+  if (is_anonymous_temp_file(filename)) {
+    int fd = anonymous_temp_file_fd(filename);
+    if (fd >= 0) close_anonymous_temp_file(fd);
+    return;
+  }
+  #endif
+  remove(filename);
+}
+
+// name for the output file of a recursion, tempfile1 is its input
+char* new_recursion_temp_file_name() {
+  char* filename = new char[TEMPFILE_NAME_SIZE + 1];
+  #ifdef __linux__
+  if (is_anonymous_temp_file(tempfile1)) {
+    int fd = open_anonymous_temp_file();
+    if (fd >= 0) {
+      sprintf(filename, ANONYMOUS_TEMPFILE_PREFIX "%i", fd);
+    } else { // no anonymous file available anymore, use a named one
+      sprintf(filename, "%s~temp%06i%03i_.dat", temp_dir, (int)(getpid() % 1000000), recursion_depth);
+      // take the recursion output slot of this level, so CTRL-C removes it
+      strcpy(tempfilelist + (tempfilelist_count - 5) * TEMPFILE_NAME_SIZE, filename);
+    }
+    return filename;
+  }
+  #endif
+  strcpy(filename, tempfile1);
+  strcat(filename, "_");
+  return filename;
+}
+
 void init_temp_files() {
+  #ifdef __linux__
+  if (init_anonymous_temp_files()) {
+    update_temp_file_list();
+    return;
+  }
+  #endif
+
+  int prefix_len = strlen(temp_dir);
+  sprintf(metatempfile, "%s~temp00000000.dat", temp_dir);
+  sprintf(tempfile0, "%s~temp000000000.dat", temp_dir);
+  sprintf(tempfile1, "%s~temp000000001.dat", temp_dir);
+  sprintf(tempfile2, "%s~temp000000002.dat", temp_dir);
+  sprintf(tempfile3, "%s~temp000000003.dat", temp_dir);
+
   if (recursion_depth == 0) {
     int i = 0, j, k;
     do {
       k = i;
       for (j = 1; j >= 0; j--) {
-        metatempfile[5 + j] = '0' + (k % 10);
+        metatempfile[prefix_len + 5 + j] = '0' + (k % 10);
         k /= 10;
       }
       i++;
@@ -7680,7 +9584,7 @@ void init_temp_files() {
   do {
     k = i;
     for (j = 7; j >= 2; j--) {
-      metatempfile[5+j] = '0' + (k % 10);
+      metatempfile[prefix_len + 5 + j] = '0' + (k % 10);
       k /= 10;
     }
     i++;
@@ -7688,18 +9592,18 @@ void init_temp_files() {
 
   k = i - 1;
   for (j = 7; j >= 2; j--) {
-    tempfile0[5+j] = '0' + (k % 10);
-    tempfile1[5+j] = '0' + (k % 10);
-    tempfile2[5+j] = '0' + (k % 10);
-    tempfile3[5+j] = '0' + (k % 10);
+    tempfile0[prefix_len + 5 + j] = '0' + (k % 10);
+    tempfile1[prefix_len + 5 + j] = '0' + (k % 10);
+    tempfile2[prefix_len + 5 + j] = '0' + (k % 10);
+    tempfile3[prefix_len + 5 + j] = '0' + (k % 10);
     k /= 10;
   }
   k = tempfile_instance;
   for (j = 1; j >= 0; j--) {
-    tempfile0[5 + j] = '0' + (k % 10);
-    tempfile1[5 + j] = '0' + (k % 10);
-    tempfile2[5 + j] = '0' + (k % 10);
-    tempfile3[5 + j] = '0' + (k % 10);
+    tempfile0[prefix_len + 5 + j] = '0' + (k % 10);
+    tempfile1[prefix_len + 5 + j] = '0' + (k % 10);
+    tempfile2[prefix_len + 5 + j] = '0' + (k % 10);
+    tempfile3[prefix_len + 5 + j] = '0' + (k % 10);
     k /= 10;
   }
 
@@ -7707,20 +9611,22 @@ void init_temp_files() {
   FILE* f = fopen(metatempfile, "wb");
   safe_fclose(&f);
 
-  // update temporary file list
+  update_temp_file_list();
+}
+
+void update_temp_file_list() {
   tempfilelist_count += 8;
-  tempfilelist = (char*)realloc(tempfilelist, 20 * tempfilelist_count * sizeof(char));
-  strcpy(tempfilelist + (tempfilelist_count - 8) * 20, metatempfile);
-  strcpy(tempfilelist + (tempfilelist_count - 7) * 20, tempfile0);
-  strcpy(tempfilelist + (tempfilelist_count - 6) * 20, tempfile1);
+  tempfilelist = (char*)realloc(tempfilelist, TEMPFILE_NAME_SIZE * tempfilelist_count * sizeof(char));
+  strcpy(tempfilelist + (tempfilelist_count - 8) * TEMPFILE_NAME_SIZE, metatempfile);
+  strcpy(tempfilelist + (tempfilelist_count - 7) * TEMPFILE_NAME_SIZE, tempfile0);
+  strcpy(tempfilelist + (tempfilelist_count - 6) * TEMPFILE_NAME_SIZE, tempfile1);
 
   // recursion input file
-  strcpy(tempfilelist + (tempfilelist_count - 5) * 20, tempfile1);
-  tempfilelist[(tempfilelist_count - 5) * 20 + 18] = '_';
-  tempfilelist[(tempfilelist_count - 5) * 20 + 19] = 0;
+  strcpy(tempfilelist + (tempfilelist_count - 5) * TEMPFILE_NAME_SIZE, tempfile1);
+  strcat(tempfilelist + (tempfilelist_count - 5) * TEMPFILE_NAME_SIZE, "_");
 
-  strcpy(tempfilelist + (tempfilelist_count - 4) * 20, tempfile2);
-  strcpy(tempfilelist + (tempfilelist_count - 2) * 20, tempfile3);
+  strcpy(tempfilelist + (tempfilelist_count - 4) * TEMPFILE_NAME_SIZE, tempfile2);
+  strcpy(tempfilelist + (tempfilelist_count - 2) * TEMPFILE_NAME_SIZE, tempfile3);
 }
 
 void recursion_stack_push(void* var, int var_size) {
@@ -7741,6 +9647,9 @@ void recursion_stack_pop(void* var, int var_size) {
 
 void recursion_push() {
   recursion_stack_push(&fin_length, sizeof(fin_length));
+  recursion_stack_push(&stream_deadline, sizeof(stream_deadline));
+  recursion_stack_push(&outer_stream_deadline, sizeof(outer_stream_deadline));
+  recursion_stack_push(&stream_time_exceeded_reported, sizeof(stream_time_exceeded_reported));
   recursion_stack_push(&input_file_name, sizeof(input_file_name));
   recursion_stack_push(&output_file_name, sizeof(output_file_name));
   recursion_stack_push(&uncompressed_pos, sizeof(uncompressed_pos));
@@ -7766,11 +9675,11 @@ void recursion_push() {
   recursion_stack_push(&fjpg, sizeof(fjpg));
   recursion_stack_push(&fmp3, sizeof(fmp3));
   recursion_stack_push(&in_buf[0], sizeof(in_buf[0]) * IN_BUF_SIZE);
-  recursion_stack_push(&metatempfile[0], sizeof(metatempfile[0]) * 18);
-  recursion_stack_push(&tempfile0[0], sizeof(tempfile0[0]) * 19);
-  recursion_stack_push(&tempfile1[0], sizeof(tempfile1[0]) * 19);
-  recursion_stack_push(&tempfile2[0], sizeof(tempfile2[0]) * 19);
-  recursion_stack_push(&tempfile3[0], sizeof(tempfile3[0]) * 19);
+  recursion_stack_push(&metatempfile[0], sizeof(metatempfile));
+  recursion_stack_push(&tempfile0[0], sizeof(tempfile0));
+  recursion_stack_push(&tempfile1[0], sizeof(tempfile1));
+  recursion_stack_push(&tempfile2[0], sizeof(tempfile2));
+  recursion_stack_push(&tempfile3[0], sizeof(tempfile3));
   recursion_stack_push(&penalty_bytes, sizeof(penalty_bytes));
   recursion_stack_push(&local_penalty_bytes, sizeof(penalty_bytes));
   recursion_stack_push(&best_penalty_bytes, sizeof(penalty_bytes));
@@ -7795,27 +9704,28 @@ void recursion_push() {
   recursion_stack_push(&suppress_mp3_non_zero_padbits_sum, sizeof(suppress_mp3_non_zero_padbits_sum));
   recursion_stack_push(&suppress_mp3_inconsistent_emphasis_sum, sizeof(suppress_mp3_inconsistent_emphasis_sum));
   recursion_stack_push(&suppress_mp3_inconsistent_original_bit, sizeof(suppress_mp3_inconsistent_original_bit));
-  recursion_stack_push(&mp3_parsing_cache_second_frame, sizeof(mp3_parsing_cache_second_frame));
-  recursion_stack_push(&mp3_parsing_cache_n, sizeof(mp3_parsing_cache_n));
-  recursion_stack_push(&mp3_parsing_cache_mp3_length, sizeof(mp3_parsing_cache_mp3_length));
   recursion_stack_push(&intense_ignore_offsets, sizeof(intense_ignore_offsets));
   recursion_stack_push(&brute_ignore_offsets, sizeof(brute_ignore_offsets));
+  recursion_stack_push(&mp3_index, sizeof(mp3_index));
   recursion_stack_push(&decomp_io_buf, sizeof(decomp_io_buf));
+  recursion_stack_push(&decomp_io_buf_size, sizeof(decomp_io_buf_size));
 
   recursion_stack_push(&compression_otf_method, sizeof(compression_otf_method));
   recursion_stack_push(&decompress_otf_end, sizeof(decompress_otf_end));
+
+  // streams found inside the current stream have to finish before its deadline
+  outer_stream_deadline = stream_deadline;
 }
 
 void recursion_pop() {
   recursion_stack_pop(&decompress_otf_end, sizeof(decompress_otf_end));
   recursion_stack_pop(&compression_otf_method, sizeof(compression_otf_method));
 
+  recursion_stack_pop(&decomp_io_buf_size, sizeof(decomp_io_buf_size));
   recursion_stack_pop(&decomp_io_buf, sizeof(decomp_io_buf));
+  recursion_stack_pop(&mp3_index, sizeof(mp3_index));
   recursion_stack_pop(&brute_ignore_offsets, sizeof(brute_ignore_offsets));
   recursion_stack_pop(&intense_ignore_offsets, sizeof(intense_ignore_offsets));
-  recursion_stack_pop(&mp3_parsing_cache_mp3_length, sizeof(mp3_parsing_cache_mp3_length));
-  recursion_stack_pop(&mp3_parsing_cache_n, sizeof(mp3_parsing_cache_n));
-  recursion_stack_pop(&mp3_parsing_cache_second_frame, sizeof(mp3_parsing_cache_second_frame));
   recursion_stack_pop(&suppress_mp3_inconsistent_original_bit, sizeof(suppress_mp3_inconsistent_original_bit));
   recursion_stack_pop(&suppress_mp3_inconsistent_emphasis_sum, sizeof(suppress_mp3_inconsistent_emphasis_sum));
   recursion_stack_pop(&suppress_mp3_non_zero_padbits_sum, sizeof(suppress_mp3_non_zero_padbits_sum));
@@ -7840,11 +9750,11 @@ void recursion_pop() {
   recursion_stack_pop(&best_penalty_bytes, sizeof(penalty_bytes));
   recursion_stack_pop(&local_penalty_bytes, sizeof(penalty_bytes));
   recursion_stack_pop(&penalty_bytes, sizeof(penalty_bytes));
-  recursion_stack_pop(&tempfile3[0], sizeof(tempfile3[0]) * 19);
-  recursion_stack_pop(&tempfile2[0], sizeof(tempfile2[0]) * 19);
-  recursion_stack_pop(&tempfile1[0], sizeof(tempfile1[0]) * 19);
-  recursion_stack_pop(&tempfile0[0], sizeof(tempfile0[0]) * 19);
-  recursion_stack_pop(&metatempfile[0], sizeof(metatempfile[0]) * 18);
+  recursion_stack_pop(&tempfile3[0], sizeof(tempfile3));
+  recursion_stack_pop(&tempfile2[0], sizeof(tempfile2));
+  recursion_stack_pop(&tempfile1[0], sizeof(tempfile1));
+  recursion_stack_pop(&tempfile0[0], sizeof(tempfile0));
+  recursion_stack_pop(&metatempfile[0], sizeof(metatempfile));
   recursion_stack_pop(&in_buf[0], sizeof(in_buf[0]) * IN_BUF_SIZE);
   recursion_stack_pop(&fmp3, sizeof(fmp3));
   recursion_stack_pop(&fjpg, sizeof(fjpg));
@@ -7870,6 +9780,9 @@ void recursion_pop() {
   recursion_stack_pop(&uncompressed_pos, sizeof(uncompressed_pos));
   recursion_stack_pop(&output_file_name, sizeof(output_file_name));
   recursion_stack_pop(&input_file_name, sizeof(input_file_name));
+  recursion_stack_pop(&stream_time_exceeded_reported, sizeof(stream_time_exceeded_reported));
+  recursion_stack_pop(&outer_stream_deadline, sizeof(outer_stream_deadline));
+  recursion_stack_pop(&stream_deadline, sizeof(stream_deadline));
   recursion_stack_pop(&fin_length, sizeof(fin_length));
 }
 
@@ -7897,6 +9810,10 @@ recursion_result recursion_compress(long long compressed_bytes, long long decomp
     return tmp_r;
   }
 
+  if (stream_time_exceeded()) { // no time left for this stream, don't recurse
+    return tmp_r;
+  }
+
   if (deflate_type) {
     write_ftempout_if_not_present(decompressed_bytes, in_memory);
   }
@@ -7919,18 +9836,15 @@ recursion_result recursion_compress(long long compressed_bytes, long long decomp
   }
   input_file_name = new char[strlen(tempfile1)+1];
   strcpy(input_file_name, tempfile1);
-  output_file_name = new char[strlen(tempfile1)+2];
-  strcpy(output_file_name, tempfile1);
-  output_file_name[strlen(tempfile1)] = '_';
-  output_file_name[strlen(tempfile1) + 1] = 0;
-  tmp_r.file_name = new char[strlen(tempfile1)+2];
+  output_file_name = new_recursion_temp_file_name();
+  tmp_r.file_name = new char[strlen(output_file_name)+1];
   strcpy(tmp_r.file_name, output_file_name);
   recursion_fout = tryOpen(output_file_name,"wb");
   fout = recursion_fout;
 
-  penalty_bytes = new char[MAX_PENALTY_BYTES];
-  local_penalty_bytes = new char[MAX_PENALTY_BYTES];
-  best_penalty_bytes = new char[MAX_PENALTY_BYTES];
+  penalty_bytes = (char*)scratch_buf_get(MAX_PENALTY_BYTES);
+  local_penalty_bytes = (char*)scratch_buf_get(MAX_PENALTY_BYTES);
+  best_penalty_bytes = (char*)scratch_buf_get(MAX_PENALTY_BYTES);
 
   intense_ignore_offsets = new set<long long>();
   brute_ignore_offsets = new set<long long>();
@@ -7943,8 +9857,7 @@ recursion_result recursion_compress(long long compressed_bytes, long long decomp
   suppress_mp3_non_zero_padbits_sum = -1;
   suppress_mp3_inconsistent_emphasis_sum = -1;
   suppress_mp3_inconsistent_original_bit = -1;
-
-  mp3_parsing_cache_second_frame = -1;
+  mp3_index = new mp3_frame_index();
 
   // disable compression-on-the-fly in recursion - we don't want compressed compressed streams
   compression_otf_method = OTF_NONE;
@@ -7957,11 +9870,12 @@ recursion_result recursion_compress(long long compressed_bytes, long long decomp
 
   delete intense_ignore_offsets;
   delete brute_ignore_offsets;
+  delete mp3_index;
   delete[] input_file_name;
   delete[] output_file_name;
-  delete[] penalty_bytes;
-  delete[] local_penalty_bytes;
-  delete[] best_penalty_bytes;
+  scratch_buf_release((unsigned char*)penalty_bytes);
+  scratch_buf_release((unsigned char*)local_penalty_bytes);
+  scratch_buf_release((unsigned char*)best_penalty_bytes);
 
   if (anything_was_used)
     rescue_anything_was_used = true;
@@ -7988,7 +9902,7 @@ recursion_result recursion_compress(long long compressed_bytes, long long decomp
   }
 
   if (!tmp_r.success) {
-    remove(tmp_r.file_name);
+    close_temp_file(tmp_r.file_name);
     delete[] tmp_r.file_name;
     tmp_r.file_name = NULL;
   } else {
@@ -8005,6 +9919,70 @@ recursion_result recursion_write_file_and_compress(const recompress_deflate_resu
   return r;
 }
 
+// everything a recursion pass changes outside of the recursion stack
+struct statistics_var {
+  void* var;
+  size_t size;
+};
+#define STATISTICS_VAR(v) { &v, sizeof(v) }
+const statistics_var statistics_vars[] = {
+  STATISTICS_VAR(recompressed_streams_count), STATISTICS_VAR(recompressed_pdf_count),
+  STATISTICS_VAR(recompressed_pdf_count_8_bit), STATISTICS_VAR(recompressed_pdf_count_24_bit),
+  STATISTICS_VAR(recompressed_zip_count), STATISTICS_VAR(recompressed_gzip_count),
+  STATISTICS_VAR(recompressed_png_count), STATISTICS_VAR(recompressed_png_multi_count),
+  STATISTICS_VAR(recompressed_gif_count), STATISTICS_VAR(recompressed_jpg_count),
+  STATISTICS_VAR(recompressed_jpg_prog_count), STATISTICS_VAR(recompressed_mp3_count),
+  STATISTICS_VAR(recompressed_swf_count), STATISTICS_VAR(recompressed_base64_count),
+  STATISTICS_VAR(recompressed_bzip2_count), STATISTICS_VAR(recompressed_zlib_count),
+  STATISTICS_VAR(recompressed_brute_count),
+  STATISTICS_VAR(decompressed_streams_count), STATISTICS_VAR(decompressed_pdf_count),
+  STATISTICS_VAR(decompressed_pdf_count_8_bit), STATISTICS_VAR(decompressed_pdf_count_24_bit),
+  STATISTICS_VAR(decompressed_zip_count), STATISTICS_VAR(decompressed_gzip_count),
+  STATISTICS_VAR(decompressed_png_count), STATISTICS_VAR(decompressed_png_multi_count),
+  STATISTICS_VAR(decompressed_gif_count), STATISTICS_VAR(decompressed_jpg_count),
+  STATISTICS_VAR(decompressed_jpg_prog_count), STATISTICS_VAR(decompressed_mp3_count),
+  STATISTICS_VAR(decompressed_swf_count), STATISTICS_VAR(decompressed_base64_count),
+  STATISTICS_VAR(decompressed_bzip2_count), STATISTICS_VAR(decompressed_zlib_count),
+  STATISTICS_VAR(decompressed_brute_count),
+  STATISTICS_VAR(anything_was_used), STATISTICS_VAR(non_zlib_was_used),
+  STATISTICS_VAR(max_recursion_depth_used), STATISTICS_VAR(max_recursion_depth_reached)
+};
+#undef STATISTICS_VAR
+
+void statistics_save(std::vector<unsigned char>& saved) {
+  saved.clear();
+  for (const statistics_var& s : statistics_vars) {
+    saved.insert(saved.end(), (unsigned char*)s.var, (unsigned char*)s.var + s.size);
+  }
+}
+
+void statistics_restore(const std::vector<unsigned char>& saved) {
+  size_t pos = 0;
+  for (const statistics_var& s : statistics_vars) {
+    memcpy(s.var, saved.data() + pos, s.size);
+    pos += s.size;
+  }
+}
+
+recursion_result recursion_write_file_and_compress_verified(recompress_deflate_result& rdres, preflate_verification& verification) {
+  std::vector<unsigned char> saved_statistics;
+  statistics_save(saved_statistics);
+
+  recursion_result r = recursion_write_file_and_compress(rdres);
+
+  if (!preflate_verification_finish(verification)) {
+    rdres.accepted = false;
+    statistics_restore(saved_statistics);
+    if (r.success) {
+      close_temp_file(r.file_name);
+      delete[] r.file_name;
+      r.file_name = NULL;
+      r.success = false;
+    }
+  }
+  return r;
+}
+
 recursion_result recursion_decompress(long long recursion_data_length) {
   FILE* recursion_fin;
   FILE* recursion_fout;
@@ -8012,7 +9990,7 @@ recursion_result recursion_decompress(long long recursion_data_length) {
 
   recursion_push();
 
-  remove(tempfile1);
+  remove_temp_file(tempfile1);
   recursion_fin = tryOpen(tempfile1,"wb");
 
   fast_copy(fin, recursion_fin, recursion_data_length);
@@ -8028,18 +10006,15 @@ recursion_result recursion_decompress(long long recursion_data_length) {
   }
   input_file_name = new char[strlen(tempfile1)+1];
   strcpy(input_file_name, tempfile1);
-  output_file_name = new char[strlen(tempfile1)+2];
-  strcpy(output_file_name, tempfile1);
-  output_file_name[strlen(tempfile1)] = '_';
-  output_file_name[strlen(tempfile1) + 1] = 0;
-  tmp_r.file_name = new char[strlen(tempfile1)+2];
+  output_file_name = new_recursion_temp_file_name();
+  tmp_r.file_name = new char[strlen(output_file_name)+1];
   strcpy(tmp_r.file_name, output_file_name);
   recursion_fout = tryOpen(output_file_name,"wb");
   fout = recursion_fout;
 
-  penalty_bytes = new char[MAX_PENALTY_BYTES];
-  local_penalty_bytes = new char[MAX_PENALTY_BYTES];
-  best_penalty_bytes = new char[MAX_PENALTY_BYTES];
+  penalty_bytes = (char*)scratch_buf_get(MAX_PENALTY_BYTES);
+  local_penalty_bytes = (char*)scratch_buf_get(MAX_PENALTY_BYTES);
+  best_penalty_bytes = (char*)scratch_buf_get(MAX_PENALTY_BYTES);
 
   // disable compression-on-the-fly in recursion - we don't want compressed compressed streams
   compression_otf_method = OTF_NONE;
@@ -8052,9 +10027,9 @@ recursion_result recursion_decompress(long long recursion_data_length) {
 
   delete[] input_file_name;
   delete[] output_file_name;
-  delete[] penalty_bytes;
-  delete[] local_penalty_bytes;
-  delete[] best_penalty_bytes;
+  scratch_buf_release((unsigned char*)penalty_bytes);
+  scratch_buf_release((unsigned char*)local_penalty_bytes);
+  scratch_buf_release((unsigned char*)best_penalty_bytes);
 
   recursion_depth--;
   recursion_pop();
@@ -8201,7 +10176,7 @@ void fout_fput_deflate_rec(const unsigned char type,
   if (recres.success) {
     fout_fput_vlint(recres.file_length);
     write_decompressed_data(recres.file_length, recres.file_name);
-    remove(recres.file_name);
+    close_temp_file(recres.file_name);
     delete[] recres.file_name;
   } else {
     fout_fput_uncompressed(rdres);
@@ -8223,7 +10198,7 @@ bool fin_fget_deflate_rec(recompress_deflate_result& rdres, const unsigned char
     bool result = try_reconstructing_deflate(r.frecurse, fout, rdres);
     debug_pos();
     safe_fclose(&r.frecurse);
-    remove(r.file_name);
+    close_temp_file(r.file_name);
     delete[] r.file_name;
     return result;
   } else {
@@ -8294,6 +10269,10 @@ void init_compress_otf() {
       uint64_t max_memory = compression_otf_max_memory * 1024 * 1024LL;
       int threads = compression_otf_thread_count;
 
+      if ((max_memory == 0) && (memory_budget > 0)) {
+        // LZMA gets half of the global memory budget, the rest is left for precompression
+        max_memory = std::max(memory_budget / 2, 16u) * 1024 * 1024LL;
+      }
       if (max_memory == 0) {
         max_memory = lzma_max_memory_default() * 1024 * 1024LL;
       }
@@ -8445,6 +10424,129 @@ void safe_fclose(FILE** f) {
   *f = NULL;
 }
 
+// a stream inside another one gets the same budget, but never more than the outer one has left
+void stream_time_start() {
+  stream_deadline = get_time_ms() + stream_time_budget;
+  if ((outer_stream_deadline != 0) && (outer_stream_deadline < stream_deadline)) {
+    stream_deadline = outer_stream_deadline;
+  }
+  stream_time_exceeded_reported = false;
+}
+
+// check if the stream that is currently precompressed took too long, restoring is never limited
+bool stream_time_exceeded() {
+  if ((stream_time_budget == 0) || (comp_decomp_state != P_COMPRESS)) return false;
+  if (get_time_ms() <= stream_deadline) return false;
+  if ((DEBUG_MODE) && (!stream_time_exceeded_reported)) {
+    printf("Stream time budget exceeded, skipping stream\n");
+  }
+  stream_time_exceeded_reported = true;
+  return true;
+}
+
+int scratch_pool_size_class(size_t size) {
+  int size_class = 0;
+  size_t class_size = SCRATCH_POOL_MIN_SIZE;
+  while (class_size < size) {
+    class_size <<= 1;
+    size_class++;
+  }
+  return size_class;
+}
+
+// get a buffer of at least size bytes, reusing a released one of the same size class if possible
+unsigned char* scratch_buf_get(size_t size) {
+  std::lock_guard<std::mutex> lock(scratch_pool_mutex);
+  int size_class = scratch_pool_size_class(size);
+  unsigned char* buf;
+  if (size_class >= SCRATCH_POOL_CLASSES) { // too large to be pooled
+    buf = new unsigned char[size];
+    memory_budget_used += size;
+    scratch_pool_used[buf] = -1;
+    scratch_pool_unpooled_size[buf] = size;
+    return buf;
+  }
+  if (!scratch_pool_free[size_class].empty()) {
+    buf = scratch_pool_free[size_class].back();
+    scratch_pool_free[size_class].pop_back();
+  } else {
+    buf = new unsigned char[(size_t)SCRATCH_POOL_MIN_SIZE << size_class];
+    memory_budget_used += (size_t)SCRATCH_POOL_MIN_SIZE << size_class;
+  }
+  scratch_pool_used[buf] = size_class;
+  return buf;
+}
+
+void scratch_buf_release(unsigned char* buf) {
+  if (buf == NULL) return;
+  std::lock_guard<std::mutex> lock(scratch_pool_mutex);
+  std::map<unsigned char*, int>::iterator it = scratch_pool_used.find(buf);
+  if (it == scratch_pool_used.end()) return;
+  int size_class = it->second;
+  scratch_pool_used.erase(it);
+  if (size_class < 0) {
+    memory_budget_used -= scratch_pool_unpooled_size[buf];
+    scratch_pool_unpooled_size.erase(buf);
+    delete[] buf;
+  } else if ((memory_budget > 0) && (memory_budget_used > memory_budget * 1024LL * 1024)) {
+    // over budget, don't keep the buffer around
+    memory_budget_used -= (size_t)SCRATCH_POOL_MIN_SIZE << size_class;
+    delete[] buf;
+  } else {
+    scratch_pool_free[size_class].push_back(buf);
+  }
+}
+
+void scratch_pool_clear() {
+  std::lock_guard<std::mutex> lock(scratch_pool_mutex);
+  for (int i = 0; i < SCRATCH_POOL_CLASSES; i++) {
+    for (size_t j = 0; j < scratch_pool_free[i].size(); j++) {
+      delete[] scratch_pool_free[i][j];
+      memory_budget_used -= (size_t)SCRATCH_POOL_MIN_SIZE << i;
+    }
+    scratch_pool_free[i].clear();
+  }
+}
+
+// bytes of the global memory budget that are not allocated yet
+long long memory_budget_available() {
+  std::lock_guard<std::mutex> lock(scratch_pool_mutex);
+  long long available = memory_budget * 1024LL * 1024 - memory_budget_used;
+  return (available > 0) ? available : 0;
+}
+
+// memory that isn't allocated through the scratch pool, but still counts against the budget
+// (negative size to give it back)
+void memory_budget_charge(long long size) {
+  std::lock_guard<std::mutex> lock(scratch_pool_mutex);
+  memory_budget_used += size;
+}
+
+// decide if a stream of the given size can be processed in memory,
+// mem_factor is the estimated memory needed per stream byte
+bool memory_budget_allows(long long size, long long fixed_limit, int mem_factor) {
+  if (memory_budget == 0) return (size <= fixed_limit);
+  return (size * mem_factor <= memory_budget_available());
+}
+
+// size of the in-memory buffer for decompressed streams, 1/16 of the budget
+// (but at most half of what's still available) in the range 1 MiB .. 1 GiB
+long long io_buffer_size_for_budget() {
+  if (memory_budget == 0) return MAX_IO_BUFFER_SIZE;
+  long long size = memory_budget * 1024LL * 1024 / 16;
+  size = std::min(size, memory_budget_available() / 2);
+  size = std::max(size, 1024LL * 1024);
+  size = std::min(size, 1024LL * 1024 * 1024);
+  return size;
+}
+
+void init_memory_budget() {
+  if (memory_budget == 0) return;
+  // limit the data queued for parallel preflate tasks to 1/8 of the budget,
+  // this determines how many worker threads can be busy at the same time
+  globalTaskPool.setQueueMemoryLimit(std::max(memory_budget * 1024LL * 1024 / 8, 1024LL * 1024));
+}
+
 void print_work_sign(bool with_backspace) {
   if (!DEBUG_MODE) {
     if ((get_time_ms() - work_sign_start_time) >= 250) {
@@ -8501,8 +10603,9 @@ void ctrl_c_handler(int sig) {
   if (tempfilelist_count > 0) {
     printf("Removing temporary files...\n");
     for (int i = 0; i < tempfilelist_count; i++) {
-      if ((tempfilelist[i * 20]) == '~') { // just to be safe
-        remove(tempfilelist + i * 20);
+      char* tempfile_name = tempfilelist + i * TEMPFILE_NAME_SIZE;
+      if (strstr(tempfile_name, "~temp") != NULL) { // just to be safe
+        remove(tempfile_name);
       }
     }
   }
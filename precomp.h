@@ -25,6 +25,7 @@ void write_decompressed_data_io_buf(long long byte_count, bool in_memory, char*
 unsigned long long compare_files(FILE* file1, FILE* file2, unsigned int pos1, unsigned int pos2);
 long long compare_file_mem_penalty(FILE* file1, unsigned char* input_bytes2, long long pos1, long long bytecount, long long& total_same_byte_count, long long& total_same_byte_count_penalty, long long& rek_same_byte_count, long long& rek_same_byte_count_penalty, long long& rek_penalty_bytes_len, long long& local_penalty_bytes_len, bool& use_penalty_bytes);
 long long compare_files_penalty(FILE* file1, FILE* file2, long long pos1, long long pos2);
+long long compare_mem_penalty(FILE* file1, const unsigned char* mem, long long mem_size, long long pos1);
 void start_uncompressed_data();
 void end_uncompressed_data();
 void try_decompression_pdf(int windowbits, int pdf_header_length, int img_width, int img_height, int img_bpc);
@@ -34,6 +35,25 @@ void try_decompression_png(int windowbits);
 void try_decompression_png_multi(FILE* fpng, int windowbits);
 void try_decompression_gif(unsigned char version[5]);
 void try_decompression_jpg(long long jpg_length, bool progressive_jpg);
+long long jpg_mjpeg_dht_pos(const unsigned char* data, long long length);
+unsigned char* jpg_insert_mjpeg_dht(unsigned char* buf, long long dht_pos);
+unsigned char* jpg_remove_mjpeg_dht(unsigned char* buf, long long dht_pos);
+int brunsli_output_hook(void* data, const uint8_t* buf, size_t len);
+bool brunsli_compress_jpg(const brunsli::JPEGData& jpegData, long long jpg_length, std::vector<unsigned char>& out);
+int jpg_restore_sink_write(void* data, const uint8_t* buf, size_t count);
+struct jpg_recompression;
+struct jpg_batch_frame;
+void jpg_recompress_in_memory(unsigned char* jpg_mem_in, long long jpg_length, jpg_recompression& r);
+bool jpg_batch_enabled();
+std::shared_ptr<jpg_batch_frame> jpg_batch_take(long long pos, long long length, bool progressive);
+void jpg_batch_start(long long pos);
+void mp3_parse_frames(long long pos, int& type, int& n, long long& mp3_length);
+struct mp3_recompression;
+struct mp3_batch_stream;
+void mp3_recompress_in_memory(unsigned char* mp3_mem_in, long long mp3_length, mp3_recompression& r);
+bool mp3_batch_enabled();
+std::shared_ptr<mp3_batch_stream> mp3_batch_take(long long pos, long long length);
+void mp3_batch_start(long long pos);
 void try_decompression_mp3(long long mp3_length);
 void try_decompression_zlib(int windowbits);
 void try_decompression_brute();
@@ -45,13 +65,64 @@ void try_decompression_base64(int gzip_header_length);
 
 void init_decompression_variables();
 unsigned char base64_char_decode(unsigned char c);
-void base64_reencode(FILE* file_in, FILE* file_out, int line_count, unsigned int* base64_line_len, long long max_in_count = 0x7FFFFFFFFFFFFFFF, long long max_byte_count = 0x7FFFFFFFFFFFFFFF);
+// Base64 line lengths, consecutive lines of the same length form one run
+struct base64_line_run {
+  unsigned int length;
+  long long count;
+};
+size_t base64_scan_bytewise(const unsigned char* buf, size_t len);
+void base64_decode_bytewise(const unsigned char* chars, size_t groups, unsigned char* out);
+void base64_encode_bytewise(const unsigned char* bytes, size_t groups, unsigned char* chars);
+void base64_line_add(std::vector<base64_line_run>& line_lengths, unsigned int length);
+void base64_reencode(FILE* file_in, FILE* file_out, const std::vector<base64_line_run>& line_lengths, long long max_in_count = 0x7FFFFFFFFFFFFFFF, long long max_byte_count = 0x7FFFFFFFFFFFFFFF);
 
 void packjpg_mp3_dll_msg();
 bool is_valid_mp3_frame(unsigned char* frame_data, unsigned char header2, unsigned char header3, int protection);
 inline unsigned short mp3_calc_layer3_crc(unsigned char header2, unsigned char header3, unsigned char* sideinfo, int sidesize);
-bool recompress_gif(FILE* srcfile, FILE* dstfile, unsigned char block_size, GifCodeStruct* g, GifDiffStruct* gd);
-bool decompress_gif(FILE* srcfile, FILE* dstfile, long long src_pos, int& gif_length, int& decomp_length, unsigned char& block_size, GifCodeStruct* g);
+
+// Source or destination of decompress_gif and recompress_gif, either a file or a memory buffer.
+// Memory buffers are moved to the file spill_name when they get too large. The gif_io is passed
+// to giflib as user data.
+struct gif_io {
+  FILE* file;
+  std::vector<unsigned char>* mem;
+  long long mem_pos;
+  char* spill_name;
+  long long charged; // capacity of mem charged to the memory budget, only if it can be spilled
+  bool may_write; // giflib output is only written while image data is encoded
+};
+
+gif_io gif_io_file(FILE* file);
+gif_io gif_io_mem(std::vector<unsigned char>* mem, char* spill_name);
+long long gif_io_tell(gif_io* io);
+void gif_io_seek(gif_io* io, long long pos);
+size_t gif_io_read(gif_io* io, unsigned char* buf, size_t count);
+bool gif_io_reserve(gif_io* io, long long end);
+void gif_io_spill(gif_io* io);
+size_t gif_io_write(gif_io* io, const unsigned char* buf, size_t count);
+void gif_io_copy(gif_io* src, gif_io* dst, long long bytecount);
+void gif_io_put_signature(gif_io* io, unsigned char c1, unsigned char c2);
+void gif_io_close(gif_io* io);
+long long gif_io_compare_penalty(gif_io* io, long long pos);
+struct gif_frame;
+struct gif_frame_encoding;
+bool gif_frames_ahead_enabled(gif_io* src);
+bool gif_put_frame(GifFileType* newGifFile, gif_io* dst, const gif_frame& frame, unsigned char** lines, GifCodeStruct* g, GifDiffStruct* gd);
+void gif_frame_encode_ahead(GifFileType* myGifFile, const gif_frame* frame, const unsigned char* pixels, unsigned char block_size, GifCodeStruct frame_g, bool compressing, gif_frame_encoding* r);
+void gif_frame_start_ahead(GifFileType* myGifFile, gif_frame& frame, gif_io* src, unsigned char block_size, GifCodeStruct* g);
+void gif_diff_append(GifDiffStruct* gd, GifDiffStruct* frame_gd, int pos_offset);
+int gif_diff_next_pos(GifDiffStruct* gd);
+bool gif_frame_take_ahead(gif_frame& frame, gif_io* dst, GifCodeStruct* g, GifDiffStruct* gd);
+bool recompress_gif(gif_io* src, gif_io* dst, unsigned char block_size, GifCodeStruct* g, GifDiffStruct* gd, const std::vector<int>* frame_code_starts, bool frames_ahead);
+bool decompress_gif(gif_io* src, gif_io* dst, long long src_pos, int& gif_length, long long& decomp_length, unsigned char& block_size, GifCodeStruct* g, std::vector<int>* frame_code_starts);
+struct gif_recompression;
+struct gif_batch_stream;
+void gif_recompress_in_memory(std::vector<unsigned char>* data, gif_recompression& r);
+bool gif_batch_enabled();
+bool gif_header_found(const unsigned char* buf);
+bool gif_batch_read(long long pos, long long max_size, std::vector<unsigned char>& data, long long& pixel_count);
+std::shared_ptr<gif_batch_stream> gif_batch_take(long long pos);
+void gif_batch_start(long long pos);
 void sort_comp_mem_levels();
 void show_used_levels();
 bool compress_file(float min_percent = 0, float max_percent = 100);
@@ -81,10 +152,38 @@ FILE* tryOpen(const char* filename, const char* mode);
 long long fileSize64(char* filename);
 void print64(long long i64);
 void init_temp_files();
+void update_temp_file_list();
+void set_temp_dir(const char* dir);
+bool is_anonymous_temp_file(const char* filename);
+void remove_temp_file(char* filename);
+void close_temp_file(char* filename);
+char* new_recursion_temp_file_name();
 long long get_time_ms();
 void printf_time(long long t);
 char get_char_with_echo();
 void safe_fclose(FILE** f);
+void stream_time_start();
+bool stream_time_exceeded();
+bool jpg_header_found(const unsigned char* buf);
+long long jpg_stream_length(long long start, unsigned char first_marker, bool& progressive_flag);
+bool jpg_marker_continues_scan(unsigned char c, bool progressive);
+size_t jpg_scan_bytewise(const unsigned char* buf, size_t len, bool progressive);
+bool jpg_scan_entropy_data(const unsigned char* buf, size_t len, bool progressive, bool& is_marker, bool& eoi, size_t& consumed);
+size_t jpg_scan_reference(const unsigned char* buf, size_t len, bool progressive, bool& eoi);
+bool jpg_scan_self_test();
+struct base64_kernel_set;
+std::vector<base64_kernel_set> base64_kernel_sets();
+bool base64_self_test();
+bool base64_lines_self_test();
+bool kernel_self_tests();
+unsigned char* scratch_buf_get(size_t size);
+void scratch_buf_release(unsigned char* buf);
+void scratch_pool_clear();
+long long memory_budget_available();
+bool memory_budget_allows(long long size, long long fixed_limit, int mem_factor);
+void memory_budget_charge(long long size);
+long long io_buffer_size_for_budget();
+void init_memory_budget();
 void print_work_sign(bool with_backspace);
 void print_debug_percent();
 void show_progress(float percent, bool use_backspaces, bool check_time);
@@ -129,11 +228,13 @@ public:
   }
 };
 struct recompress_deflate_result;
+struct preflate_verification;
 
 void write_ftempout_if_not_present(long long byte_count, bool in_memory, bool leave_open = false);
 recursion_result recursion_compress(long long compressed_bytes, long long decompressed_bytes, bool deflate_type = false, bool in_memory = true);
 recursion_result recursion_decompress(long long recursion_data_length);
 recursion_result recursion_write_file_and_compress(const recompress_deflate_result&);
+recursion_result recursion_write_file_and_compress_verified(recompress_deflate_result&, preflate_verification&);
 
 // compression-on-the-fly
 enum {OTF_NONE = 0, OTF_BZIP2 = 1, OTF_XZ_MT = 2}; // uncompressed, bzip2, lzma2 multithreaded
@@ -6,6 +6,7 @@ class Switches {
     int compression_method;        //compression method to use (default: none)
     unsigned int compression_otf_max_memory;    // max. memory for LZMA compression method (default: 2 GiB)
     unsigned int compression_otf_thread_count;  // max. thread count for LZMA compression method (default: auto-detect)
+    unsigned int memory_budget;    // global memory budget in MiB, 0 = fixed limits per stream type (default: 0)
 
     //byte positions to ignore (default: none)
     long long* ignore_list;
@@ -29,6 +30,7 @@ class Switches {
     bool debug_mode;               //debug mode (default: off)
 
     unsigned int min_ident_size;   //minimal identical bytes (default: 4)
+    unsigned int stream_time_budget; //skip streams that take longer (in ms) to precompress (default: 0 = off)
 
     //(p)recompression types to use (default: all)
     bool use_pdf;
@@ -54,6 +56,7 @@ Switches::Switches() {
   if (compression_otf_thread_count == 0) {
     compression_otf_thread_count = 2;
   }
+  memory_budget = 0;
 
   ignore_list = NULL;
   ignore_list_len = 0;
@@ -68,6 +71,7 @@ Switches::Switches() {
   use_packjpg_fallback = true;
   debug_mode = false;
   min_ident_size = 4;
+  stream_time_budget = 0;
   
   use_pdf = true;
   use_zip = true;